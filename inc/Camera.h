@@ -1,24 +1,73 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <array>
 #include <vector>
+#include <chrono>
+#include <unordered_map>
 
 #include "RTGeometry.h"
 #include "RTObjects.h"
+#include "RTTileScheduler.h"
+#include "RTSampler.h"
+#include "RTDenoiser.h"
 class SceneManager;
 
 struct RTPixelColor {
     uint8_t r, g, b, a;
 };
 
+enum class RTIntegrator {
+    Branching,    // samplesPerScatter child rays at every bounce
+    Path,         // one path per sample, samplesPerScatter is ignored
+    Wavefront,    // Path estimate traced breadth-first per tile, hits shaded in batches per material
+};
+
+// Per-pixel outputs besides the color, captured from the camera rays of the render itself
+enum class RTAov : uint8_t {
+    Depth,          // 1 channel: mean distance to the first hit, misses count as 0
+    Normal,         // 3 channels: mean first-hit normal, facing the camera, not renormalized
+    Albedo,         // 3 channels: mean first-hit albedo, the background color for misses
+    MaterialId,     // 1 channel: material table row hit by the pixel's first sample, -1 for a miss
+    PrimitiveId,    // 1 channel: index in SceneManager::primitives() hit by the pixel's first sample, -1 for a miss
+    SampleCount,    // 1 channel: samples accumulated in the pixel
+};
+
+constexpr int RT_AOV_COUNT = 6;
+
+constexpr int aovChannels(RTAov aov) {
+    return (aov == RTAov::Normal || aov == RTAov::Albedo) ? 3 : 1;
+}
+
 struct CameraRenderProperties {
     int samplesPerPixel;
     int samplesPerScatter;    
     int maxRayDepth;       
-    int threadPixelbunchSize; 
+    int threadPixelbunchSize;   // pixels per render tile; tile width is rounded up to primaryPacketSize
+    int primaryPacketSize;      // 4, 8 or 16 primary rays traced together; anything else traces them one by one
     bool enableParallelRender;  
     bool enableLDirect;         
     bool enableRayTracerMode;   
+    RTIntegrator integrator;
+    bool enableAccumulation;    // render() adds samplesPerPixel samples to the running mean of earlier frames
+    double noiseThreshold;      // > 0 enables adaptive sampling: a pixel stops once its luminance standard error
+                                // is below this fraction of its mean
+    int maxSamplesPerPixel;     // adaptive sampling budget of one pixel in one render() call
+    bool enableRussianRoulette; // Path and Wavefront integrators randomly end dim paths, unbiased
+    int rouletteMinDepth;       // bounces every path takes before roulette applies
+    int lightSamples;           // > 0: lights picked from the scene light tree per shading point, 0: every light
+    bool enableAreaLights;      // Path and Wavefront integrators sample emissive objects with shadow rays (MIS)
+    RTSamplerType samplerType;  // Sobol and BlueNoise spread the samples of a pixel evenly over every sampled dimension
+    bool enableDenoiser;        // filters the displayed image, guided by the albedo, normal and depth of the first hits
+    int denoiserIterations;     // à-trous passes, the filter reaches about 2^(iterations + 1) pixels
+};
+
+struct RenderStats {
+    long long samples              = 0;
+    long long pathRays             = 0;    // camera and bounce rays
+    long long shadowRays           = 0;
+    long long rouletteTerminations = 0;
+    double    renderMs             = 0.0;
 };
 
 struct Viewport {
@@ -40,9 +89,21 @@ public:
         .samplesPerScatter      = 3,
         .maxRayDepth            = 10,
         .threadPixelbunchSize   = 64,
+        .primaryPacketSize      = 8,
         .enableParallelRender   = true,
         .enableLDirect          = true,
         .enableRayTracerMode    = true,
+        .integrator             = RTIntegrator::Branching,
+        .enableAccumulation     = false,
+        .noiseThreshold         = 0.0,
+        .maxSamplesPerPixel     = 64,
+        .enableRussianRoulette  = false,
+        .rouletteMinDepth       = 3,
+        .lightSamples           = 0,
+        .enableAreaLights       = false,
+        .samplerType            = RTSamplerType::Random,
+        .enableDenoiser         = false,
+        .denoiserIterations     = 5,
     };
 private:
     static constexpr const double FOCAL_LENGTH = 1;
@@ -52,6 +113,38 @@ private:
 
     Viewport viewPort_  = {};
 
+    // Per-pixel sums of every sample since the last reset, the displayed image is their mean
+    std::vector<RTColor> accumulation_;
+    std::vector<double>  luminanceSquares_;
+    std::vector<int>     sampleCounts_;
+    // First hits of the camera rays: albedo, normal and depth summed like accumulation_, the ids of the
+    // first sample. Each is empty unless the denoiser or a registered AOV reads it.
+    std::vector<RTColor>    firstHitAlbedo_;
+    std::vector<gm::IVec3f> firstHitNormal_;
+    std::vector<double>     firstHitDepth_;
+    std::vector<int>        firstHitMaterials_;
+    std::vector<int>        firstHitPrimitives_;
+    std::unordered_map<const Primitives *, int> primitiveIds_;
+    RTDenoiser denoiser_;
+    // Caller buffers of the registered AOVs by RTAov, written by finishPass
+    std::array<std::vector<float> *, RT_AOV_COUNT> aovBuffers_ = {};
+    int accumulatedPasses_  = 0;
+    double averageSamplesPerPixel_ = 0.0;
+
+    // Per-thread counters of the current pass, summed into renderStats_ when it finishes
+    struct alignas(64) RenderCounters {
+        long long pathRays             = 0;
+        long long shadowRays           = 0;
+        long long rouletteTerminations = 0;
+    };
+    mutable std::vector<RenderCounters> threadCounters_;
+    std::chrono::steady_clock::time_point passStart_;
+    RenderStats renderStats_;
+    std::pair<int, int> accumulationResolution_ = {0, 0};
+    const SceneManager *accumulationScene_ = nullptr;
+    uint64_t accumulationSceneRevision_ = 0;
+    CameraRenderProperties accumulationProperties_ = {};
+
 public:
   // Constructors
     Camera();
@@ -61,6 +154,21 @@ public:
     void move(const gm::IVec3f motionVec);
 
   // Render
+    // Restarts progressive accumulation. Camera and scene edits do this automatically,
+    // material and light edits made through raw pointers need an explicit call.
+    void resetAccumulation();
+    int accumulatedPasses() const { return accumulatedPasses_; }
+    double averageSamplesPerPixel() const { return averageSamplesPerPixel_; }
+    const RenderStats &renderStats() const { return renderStats_; }
+
+    // Samples taken by every pixel since the last reset, and the same as a blue (fewest) to red (most) image
+    const std::vector<int> &sampleCounts() const { return sampleCounts_; }
+    void sampleHeatmap(std::vector<RTPixelColor> &outputBufer) const;
+
+    // Every following render() fills buffer with aov: width * height pixels of aovChannels(aov) floats each,
+    // row by row. nullptr unregisters it. Registering or unregistering restarts accumulation.
+    void setAovBuffer(RTAov aov, std::vector<float> *buffer);
+
     void render
     (
         const SceneManager& sceneManager,
@@ -89,6 +197,24 @@ public:
         const std::pair<int, int> screenResolution
     );
 
+    // Object seen through the center of pixel (pixelX, pixelY), nullptr for the background.
+    // Casts one ray without selection outlines, no render or commit needed.
+    const Primitives *pick
+    (
+        const SceneManager& sceneManager,
+        const int pixelX,
+        const int pixelY,
+        const std::pair<int, int> screenResolution
+    ) const;
+
+    Primitives *pick
+    (
+        SceneManager& sceneManager,
+        const int pixelX,
+        const int pixelY,
+        const std::pair<int, int> screenResolution
+    ) const;
+
   // Getters
     gm::IVec3f direction() const;
     gm::IPoint3 center() const;
@@ -104,20 +230,119 @@ private:
     
 
 // render details
-    Ray genRay(int pixelX, int pixelY, std::pair<int, int> screenResolution);
+    struct WavefrontPath;
+
+    void beginPass(const SceneManager& sceneManager, const std::pair<int, int> screenResolution);
+    void finishPass(std::vector<RTPixelColor> &outputBufer);
+    // Random numbers of one camera sample, keyed by the pixel and the sample's index since the accumulation began
+    RTSampler makeSampler(int pixelX, int pixelY, int sample) const;
+
+    void addSample(int pixelId, const RTColor &color);
+    // Records the first hit of a camera sample for the denoiser and the AOVs, rec is nullptr for a miss
+    void addFirstHit(int pixelId, const Ray &ray, const HitRecord *rec, const SceneManager& sceneManager);
+    void resetFirstHits(const SceneManager& sceneManager, size_t pixelCount);
+    RTColor firstHitAlbedo(const HitRecord &rec, const SceneManager& sceneManager) const;
+    void filterAccumulation();
+    void writeAovs(size_t pixelCount);
+    bool pixelConverged(int pixelId) const;
+    bool pixelNeedsSample(int pixelId, int passSamples) const;
+
+    RenderCounters &counters() const;
+    bool survivesRoulette(int bounce, RTColor &throughput, RTSampler &sampler) const;
+
+    // Adds the samples of `count` consecutive pixels of one row, using primary ray packets when enabled
+    void renderPixelSpan
+    (
+        const SceneManager& sceneManager,
+        const int firstPixelId,
+        const int count,
+        const std::pair<int, int> screenResolution
+    );
+
+    Ray genRay(int pixelX, int pixelY, std::pair<int, int> screenResolution, RTSampler &sampler) const;
+    // Ray through the viewport point at fractional pixel coordinates (x, y)
+    Ray rayThrough(double x, double y, std::pair<int, int> screenResolution) const;
     
     RTColor getRayColor
     (
         const Ray& ray, 
         const int depth, 
-        const SceneManager& sceneManager
+        const SceneManager& sceneManager,
+        RTSampler &sampler
+    ) const;
+
+    RTColor getHitColor
+    (
+        const Ray& ray,
+        const HitRecord &rec,
+        const int depth,
+        const SceneManager& sceneManager,
+        RTSampler &sampler
     ) const;
 
+    RTColor getBackgroundColor(const Ray& ray) const;
+
+    RTColor getSampleColor
+    (
+        const Ray& ray,
+        const SceneManager& sceneManager,
+        RTSampler &sampler
+    ) const;
+
+    // Color of a camera ray that hit rec, traced by the configured integrator
+    RTColor getPrimaryHitColor
+    (
+        const Ray& ray,
+        const HitRecord &rec,
+        const SceneManager& sceneManager,
+        RTSampler &sampler
+    ) const;
+
+    RTColor getPathColor
+    (
+        const Ray& ray,
+        const SceneManager& sceneManager,
+        RTSampler &sampler
+    ) const;
+
+    RTColor getPathHitColor
+    (
+        const Ray& ray,
+        const HitRecord &rec,
+        const SceneManager& sceneManager,
+        RTSampler &sampler
+    ) const;
+
+    void renderTileWavefront
+    (
+        const SceneManager& sceneManager,
+        const RenderTile &tile,
+        const std::pair<int, int> screenResolution
+    );
+
+    void traceWavefront
+    (
+        const SceneManager& sceneManager,
+        std::vector<WavefrontPath> &queue,
+        std::vector<RTColor> &sampleColors,
+        const std::vector<int> &samplePixels
+    );
+
+    template <int N>
+    void renderPixelPacket
+    (
+        const SceneManager& sceneManager,
+        const int firstPixelId,
+        const int count,
+        const std::pair<int, int> screenResolution
+    );
+
 // ray color details
     gm::IVec3f computeDirectLighting
     (
       const HitRecord &rec, 
-      const SceneManager& sceneManager
+      const SceneManager& sceneManager,
+      RTSampler &sampler
     ) const;
 
     gm::IVec3f computeMultipleScatterLInderect
@@ -125,6 +350,35 @@ private:
       const Ray& ray, 
       const HitRecord &hitRecord, 
       const int depth, 
+      const SceneManager& sceneManager,
+      RTSampler &sampler
+    ) const;
+
+    // Next event estimation for area lights: one emissive object sampled towards rec, weighted
+    // against the chance of scattering into it with the power heuristic
+    RTColor sampleAreaLights
+    (
+      const Ray& ray,
+      const HitRecord &rec,
+      const SceneManager& sceneManager,
+      RTSampler &sampler
+    ) const;
+
+    // MIS weight of the emission found at rec by a ray scattered with scatterPdf (0: camera ray or mirror-like bounce)
+    double emissionWeight
+    (
+      const Ray& ray,
+      const HitRecord &rec,
+      double scatterPdf,
+      const SceneManager& sceneManager
+    ) const;
+
+    // Pdf of the scatter from rec into scattered when area lights are sampled, 0 for mirror-like materials
+    double scatterPdf
+    (
+      const Ray& ray,
+      const HitRecord &rec,
+      const Ray& scattered,
       const SceneManager& sceneManager
     ) const;
 };
@@ -0,0 +1,208 @@
+#ifndef RTBVH_H
+#define RTBVH_H
+
+#include <vector>
+
+#include "RTGeometry.h"
+#include "RTPacket.h"
+
+
+class BVHTree {
+public:
+    static constexpr int MAX_LEAF_SIZE = 4;
+    static constexpr int SAH_BIN_COUNT = 12;
+    static constexpr int MAX_DEPTH     = 64;
+
+    static constexpr double TRAVERSAL_COST    = 1.0;
+    static constexpr double INTERSECTION_COST = 1.0;
+
+    // A refitted subtree whose surface area grew past this factor is rebuilt from its slots
+    static constexpr double REBUILD_AREA_RATIO = 2.0;
+
+    struct Node {
+        AABB box;
+        int  left   = -1;
+        int  right  = -1;
+        int  parent = -1;
+        int  first  = 0;
+        int  count  = 0;
+        double buildArea = 0.0;
+
+        bool isLeaf() const { return left < 0; }
+    };
+
+public:
+    BVHTree() = default;
+
+    // Builds the tree over `bounds`. On return order[slot] is the index of the item placed in that slot,
+    // leaves reference contiguous slot ranges [first, first + count).
+    void build(const std::vector<AABB> &bounds, std::vector<int> &order);
+    void clear();
+
+    // Takes over a tree saved from nodes() over slotCount slots, e.g. from a scene file.
+    // Returns false and stays empty unless the nodes form one tree rooted at 0, no deeper than MAX_DEPTH,
+    // whose leaves cover every slot exactly once.
+    bool assign(std::vector<Node> nodes, int slotCount);
+
+    // Recomputes boxes above the given slots from slotBounds (indexed by slot).
+    // Fills degraded with the topmost nodes whose area outgrew REBUILD_AREA_RATIO.
+    void refit(const std::vector<int> &slots, const std::vector<AABB> &slotBounds, std::vector<int> &degraded);
+
+    // Rebuilds the subtree under nodeId in place. Its slot range is reordered:
+    // new slot (first + i) holds the item previously in slot (first + order[i]).
+    void rebuildSubtree(int nodeId, const std::vector<AABB> &slotBounds, std::vector<int> &order);
+
+    bool empty() const { return nodes_.empty(); }
+    const std::vector<Node> &nodes() const { return nodes_; }
+    int leafOfSlot(int slot) const { return slotLeaf_[slot]; }
+
+    // Subtree rebuilds leave unreachable nodes behind; the owner should do a full build once this is set
+    bool fragmented() const { return garbageNodes_ > nodes_.size() / 2; }
+
+    // Front-to-back traversal. leaf(first, count, tMax) is called for every reached leaf and may shrink tMax.
+    template <typename LeafFn>
+    void traverse(const Ray &ray, double tMin, double &tMax, LeafFn &&leaf) const;
+
+    // Any-hit traversal without ordering, returns true as soon as leaf(first, count) does
+    template <typename LeafFn>
+    bool traverseAny(const Ray &ray, double tMin, double tMax, LeafFn &&leaf) const;
+
+    // Packet traversal: a node is visited while any lane still reaches it. leaf(first, count) updates packet.tMax.
+    template <int N, typename Real, typename LeafFn>
+    void traversePacket(const RayPacket<N, Real> &packet, LeafFn &&leaf) const;
+
+private:
+    std::vector<Node> nodes_;
+    std::vector<int>  slotLeaf_;
+    size_t garbageNodes_ = 0;
+
+    int buildNode(const std::vector<AABB> &bounds, std::vector<int> &order, int first, int count, int slotOffset, int depth);
+    int nodeDepth(int nodeId) const;
+    size_t subtreeSize(int nodeId) const;
+};
+
+
+template <typename LeafFn>
+void BVHTree::traverse(const Ray &ray, double tMin, double &tMax, LeafFn &&leaf) const {
+    if (nodes_.empty()) return;
+
+    const double origin[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+    const double invDir[3] = { 1.0 / ray.direction.x(), 1.0 / ray.direction.y(), 1.0 / ray.direction.z() };
+
+    struct StackEntry {
+        int node;
+        double tEnter;
+    };
+
+    StackEntry stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+
+    double tEnter = 0.0;
+    if (!nodes_[0].box.hit(origin, invDir, tMin, tMax, tEnter)) return;
+    stack[stackSize++] = {0, tEnter};
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tEnter > tMax) continue;
+
+        const Node &node = nodes_[entry.node];
+        if (node.isLeaf()) {
+            leaf(node.first, node.count, tMax);
+            continue;
+        }
+
+        double tLeft = 0.0, tRight = 0.0;
+        bool hitLeft  = nodes_[node.left].box.hit(origin, invDir, tMin, tMax, tLeft);
+        bool hitRight = nodes_[node.right].box.hit(origin, invDir, tMin, tMax, tRight);
+
+        if (hitLeft && hitRight) {
+            if (tLeft <= tRight) {
+                stack[stackSize++] = {node.right, tRight};
+                stack[stackSize++] = {node.left, tLeft};
+            } else {
+                stack[stackSize++] = {node.left, tLeft};
+                stack[stackSize++] = {node.right, tRight};
+            }
+        } else if (hitLeft) {
+            stack[stackSize++] = {node.left, tLeft};
+        } else if (hitRight) {
+            stack[stackSize++] = {node.right, tRight};
+        }
+    }
+}
+
+template <typename LeafFn>
+bool BVHTree::traverseAny(const Ray &ray, double tMin, double tMax, LeafFn &&leaf) const {
+    if (nodes_.empty()) return false;
+
+    const double origin[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+    const double invDir[3] = { 1.0 / ray.direction.x(), 1.0 / ray.direction.y(), 1.0 / ray.direction.z() };
+
+    int stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    double tEnter = 0.0;
+    while (stackSize > 0) {
+        const Node &node = nodes_[stack[--stackSize]];
+        if (!node.box.hit(origin, invDir, tMin, tMax, tEnter)) continue;
+
+        if (node.isLeaf()) {
+            if (leaf(node.first, node.count)) return true;
+            continue;
+        }
+
+        stack[stackSize++] = node.right;
+        stack[stackSize++] = node.left;
+    }
+    return false;
+}
+
+template <int N, typename Real, typename LeafFn>
+void BVHTree::traversePacket(const RayPacket<N, Real> &packet, LeafFn &&leaf) const {
+    if (nodes_.empty()) return;
+
+    struct StackEntry {
+        int node;
+        Real tEnter;
+    };
+
+    StackEntry stack[MAX_DEPTH + 2];
+    int stackSize = 0;
+
+    Real tEnter = 0;
+    if (!packet.hitBox(nodes_[0].box, tEnter)) return;
+    stack[stackSize++] = {0, tEnter};
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tEnter > packet.farthestTMax()) continue;
+
+        const Node &node = nodes_[entry.node];
+        if (node.isLeaf()) {
+            leaf(node.first, node.count);
+            continue;
+        }
+
+        Real tLeft = 0, tRight = 0;
+        bool hitLeft  = packet.hitBox(nodes_[node.left].box, tLeft);
+        bool hitRight = packet.hitBox(nodes_[node.right].box, tRight);
+
+        if (hitLeft && hitRight) {
+            if (tLeft <= tRight) {
+                stack[stackSize++] = {node.right, tRight};
+                stack[stackSize++] = {node.left, tLeft};
+            } else {
+                stack[stackSize++] = {node.left, tLeft};
+                stack[stackSize++] = {node.right, tRight};
+            }
+        } else if (hitLeft) {
+            stack[stackSize++] = {node.left, tLeft};
+        } else if (hitRight) {
+            stack[stackSize++] = {node.right, tRight};
+        }
+    }
+}
+
+
+#endif // RTBVH_H
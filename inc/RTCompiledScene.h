@@ -0,0 +1,737 @@
+#ifndef RTCOMPILED_SCENE_H
+#define RTCOMPILED_SCENE_H
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <typeinfo>
+
+#include "RTObjects.h"
+#include "RTBvh.h"
+#include "RTPacket.h"
+
+
+// Compiled scene representation: per-type structure-of-arrays storage in BVH slot order,
+// filled from the Primitives authoring objects by SceneManager::commit().
+
+// Leaf box of geometry stored in Real. Rounding to nearest moves every stored coordinate (a center, a
+// radius, a corner) by up to half an ulp of its own magnitude, which can be far larger than the ulp of
+// the box faces, e.g. a big sphere whose side passes the origin. In float each face is moved out by two
+// float ulps of the largest coordinate of its axis: one for the rounding, one for the slab arithmetic.
+template <typename Real>
+AABB storedBounds(const AABB &box) {
+    if (std::is_same<Real, double>::value || box.isEmpty()) return box;
+
+    auto widen = [](const Interval &interval) {
+        double magnitude = std::max(std::fabs(interval.min), std::fabs(interval.max));
+        Real rounded = static_cast<Real>(magnitude);
+        if (rounded < magnitude) rounded = std::nextafter(rounded, std::numeric_limits<Real>::infinity());
+        double ulp = static_cast<double>(std::nextafter(rounded, std::numeric_limits<Real>::infinity())) - rounded;
+        return Interval(interval.min - 2.0 * ulp, interval.max + 2.0 * ulp);
+    };
+    return AABB(widen(box.x), widen(box.y), widen(box.z));
+}
+
+// Material table: small ids for the materials in use and a MaterialRecord per id, the form the
+// shading loops read. Records are copies, refresh() picks up edits made through the material setters.
+class MaterialRegistry {
+    std::vector<const RTMaterial *> materials_;
+    std::vector<MaterialRecord> records_;
+    std::unordered_map<const RTMaterial *, uint32_t> ids_;
+
+public:
+    uint32_t idOf(const RTMaterial *material) {
+        auto it = ids_.find(material);
+        if (it != ids_.end()) return it->second;
+
+        uint32_t id = static_cast<uint32_t>(materials_.size());
+        materials_.push_back(material);
+        records_.push_back(material ? material->record() : MaterialRecord{});
+        ids_.emplace(material, id);
+        return id;
+    }
+
+    // HitRecord::NO_MATERIAL for materials without an id
+    uint32_t find(const RTMaterial *material) const {
+        auto it = ids_.find(material);
+        return it != ids_.end() ? it->second : HitRecord::NO_MATERIAL;
+    }
+
+    const RTMaterial *material(uint32_t id) const { return materials_[id]; }
+
+    // Unknown ids get a Custom record, which shades through the virtual functions
+    const MaterialRecord &record(uint32_t id) const {
+        static const MaterialRecord custom;
+        return id < records_.size() ? records_[id] : custom;
+    }
+
+    size_t size() const { return materials_.size(); }
+
+    void refresh() {
+        for (size_t id = 0; id < materials_.size(); ++id)
+            records_[id] = materials_[id] ? materials_[id]->record() : MaterialRecord{};
+    }
+
+    void clear() {
+        materials_.clear();
+        records_.clear();
+        ids_.clear();
+    }
+};
+
+// Ray data shared by every slot test of one traversal, in the kernel scalar
+template <typename Real>
+struct BasicPreparedRay {
+    Real origin[3];
+    Real direction[3];
+    Real invDirection[3];
+    Real directionLength2;
+    Real tMin;
+
+    // tMin is raised to the SelfHitEpsilon of Real
+    BasicPreparedRay(const Ray &ray, double rayTMin) {
+        const double rayOrigin[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+        const double rayDirection[3] = { ray.direction.x(), ray.direction.y(), ray.direction.z() };
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = static_cast<Real>(rayOrigin[axis]);
+            direction[axis] = static_cast<Real>(rayDirection[axis]);
+            invDirection[axis] = Real(1) / direction[axis];
+        }
+        directionLength2 = direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2];
+
+        double length2 = rayDirection[0] * rayDirection[0] + rayDirection[1] * rayDirection[1] + rayDirection[2] * rayDirection[2];
+        tMin = static_cast<Real>(std::max(rayTMin, SelfHitEpsilon<Real>::minT(rayOrigin, length2)));
+    }
+};
+
+struct HitCandidate {
+    int slot = -1;
+    HitRecord record;
+};
+
+template <typename RealType>
+class BasicSphereStorage {
+public:
+    using Real = RealType;
+
+    std::vector<Real> centerX, centerY, centerZ;
+    std::vector<Real> radius;
+    std::vector<uint32_t> materialId;
+
+    // Exact type: a subclass may override hit() and has to stay a virtual call in the others group
+    static bool accepts(const Primitives *object) { return typeid(*object) == typeid(SphereObject); }
+    static AABB bounds(const AABB &box) { return storedBounds<Real>(box); }
+
+    void resize(size_t size) {
+        centerX.resize(size); centerY.resize(size); centerZ.resize(size);
+        radius.resize(size);
+        materialId.resize(size);
+    }
+
+    void store(int slot, const Primitives *object, uint32_t material) {
+        const SphereObject *sphere = static_cast<const SphereObject *>(object);
+        gm::IPoint3 center = sphere->position();
+        centerX[slot] = static_cast<Real>(center.x());
+        centerY[slot] = static_cast<Real>(center.y());
+        centerZ[slot] = static_cast<Real>(center.z());
+        radius[slot] = static_cast<Real>(sphere->getRadius());
+        materialId[slot] = material;
+    }
+
+    // NaN centers make every discriminant test fail
+    void erase(int slot) {
+        centerX[slot] = centerY[slot] = centerZ[slot] = std::numeric_limits<Real>::quiet_NaN();
+    }
+
+    bool hitRange(const Ray &, const BasicPreparedRay<Real> &ray, int first, int count, Real &tMax, HitCandidate &hit) const {
+        const Real tMin = ray.tMin;
+        bool found = false;
+        for (int slot = first; slot < first + count; ++slot) {
+            Real ocX = ray.origin[0] - centerX[slot];
+            Real ocY = ray.origin[1] - centerY[slot];
+            Real ocZ = ray.origin[2] - centerZ[slot];
+
+            Real halfB = ocX * ray.direction[0] + ocY * ray.direction[1] + ocZ * ray.direction[2];
+            Real c = ocX * ocX + ocY * ocY + ocZ * ocZ - radius[slot] * radius[slot];
+            Real discriminant = halfB * halfB - ray.directionLength2 * c;
+            if (!(discriminant >= 0)) continue;
+
+            Real sqrtd = std::sqrt(discriminant);
+            Real root = (-halfB - sqrtd) / ray.directionLength2;
+            if (!(tMin < root && root < tMax)) {
+                root = (-halfB + sqrtd) / ray.directionLength2;
+                if (!(tMin < root && root < tMax)) continue;
+            }
+
+            tMax = root;
+            hit.slot = slot;
+            found = true;
+        }
+        return found;
+    }
+
+    bool occludedRange(const Ray &, const BasicPreparedRay<Real> &ray, int first, int count, Real tMax, int ignoreSlot) const {
+        const Real tMin = ray.tMin;
+        for (int slot = first; slot < first + count; ++slot) {
+            Real ocX = ray.origin[0] - centerX[slot];
+            Real ocY = ray.origin[1] - centerY[slot];
+            Real ocZ = ray.origin[2] - centerZ[slot];
+
+            Real halfB = ocX * ray.direction[0] + ocY * ray.direction[1] + ocZ * ray.direction[2];
+            Real c = ocX * ocX + ocY * ocY + ocZ * ocZ - radius[slot] * radius[slot];
+            Real discriminant = halfB * halfB - ray.directionLength2 * c;
+            if (!(discriminant >= 0) || slot == ignoreSlot) continue;
+
+            Real sqrtd = std::sqrt(discriminant);
+            Real nearRoot = (-halfB - sqrtd) / ray.directionLength2;
+            Real farRoot  = (-halfB + sqrtd) / ray.directionLength2;
+            if ((tMin < nearRoot && nearRoot < tMax) || (tMin < farRoot && farRoot < tMax)) return true;
+        }
+        return false;
+    }
+
+    template <int N>
+    void hitPacket(RayPacket<N, Real> &packet, int first, int count, int groupId) const {
+        for (int slot = first; slot < first + count; ++slot) {
+            const Real cX = centerX[slot], cY = centerY[slot], cZ = centerZ[slot];
+            const Real radius2 = radius[slot] * radius[slot];
+
+            #pragma omp simd
+            for (int lane = 0; lane < N; ++lane) {
+                Real ocX = packet.originX[lane] - cX;
+                Real ocY = packet.originY[lane] - cY;
+                Real ocZ = packet.originZ[lane] - cZ;
+
+                Real halfB = ocX * packet.dirX[lane] + ocY * packet.dirY[lane] + ocZ * packet.dirZ[lane];
+                Real c = ocX * ocX + ocY * ocY + ocZ * ocZ - radius2;
+                Real discriminant = halfB * halfB - packet.dirLength2[lane] * c;
+                Real sqrtd = std::sqrt(discriminant >= 0 ? discriminant : Real(0));
+
+                Real nearRoot = (-halfB - sqrtd) / packet.dirLength2[lane];
+                Real farRoot  = (-halfB + sqrtd) / packet.dirLength2[lane];
+                bool nearHit = discriminant >= 0 && packet.tMin[lane] < nearRoot && nearRoot < packet.tMax[lane];
+                bool farHit  = discriminant >= 0 && packet.tMin[lane] < farRoot  && farRoot  < packet.tMax[lane];
+
+                bool hit = nearHit || farHit;
+                packet.tMax[lane]     = hit ? (nearHit ? nearRoot : farRoot) : packet.tMax[lane];
+                packet.hitSlot[lane]  = hit ? slot : packet.hitSlot[lane];
+                packet.hitGroup[lane] = hit ? groupId : packet.hitGroup[lane];
+            }
+        }
+    }
+
+    void fillRecord(const Ray &ray, const HitCandidate &hit, double time, HitRecord &rec) const {
+        int slot = hit.slot;
+        gm::IPoint3 center(centerX[slot], centerY[slot], centerZ[slot]);
+
+        rec.time = time;
+        rec.point = ray.origin + ray.direction * time;
+        rec.setFaceNormal(ray, (rec.point - center) / static_cast<double>(radius[slot]));
+    }
+};
+
+template <typename RealType>
+class BasicBoxStorage {
+public:
+    using Real = RealType;
+
+    std::vector<Real> minX, minY, minZ;
+    std::vector<Real> maxX, maxY, maxZ;
+    std::vector<uint32_t> materialId;
+
+    // Exact type: a subclass may override hit() and has to stay a virtual call in the others group
+    static bool accepts(const Primitives *object) { return typeid(*object) == typeid(CubeObject); }
+    static AABB bounds(const AABB &box) { return storedBounds<Real>(box); }
+
+    void resize(size_t size) {
+        minX.resize(size); minY.resize(size); minZ.resize(size);
+        maxX.resize(size); maxY.resize(size); maxZ.resize(size);
+        materialId.resize(size);
+    }
+
+    void store(int slot, const Primitives *object, uint32_t material) {
+        const CubeObject *cube = static_cast<const CubeObject *>(object);
+        gm::IPoint3 center = cube->position();
+        gm::IVec3f halfSize = cube->getHalfSize();
+        minX[slot] = static_cast<Real>(center.x() - halfSize.x()); maxX[slot] = static_cast<Real>(center.x() + halfSize.x());
+        minY[slot] = static_cast<Real>(center.y() - halfSize.y()); maxY[slot] = static_cast<Real>(center.y() + halfSize.y());
+        minZ[slot] = static_cast<Real>(center.z() - halfSize.z()); maxZ[slot] = static_cast<Real>(center.z() + halfSize.z());
+        materialId[slot] = material;
+    }
+
+    // A box pushed to +infinity on every axis is never entered
+    void erase(int slot) {
+        const Real inf = std::numeric_limits<Real>::infinity();
+        minX[slot] = minY[slot] = minZ[slot] = inf;
+        maxX[slot] = maxY[slot] = maxZ[slot] = inf;
+    }
+
+    bool hitRange(const Ray &, const BasicPreparedRay<Real> &ray, int first, int count, Real &tMax, HitCandidate &hit) const {
+        const Real tMin = ray.tMin;
+        bool found = false;
+        for (int slot = first; slot < first + count; ++slot) {
+            Real tNear = -std::numeric_limits<Real>::infinity();
+            Real tFar  =  std::numeric_limits<Real>::infinity();
+
+            slab(minX[slot], maxX[slot], ray.origin[0], ray.invDirection[0], tNear, tFar);
+            slab(minY[slot], maxY[slot], ray.origin[1], ray.invDirection[1], tNear, tFar);
+            slab(minZ[slot], maxZ[slot], ray.origin[2], ray.invDirection[2], tNear, tFar);
+            if (tFar < tNear) continue;
+
+            Real t = tNear;
+            if (!(tMin < t && t < tMax)) {
+                t = tFar;
+                if (!(tMin < t && t < tMax)) continue;
+            }
+
+            tMax = t;
+            hit.slot = slot;
+            found = true;
+        }
+        return found;
+    }
+
+    bool occludedRange(const Ray &, const BasicPreparedRay<Real> &ray, int first, int count, Real tMax, int ignoreSlot) const {
+        const Real tMin = ray.tMin;
+        for (int slot = first; slot < first + count; ++slot) {
+            Real tNear = -std::numeric_limits<Real>::infinity();
+            Real tFar  =  std::numeric_limits<Real>::infinity();
+
+            slab(minX[slot], maxX[slot], ray.origin[0], ray.invDirection[0], tNear, tFar);
+            slab(minY[slot], maxY[slot], ray.origin[1], ray.invDirection[1], tNear, tFar);
+            slab(minZ[slot], maxZ[slot], ray.origin[2], ray.invDirection[2], tNear, tFar);
+            if (tFar < tNear || slot == ignoreSlot) continue;
+
+            if ((tMin < tNear && tNear < tMax) || (tMin < tFar && tFar < tMax)) return true;
+        }
+        return false;
+    }
+
+    template <int N>
+    void hitPacket(RayPacket<N, Real> &packet, int first, int count, int groupId) const {
+        for (int slot = first; slot < first + count; ++slot) {
+            const Real loX = minX[slot], loY = minY[slot], loZ = minZ[slot];
+            const Real hiX = maxX[slot], hiY = maxY[slot], hiZ = maxZ[slot];
+
+            #pragma omp simd
+            for (int lane = 0; lane < N; ++lane) {
+                Real tx0 = (loX - packet.originX[lane]) * packet.invX[lane], tx1 = (hiX - packet.originX[lane]) * packet.invX[lane];
+                Real ty0 = (loY - packet.originY[lane]) * packet.invY[lane], ty1 = (hiY - packet.originY[lane]) * packet.invY[lane];
+                Real tz0 = (loZ - packet.originZ[lane]) * packet.invZ[lane], tz1 = (hiZ - packet.originZ[lane]) * packet.invZ[lane];
+
+                Real tNear = std::max(std::min(tx0, tx1), std::max(std::min(ty0, ty1), std::min(tz0, tz1)));
+                Real tFar  = std::min(std::max(tx0, tx1), std::min(std::max(ty0, ty1), std::max(tz0, tz1)));
+
+                bool overlap = tNear <= tFar;
+                bool nearHit = overlap && packet.tMin[lane] < tNear && tNear < packet.tMax[lane];
+                bool farHit  = overlap && packet.tMin[lane] < tFar  && tFar  < packet.tMax[lane];
+
+                bool hit = nearHit || farHit;
+                packet.tMax[lane]     = hit ? (nearHit ? tNear : tFar) : packet.tMax[lane];
+                packet.hitSlot[lane]  = hit ? slot : packet.hitSlot[lane];
+                packet.hitGroup[lane] = hit ? groupId : packet.hitGroup[lane];
+            }
+        }
+    }
+
+    void fillRecord(const Ray &ray, const HitCandidate &hit, double time, HitRecord &rec) const {
+        int slot = hit.slot;
+        double minB[3] = { minX[slot], minY[slot], minZ[slot] };
+        double maxB[3] = { maxX[slot], maxY[slot], maxZ[slot] };
+
+        rec.time = time;
+        rec.point = ray.origin + ray.direction * time;
+        rec.setFaceNormal(ray, CubeObject::faceNormal(rec.point, minB, maxB));
+    }
+
+private:
+    static void slab(Real minB, Real maxB, Real origin, Real invDir, Real &tNear, Real &tFar) {
+        Real t0 = (minB - origin) * invDir;
+        Real t1 = (maxB - origin) * invDir;
+        if (t0 > t1) std::swap(t0, t1);
+        if (t0 > tNear) tNear = t0;
+        if (t1 < tFar)  tFar  = t1;
+    }
+};
+
+using SphereStorage = BasicSphereStorage<RTReal>;
+using BoxStorage    = BasicBoxStorage<RTReal>;
+
+// Anything without a dedicated layout (polygons, user types) keeps the virtual hit, in double
+class ObjectStorage {
+public:
+    using Real = RTReal;
+
+    std::vector<const Primitives *> objects;
+    std::vector<uint32_t> materialId;
+
+    static bool accepts(const Primitives *) { return true; }
+    // Hit in double through the objects, their own boxes hold
+    static AABB bounds(const AABB &box) { return box; }
+
+    void resize(size_t size) {
+        objects.resize(size);
+        materialId.resize(size);
+    }
+
+    void store(int slot, const Primitives *object, uint32_t material) {
+        objects[slot] = object;
+        materialId[slot] = material;
+    }
+
+    void erase(int slot) { objects[slot] = nullptr; }
+
+    bool hitRange(const Ray &ray, const BasicPreparedRay<Real> &prepared, int first, int count, Real &tMax, HitCandidate &hit) const {
+        bool found = false;
+        for (int slot = first; slot < first + count; ++slot) {
+            const Primitives *object = objects[slot];
+            if (object && object->hit(ray, Interval(prepared.tMin, tMax), hit.record)) {
+                tMax = static_cast<Real>(hit.record.time);
+                hit.slot = slot;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    bool occludedRange(const Ray &ray, const BasicPreparedRay<Real> &prepared, int first, int count, Real tMax, int ignoreSlot) const {
+        for (int slot = first; slot < first + count; ++slot) {
+            const Primitives *object = objects[slot];
+            if (object && slot != ignoreSlot && object->occludes(ray, Interval(prepared.tMin, tMax))) return true;
+        }
+        return false;
+    }
+
+    // Virtual hits fill the lane record directly
+    template <int N>
+    void hitPacket(RayPacket<N, Real> &packet, int first, int count, int) const {
+        for (int lane = 0; lane < packet.count; ++lane) {
+            for (int slot = first; slot < first + count; ++slot) {
+                const Primitives *object = objects[slot];
+                if (object && object->hit(packet.rays[lane], Interval(packet.tMin[lane], packet.tMax[lane]), packet.records[lane])) {
+                    packet.tMax[lane] = static_cast<Real>(packet.records[lane].time);
+                    packet.hitGroup[lane] = RayPacket<N, Real>::VIRTUAL_HIT;
+                }
+            }
+        }
+    }
+
+    void fillRecord(const Ray &, const HitCandidate &hit, double, HitRecord &rec) const {
+        rec = hit.record;
+    }
+};
+
+
+struct PrimitiveGroupStats {
+    int refittedObjects = 0;
+    int evictedObjects  = 0;
+    int rebuiltSubtrees = 0;
+};
+
+// One primitive type: a BVH over its slots, the matching storage, and a flat list of objects
+// added or evicted since the last build.
+template <typename Storage>
+class PrimitiveGroup {
+public:
+    using Real = typename Storage::Real;
+
+    // Objects added or evicted since the last build stay in the flat list until there are this many
+    static constexpr size_t PENDING_MIN_LIMIT = 64;
+    static constexpr size_t PENDING_SCENE_FRACTION = 64;
+
+    bool accepts(const Primitives *object) const { return Storage::accepts(object); }
+
+    size_t size() const { return slots_.size() + pending_.size(); }
+    bool contains(const Primitives *object) const { return slots_.count(object) || isPending(object); }
+
+    void build(const std::vector<Primitives *> &objects, MaterialRegistry &materials);
+    void rebuild(MaterialRegistry &materials);
+
+    // Installs a prebuilt tree whose slot i holds objects[i]. False if the tree does not fit the objects.
+    bool adopt(const std::vector<Primitives *> &objects, std::vector<BVHTree::Node> nodes, MaterialRegistry &materials);
+
+    void add(Primitives *object) { pending_.push_back(object); }
+    bool erase(const Primitives *object);
+
+    // Object geometry or material changed. It is refitted in place or moved to the flat list.
+    void update(const Primitives *object, const AABB &box, MaterialRegistry &materials, PrimitiveGroupStats &stats);
+
+    // Applies queued updates to the tree. Degraded subtrees are rebuilt in place.
+    void refit(MaterialRegistry &materials, PrimitiveGroupStats &stats);
+
+    bool needsRebuild() const {
+        size_t live = slots_.size();
+        size_t pendingLimit = std::max(PENDING_MIN_LIMIT, live / PENDING_SCENE_FRACTION);
+        return pending_.size() > pendingLimit || tombstones_ > live / 4 || bvh_.fragmented();
+    }
+
+    bool hitClosest(const Ray &ray, double tMin, double &tMax, HitRecord &rec, const MaterialRegistry &materials) const;
+
+    // Any-hit query, stops at the first blocker. `ignore` is skipped.
+    bool occluded(const Ray &ray, double tMin, double tMax, const Primitives *ignore) const;
+
+    // Lanes hitting this group get hitGroup = groupId and a slot, resolved later by fillPacketRecord
+    template <int N>
+    void hitPacket(RayPacket<N, Real> &packet, int groupId) const;
+
+    template <int N>
+    void fillPacketRecord(const RayPacket<N, Real> &packet, int lane, HitRecord &rec, const MaterialRegistry &materials) const;
+
+private:
+    BVHTree bvh_;
+    Storage storage_;
+    std::vector<Primitives *> objects_;
+    std::vector<AABB> bounds_;
+    std::unordered_map<const Primitives *, int> slots_;
+    size_t tombstones_ = 0;
+
+    std::vector<Primitives *> pending_;
+    std::vector<int> refitSlots_;
+
+    bool isPending(const Primitives *object) const {
+        return std::find(pending_.begin(), pending_.end(), object) != pending_.end();
+    }
+
+    void tombstone(int slot);
+    void store(int slot, MaterialRegistry &materials);
+};
+
+
+template <typename Storage>
+void PrimitiveGroup<Storage>::build(const std::vector<Primitives *> &objects, MaterialRegistry &materials) {
+    std::vector<AABB> bounds;
+    bounds.reserve(objects.size());
+    for (Primitives *object : objects)
+        bounds.push_back(Storage::bounds(object->boundingBox()));
+
+    std::vector<int> order;
+    bvh_.build(bounds, order);
+
+    objects_.resize(objects.size());
+    bounds_.resize(objects.size());
+    storage_.resize(objects.size());
+    slots_.clear();
+    slots_.reserve(objects.size());
+    for (size_t slot = 0; slot < order.size(); ++slot) {
+        objects_[slot] = objects[order[slot]];
+        bounds_[slot] = bounds[order[slot]];
+        slots_[objects_[slot]] = static_cast<int>(slot);
+        store(static_cast<int>(slot), materials);
+    }
+
+    tombstones_ = 0;
+    pending_.clear();
+    refitSlots_.clear();
+}
+
+template <typename Storage>
+bool PrimitiveGroup<Storage>::adopt(const std::vector<Primitives *> &objects, std::vector<BVHTree::Node> nodes, MaterialRegistry &materials) {
+    if (!bvh_.assign(std::move(nodes), static_cast<int>(objects.size()))) return false;
+
+    objects_ = objects;
+    bounds_.resize(objects.size());
+    storage_.resize(objects.size());
+    slots_.clear();
+    slots_.reserve(objects.size());
+    for (size_t slot = 0; slot < objects.size(); ++slot) {
+        bounds_[slot] = Storage::bounds(objects_[slot]->boundingBox());
+        slots_[objects_[slot]] = static_cast<int>(slot);
+        store(static_cast<int>(slot), materials);
+    }
+
+    // The tree may come from a build with the other Real, its leaves are refitted to this storage's bounds.
+    // A rounding ulp never degrades a subtree.
+    std::vector<int> allSlots(objects.size()), degraded;
+    std::iota(allSlots.begin(), allSlots.end(), 0);
+    bvh_.refit(allSlots, bounds_, degraded);
+
+    tombstones_ = 0;
+    pending_.clear();
+    refitSlots_.clear();
+    return true;
+}
+
+template <typename Storage>
+void PrimitiveGroup<Storage>::rebuild(MaterialRegistry &materials) {
+    std::vector<Primitives *> live;
+    live.reserve(size());
+    for (Primitives *object : objects_)
+        if (object) live.push_back(object);
+    live.insert(live.end(), pending_.begin(), pending_.end());
+    build(live, materials);
+}
+
+template <typename Storage>
+bool PrimitiveGroup<Storage>::erase(const Primitives *object) {
+    auto slotIt = slots_.find(object);
+    if (slotIt != slots_.end()) {
+        tombstone(slotIt->second);
+        return true;
+    }
+
+    auto it = std::find(pending_.begin(), pending_.end(), object);
+    if (it == pending_.end()) return false;
+    *it = pending_.back();
+    pending_.pop_back();
+    return true;
+}
+
+template <typename Storage>
+void PrimitiveGroup<Storage>::update(const Primitives *object, const AABB &box, MaterialRegistry &materials, PrimitiveGroupStats &stats) {
+    auto slotIt = slots_.find(object);
+    if (slotIt == slots_.end()) return;
+
+    int slot = slotIt->second;
+    const BVHTree::Node &leaf = bvh_.nodes()[bvh_.leafOfSlot(slot)];
+    const AABB stored = Storage::bounds(box);
+
+    // Objects that moved away from their leaf would inflate it, they go to the flat list instead
+    if (AABB(leaf.box, stored).surfaceArea() > BVHTree::REBUILD_AREA_RATIO * leaf.buildArea) {
+        Primitives *evicted = objects_[slot];
+        tombstone(slot);
+        pending_.push_back(evicted);
+        stats.evictedObjects++;
+        return;
+    }
+
+    bounds_[slot] = stored;
+    store(slot, materials);
+    refitSlots_.push_back(slot);
+    stats.refittedObjects++;
+}
+
+template <typename Storage>
+void PrimitiveGroup<Storage>::refit(MaterialRegistry &materials, PrimitiveGroupStats &stats) {
+    if (refitSlots_.empty()) return;
+
+    std::vector<int> degraded;
+    bvh_.refit(refitSlots_, bounds_, degraded);
+    refitSlots_.clear();
+
+    std::vector<int> order;
+    std::vector<Primitives *> oldObjects;
+    std::vector<AABB> oldBounds;
+    for (int nodeId : degraded) {
+        bvh_.rebuildSubtree(nodeId, bounds_, order);
+
+        int first = bvh_.nodes()[nodeId].first;
+        oldObjects.assign(objects_.begin() + first, objects_.begin() + first + order.size());
+        oldBounds.assign(bounds_.begin() + first, bounds_.begin() + first + order.size());
+
+        for (size_t i = 0; i < order.size(); ++i) {
+            int slot = first + static_cast<int>(i);
+            objects_[slot] = oldObjects[order[i]];
+            bounds_[slot] = oldBounds[order[i]];
+            if (objects_[slot]) {
+                slots_[objects_[slot]] = slot;
+                store(slot, materials);
+            } else {
+                storage_.erase(slot);
+            }
+        }
+        stats.rebuiltSubtrees++;
+    }
+}
+
+template <typename Storage>
+void PrimitiveGroup<Storage>::tombstone(int slot) {
+    // The slot keeps its place in the tree, its leaf shrinks on the next refit
+    slots_.erase(objects_[slot]);
+    objects_[slot] = nullptr;
+    bounds_[slot] = AABB::empty;
+    storage_.erase(slot);
+    tombstones_++;
+    refitSlots_.push_back(slot);
+}
+
+template <typename Storage>
+void PrimitiveGroup<Storage>::store(int slot, MaterialRegistry &materials) {
+    Primitives *object = objects_[slot];
+    storage_.store(slot, object, materials.idOf(object->material()));
+}
+
+template <typename Storage>
+bool PrimitiveGroup<Storage>::hitClosest(const Ray &ray, double tMin, double &tMax, HitRecord &rec, const MaterialRegistry &materials) const {
+    bool hitAnything = false;
+
+    for (Primitives *object : pending_) {
+        if (object->hit(ray, Interval(tMin, tMax), rec)) {
+            hitAnything = true;
+            tMax = rec.time;
+        }
+    }
+
+    BasicPreparedRay<Real> prepared(ray, tMin);
+    HitCandidate candidate;
+    bool hitTree = false;
+    bvh_.traverse(ray, tMin, tMax, [&](int first, int count, double &leafTMax) {
+        Real limit = static_cast<Real>(leafTMax);
+        if (storage_.hitRange(ray, prepared, first, count, limit, candidate)) {
+            leafTMax = limit;
+            hitTree = true;
+        }
+    });
+
+    if (!hitTree) return hitAnything;
+
+    storage_.fillRecord(ray, candidate, tMax, rec);
+    rec.materialId = storage_.materialId[candidate.slot];
+    rec.material = materials.material(rec.materialId);
+    rec.object = objects_[candidate.slot];
+    return true;
+}
+
+template <typename Storage>
+bool PrimitiveGroup<Storage>::occluded(const Ray &ray, double tMin, double tMax, const Primitives *ignore) const {
+    for (Primitives *object : pending_)
+        if (object != ignore && object->occludes(ray, Interval(tMin, tMax))) return true;
+
+    int ignoreSlot = -1;
+    if (ignore) {
+        auto slotIt = slots_.find(ignore);
+        if (slotIt != slots_.end()) ignoreSlot = slotIt->second;
+    }
+
+    BasicPreparedRay<Real> prepared(ray, tMin);
+    const Real limit = static_cast<Real>(tMax);
+    return bvh_.traverseAny(ray, tMin, tMax, [&](int first, int count) {
+        return storage_.occludedRange(ray, prepared, first, count, limit, ignoreSlot);
+    });
+}
+
+template <typename Storage>
+template <int N>
+void PrimitiveGroup<Storage>::hitPacket(RayPacket<N, Real> &packet, int groupId) const {
+    for (int lane = 0; lane < packet.count; ++lane) {
+        for (Primitives *object : pending_) {
+            if (object->hit(packet.rays[lane], Interval(packet.tMin[lane], packet.tMax[lane]), packet.records[lane])) {
+                packet.tMax[lane] = static_cast<Real>(packet.records[lane].time);
+                packet.hitGroup[lane] = RayPacket<N, Real>::VIRTUAL_HIT;
+            }
+        }
+    }
+
+    bvh_.traversePacket(packet, [&](int first, int count) {
+        storage_.hitPacket(packet, first, count, groupId);
+    });
+}
+
+template <typename Storage>
+template <int N>
+void PrimitiveGroup<Storage>::fillPacketRecord(const RayPacket<N, Real> &packet, int lane, HitRecord &rec, const MaterialRegistry &materials) const {
+    HitCandidate candidate;
+    candidate.slot = packet.hitSlot[lane];
+
+    storage_.fillRecord(packet.rays[lane], candidate, packet.tMax[lane], rec);
+    rec.materialId = storage_.materialId[candidate.slot];
+    rec.material = materials.material(rec.materialId);
+    rec.object = objects_[candidate.slot];
+}
+
+
+#endif // RTCOMPILED_SCENE_H
@@ -0,0 +1,65 @@
+#ifndef RTDENOISER_H
+#define RTDENOISER_H
+
+#include <vector>
+
+#include "IVec3f.hpp"
+
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al., "Edge-Avoiding À-Trous Wavelet Transform for fast
+// Global Illumination Filtering") with the variance-guided luminance weight of SVGF. Every iteration is a 5x5
+// B3-spline kernel with its taps 2^iteration pixels apart, weighted down across depth, normal and luminance
+// edges. Colors are divided by the first-hit albedo before filtering and multiplied back after it, so
+// texture and material borders stay sharp while the lighting is smoothed.
+//
+// Pixels are stored one plane per channel in float, the row loops vectorize over x.
+class RTDenoiser {
+public:
+    RTDenoiser() = default;
+
+    // Keeps the planes of the previous image if the size did not change
+    void resize(int width, int height);
+
+    // variance: of the pixel's mean luminance; albedo, normal and depth: means of its first hits.
+    // Camera rays that miss have a zero normal and depth.
+    void setPixel(int pixelId, const gm::IVec3f &color, double variance,
+                  const gm::IVec3f &albedo, const gm::IVec3f &normal, double depth);
+
+    void filter(int iterations);
+
+    gm::IVec3f color(int pixelId) const;
+
+private:
+    struct Plane3 {
+        std::vector<float> x, y, z;
+
+        void resize(size_t size) { x.resize(size); y.resize(size); z.resize(size); }
+    };
+
+    // Per-thread sums of one output row and the luminance weight scale of its pixels
+    struct RowSums {
+        std::vector<float> weight, x, y, z, variance;
+        std::vector<float> luminanceScale;
+
+        explicit RowSums(int width)
+            : weight(width), x(width), y(width), z(width), variance(width), luminanceScale(width) {}
+    };
+
+    int width_  = 0;
+    int height_ = 0;
+
+    Plane3 color_, nextColor_;    // demodulated by the albedo
+    std::vector<float> variance_, nextVariance_, blurredVariance_;
+    std::vector<float> luminance_;    // of color_
+    Plane3 albedo_;
+    Plane3 normal_;
+    std::vector<float> depth_;
+    std::vector<float> depthGradient_;
+
+    void computeDepthGradient();
+    void prepareIteration();
+    void filterRow(int y, int step, RowSums &sums);
+};
+
+
+#endif // RTDENOISER_H
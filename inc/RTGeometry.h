@@ -1,14 +1,45 @@
 #ifndef RTGEOMETRY_H
 #define RTGEOMETRY_H
 
+#include <cmath>
+#include <utility>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
 #include "IVec3f.hpp"
+#include "RTSampler.h"
 class RTMaterial;
 class Primitives;
 #include "GmUtilities.hpp"
 
 
-inline gm::IVec3f randomOnHemisphere(const gm::IVec3f& normal) {
-    gm::IVec3f on_unit_sphere = gm::IVec3f::randomUnit();
+// Scalar of the compiled intersection kernels (SoA primitive storage, prepared rays, packets).
+// RAYTRACER_FLOAT_PIPELINE builds them in float, which doubles the lanes per vector register and halves
+// the storage they stream. Ray, HitRecord and Interval stay on gm::IVec3f doubles either way.
+#ifdef RAYTRACER_FLOAT_PIPELINE
+using RTReal = float;
+#else
+using RTReal = double;
+#endif
+
+// Self-intersection guard for rays leaving a surface. MIN_T is the absolute floor the renderer passes as
+// rayTime.min. On top of it the kernels skip hits closer than the rounding error of an origin stored in
+// Real: negligible in double, but in float it outgrows MIN_T a few thousand units away from the origin.
+template <typename Real>
+struct SelfHitEpsilon {
+    static constexpr double MIN_T    = 0.001;
+    static constexpr double RELATIVE = 32.0 * std::numeric_limits<Real>::epsilon();
+
+    // In units of the (unnormalized) direction, like every hit time
+    static double minT(const double origin[3], double directionLength2) {
+        double magnitude = std::max({ std::fabs(origin[0]), std::fabs(origin[1]), std::fabs(origin[2]) });
+        return RELATIVE * magnitude / std::sqrt(directionLength2);
+    }
+};
+
+inline gm::IVec3f randomOnHemisphere(const gm::IVec3f& normal, RTSampler &sampler) {
+    gm::IVec3f on_unit_sphere = sampler.nextUnitVector();
     if (dot(on_unit_sphere, normal) > 0.0)
         return on_unit_sphere;
     else
@@ -47,9 +78,13 @@ struct Ray {
 };
 
 struct HitRecord {
+    static constexpr uint32_t NO_MATERIAL = UINT32_MAX;
+
     gm::IPoint3 point = {};
     gm::IVec3f normal = {};
     const RTMaterial *material = nullptr;
+    uint32_t materialId = NO_MATERIAL;     // row of `material` in the scene's material table
+    uint32_t triangle = 0;                 // of a TriangleMeshObject hit, other objects leave it alone
     const Primitives *object = nullptr;
     bool frontFace = false;
     double time = 0;
@@ -68,6 +103,8 @@ struct Interval {
 
     Interval(double min, double max) : min(min), max(max) {}
 
+    Interval(const Interval& a, const Interval& b) : min(std::fmin(a.min, b.min)), max(std::fmax(a.max, b.max)) {}
+
     double size() const {
         return max - min;
     }
@@ -86,8 +123,97 @@ struct Interval {
         return x;
     }
 
+    Interval expand(double delta) const {
+        double padding = delta / 2;
+        return Interval(min - padding, max + padding);
+    }
+
     static const Interval empty, universe;
 };
 
+struct AABB {
+    static constexpr double MIN_EXTENT = 0.0001;
+
+    Interval x, y, z;
+
+    AABB() {}
+
+    AABB(const Interval& x, const Interval& y, const Interval& z) : x(x), y(y), z(z) {
+        padToMinimums();
+    }
+
+    AABB(const gm::IPoint3& a, const gm::IPoint3& b) {
+        x = (a.x() <= b.x()) ? Interval(a.x(), b.x()) : Interval(b.x(), a.x());
+        y = (a.y() <= b.y()) ? Interval(a.y(), b.y()) : Interval(b.y(), a.y());
+        z = (a.z() <= b.z()) ? Interval(a.z(), b.z()) : Interval(b.z(), a.z());
+        padToMinimums();
+    }
+
+    AABB(const AABB& a, const AABB& b) : x(a.x, b.x), y(a.y, b.y), z(a.z, b.z) {}
+
+    const Interval& axisInterval(int n) const {
+        if (n == 1) return y;
+        if (n == 2) return z;
+        return x;
+    }
+
+    bool isEmpty() const {
+        return x.min > x.max || y.min > y.max || z.min > z.max;
+    }
+
+    bool isInfinite() const {
+        return std::isinf(x.size()) || std::isinf(y.size()) || std::isinf(z.size());
+    }
+
+    double centroid(int axis) const {
+        const Interval &i = axisInterval(axis);
+        return 0.5 * (i.min + i.max);
+    }
+
+    double surfaceArea() const {
+        if (isEmpty()) return 0.0;
+        double dx = x.size(), dy = y.size(), dz = z.size();
+        return 2.0 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    int longestAxis() const {
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+        return y.size() > z.size() ? 1 : 2;
+    }
+
+    // Slab test against a precomputed inverse direction. NaN slabs (origin on a face, zero direction) are ignored.
+    // The exit distance is widened by the rounding bound of its computation, so a ray through a box corner
+    // is not lost between slabs. Empty boxes (min > max, e.g. erased slots) are never hit: swapping their
+    // slab distances would turn them into the whole line.
+    bool hit(const double origin[3], const double invDir[3], double tMin, double tMax, double &tEnter) const {
+        static constexpr double EXIT_ROUNDING = 1.0 + 6.0 * std::numeric_limits<double>::epsilon();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const Interval &ax = axisInterval(axis);
+            if (ax.min > ax.max) return false;
+            double t0 = (ax.min - origin[axis]) * invDir[axis];
+            double t1 = (ax.max - origin[axis]) * invDir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            t1 *= EXIT_ROUNDING;
+
+            if (t0 > tMin) tMin = t0;
+            if (t1 < tMax) tMax = t1;
+            if (tMax < tMin) return false;
+        }
+        tEnter = tMin;
+        return true;
+    }
+
+    static const AABB empty, universe;
+
+private:
+    void padToMinimums() {
+        if (x.size() < MIN_EXTENT) x = x.expand(MIN_EXTENT);
+        if (y.size() < MIN_EXTENT) y = y.expand(MIN_EXTENT);
+        if (z.size() < MIN_EXTENT) z = z.expand(MIN_EXTENT);
+    }
+};
+
 
 #endif // RTGEOMETRY_H
\ No newline at end of file
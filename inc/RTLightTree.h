@@ -0,0 +1,53 @@
+#ifndef RTLIGHTTREE_H
+#define RTLIGHTTREE_H
+
+#include <vector>
+
+#include "RTGeometry.h"
+class Light;
+
+
+// Binary tree over light positions for picking one light per shading point in O(log n).
+// Each step descends into a child with probability proportional to its importance, so the
+// pdf of the picked light is the product of those probabilities and never zero for a light with power.
+class LightTree {
+public:
+    // Share of a node's importance that does not depend on the orientation bound: lights behind the
+    // surface still add ambient and specular terms and must stay reachable.
+    static constexpr double ORIENTATION_FLOOR = 0.1;
+
+    // Lights reporting no power keep a small chance of being picked
+    static constexpr double MIN_LIGHT_POWER = 1e-6;
+
+    struct Node {
+        AABB box;
+        double power = 0.0;
+        int left  = -1;
+        int right = -1;
+        int light = -1;
+
+        bool isLeaf() const { return left < 0; }
+    };
+
+public:
+    LightTree() = default;
+
+    void build(const std::vector<Light *> &lights);
+    void clear();
+
+    bool empty() const { return nodes_.empty(); }
+    size_t size() const { return lights_.size(); }
+
+    // Picks a light for a shading point using a uniform random number u in [0, 1)
+    Light *sample(const gm::IPoint3 &point, const gm::IVec3f &normal, double u, double &pdf) const;
+
+private:
+    std::vector<Node>    nodes_;
+    std::vector<Light *> lights_;
+
+    int buildNode(std::vector<int> &order, int first, int count);
+    double importance(const Node &node, const gm::IPoint3 &point, const gm::IVec3f &normal) const;
+};
+
+
+#endif // RTLIGHTTREE_H
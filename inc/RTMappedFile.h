@@ -0,0 +1,50 @@
+#ifndef RTMAPPEDFILE_H
+#define RTMAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Read-only private mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) return;
+
+        struct stat info;
+        if (::fstat(fd_, &info) != 0 || info.st_size <= 0) return;
+
+        void *data = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (data == MAP_FAILED) return;
+
+        ::madvise(data, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+        data_ = static_cast<const char *>(data);
+        size_ = static_cast<size_t>(info.st_size);
+    }
+
+    ~MappedFile() {
+        if (data_) ::munmap(const_cast<char *>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool valid() const { return data_ != nullptr; }
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    int fd_ = -1;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+
+#endif // RTMAPPEDFILE_H
@@ -1,14 +1,31 @@
 #ifndef RTMATERIAL_H
 #define RTMATERIAL_H
+#include <algorithm>
 #include <memory>
+#include <cstdint>
 #include <ostream>
 #include <istream>
 #include <sstream>
 
 #include "RTGeometry.h"
+#include "RTObjectArena.h"
+#include "RTSampler.h"
 using RTColor = gm::IVec3f;
 
 
+enum class MaterialKind : uint8_t { Lambertian, Metal, Dielectric, Emissive, Custom };
+
+// Flat copy of a material for the shading loops, kept by the scene's material table and picked through
+// HitRecord::materialId. Custom records stand for material types without one and shade through the
+// virtual functions of HitRecord::material.
+struct MaterialRecord {
+    MaterialKind kind = MaterialKind::Custom;
+    gm::IVec3f albedo  = gm::IVec3f(0, 0, 0);   // lambertian diffuse, metal specular, dielectric attenuation
+    gm::IVec3f emitted = gm::IVec3f(0, 0, 0);
+    double parameter = 0.0;                     // metal fuzz, dielectric refraction index
+};
+
+
 struct RTMaterial {
     virtual ~RTMaterial() = default;
 
@@ -16,17 +33,55 @@ struct RTMaterial {
     gm::IVec3f specular_ = gm::IVec3f(0, 0, 0);
     gm::IVec3f emission_ = gm::IVec3f(0, 0, 0);
 
+    // Random choices are drawn from the path's sampler
     virtual bool scatter(
         const Ray& inRay,
         const HitRecord &hitRecord,
+        RTSampler &sampler,
         gm::IVec3f &attenuation,
         Ray& scattered
     ) const = 0;
 
+    // Scatters `count` rays that all hit this material: one virtual call per batch instead of one per ray.
+    // Ray i draws from samplers[i].
+    virtual void scatterBatch(
+        const Ray *inRays,
+        const HitRecord *hitRecords,
+        RTSampler *samplers,
+        int count,
+        gm::IVec3f *attenuations,
+        Ray *scattered,
+        bool *scatteredFlags
+    ) const
+    {
+        for (int i = 0; i < count; ++i)
+            scatteredFlags[i] = scatter(inRays[i], hitRecords[i], samplers[i], attenuations[i], scattered[i]);
+    }
+
+    // BSDF times cosine for a given outgoing direction and the pdf scatter() samples it with.
+    // Mirror-like materials that scatter() cannot reproduce from a light sample return false.
+    virtual bool evalScatter(
+        const Ray& /*inRay*/,
+        const HitRecord &/*hitRecord*/,
+        const gm::IVec3f &/*direction*/,
+        gm::IVec3f &/*value*/,
+        double &/*pdf*/
+    ) const
+    {
+        return false;
+    }
+
     virtual bool hasSpecular() const { return false; }
     virtual bool hasDiffuse() const { return false; }
     virtual bool hasEmmision() const { return false; }
 
+    // Table record of the material, Custom unless the type has a switch case in scatterMaterial()
+    virtual MaterialRecord record() const {
+        MaterialRecord record;
+        record.emitted = emission_;
+        return record;
+    }
+
     virtual std::string typeString() const { return "RTMaterial"; }
 
     gm::IVec3f &diffuse()  { return diffuse_; }
@@ -37,6 +92,15 @@ struct RTMaterial {
     const gm::IVec3f &emitted()  const { return emission_; }
 
 protected:
+    // Non-virtual per-ray loop for scatterBatch overrides
+    template <typename Material>
+    static void scatterEach(const Material &material, const Ray *inRays, const HitRecord *hitRecords, RTSampler *samplers,
+                            int count, gm::IVec3f *attenuations, Ray *scattered, bool *scatteredFlags)
+    {
+        for (int i = 0; i < count; ++i)
+            scatteredFlags[i] = material.Material::scatter(inRays[i], hitRecords[i], samplers[i], attenuations[i], scattered[i]);
+    }
+
     virtual std::ostream &dump(std::ostream &os) const {
         os << typeString() << ' '
            << diffuse_.x()  << ' ' << diffuse_.y()  << ' ' << diffuse_.z()  << ' '
@@ -66,19 +130,53 @@ public:
 
     bool scatter(const Ray&,
                  const HitRecord &hitRecord,
+                 RTSampler &sampler,
                  gm::IVec3f &attenuation,
                  Ray& scattered) const override
     {
-        gm::IVec3f scatterDir = hitRecord.normal + gm::IVec3f::randomUnit();
+        return scatterDiffuse(diffuse_, hitRecord, sampler, attenuation, scattered);
+    }
+
+    bool evalScatter(const Ray&,
+                     const HitRecord &hitRecord,
+                     const gm::IVec3f &direction,
+                     gm::IVec3f &value,
+                     double &pdf) const override
+    {
+        return evalDiffuse(diffuse_, hitRecord, direction, value, pdf);
+    }
+
+    static bool scatterDiffuse(const gm::IVec3f &diffuse, const HitRecord &hitRecord, RTSampler &sampler,
+                               gm::IVec3f &attenuation, Ray &scattered)
+    {
+        gm::IVec3f scatterDir = hitRecord.normal + sampler.nextUnitVector();
 
         if (scatterDir.nearZero())
             scatterDir = hitRecord.normal;
 
         scattered = Ray(hitRecord.point, scatterDir);
-        attenuation = diffuse_;
+        attenuation = diffuse;
         return true;
     }
 
+    // scatterDiffuse() picks normal + a unit vector, a cosine-weighted direction
+    static bool evalDiffuse(const gm::IVec3f &diffuse, const HitRecord &hitRecord, const gm::IVec3f &direction, gm::IVec3f &value, double &pdf) {
+        double cosine = std::max(0.0, dot(hitRecord.normal, direction.normalized()));
+        value = diffuse * (cosine / M_PI);
+        pdf = cosine / M_PI;
+        return true;
+    }
+
+    MaterialRecord record() const override {
+        return { MaterialKind::Lambertian, diffuse_, emission_, 0.0 };
+    }
+
+    void scatterBatch(const Ray *inRays, const HitRecord *hitRecords, RTSampler *samplers, int count,
+                      gm::IVec3f *attenuations, Ray *scattered, bool *scatteredFlags) const override
+    {
+        scatterEach(*this, inRays, hitRecords, samplers, count, attenuations, scattered, scatteredFlags);
+    }
+
     std::string typeString() const override { return "Lambertian"; }
 
     bool hasDiffuse() const override { return true; }
@@ -104,18 +202,37 @@ public:
 
     bool scatter(const Ray& inRay,
                 const HitRecord &hitRecord,
+                RTSampler &sampler,
                 gm::IVec3f &attenuation,
                 Ray& scattered) const override
+    {
+        return scatterMetal(specular_, fuzz_, inRay, hitRecord, sampler, attenuation, scattered);
+    }
+
+    static bool scatterMetal(const gm::IVec3f &specular, double fuzz, const Ray &inRay, const HitRecord &hitRecord,
+                             RTSampler &sampler, gm::IVec3f &attenuation, Ray &scattered)
     {
         gm::IVec3f reflected = reflect(inRay.direction, hitRecord.normal);
-        reflected = reflected.normalized() + gm::IVec3f::randomUnit() * fuzz_;
+        reflected = reflected.normalized() + sampler.nextUnitVector() * fuzz;
         scattered = Ray(hitRecord.point, reflected);
-        attenuation = specular_;
+        attenuation = specular;
         return true;
     }
 
+    MaterialRecord record() const override {
+        return { MaterialKind::Metal, specular_, emission_, fuzz_ };
+    }
+
+    void scatterBatch(const Ray *inRays, const HitRecord *hitRecords, RTSampler *samplers, int count,
+                      gm::IVec3f *attenuations, Ray *scattered, bool *scatteredFlags) const override
+    {
+        scatterEach(*this, inRays, hitRecords, samplers, count, attenuations, scattered, scatteredFlags);
+    }
+
     std::string typeString() const override { return "Metal"; }
 
+    double fuzz() const { return fuzz_; }
+
     bool hasSpecular() const override { return true; }
 
 protected:
@@ -141,21 +258,29 @@ public:
 
     bool scatter(const Ray& inRay,
                 const HitRecord &hitRecord,
+                RTSampler &sampler,
                 gm::IVec3f &attenuation,
                 Ray& scattered) const override
     {
-        attenuation = specular_local_;
+        return scatterDielectric(specular_local_, refractionIndex_, inRay, hitRecord, sampler, attenuation, scattered);
+    }
 
-        double eta = hitRecord.frontFace ? (1.0 / refractionIndex_) : refractionIndex_;
+    static bool scatterDielectric(const gm::IVec3f &transmission, double refractionIndex, const Ray &inRay,
+                                  const HitRecord &hitRecord, RTSampler &sampler, gm::IVec3f &attenuation, Ray &scattered)
+    {
+        attenuation = transmission;
+
+        double eta = hitRecord.frontFace ? (1.0 / refractionIndex) : refractionIndex;
 
         gm::IVec3f unitDir = inRay.direction.normalized();
         double cosTheta = std::fmin(dot(unitDir * (-1), hitRecord.normal), 1.0);
         double sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
 
         bool cannotRefract = eta * sinTheta > 1.0;
+        double choice = sampler.next();
 
         gm::IVec3f direction;
-        if (cannotRefract || reflectance(cosTheta, eta) > gm::randomDouble()) {
+        if (cannotRefract || reflectance(cosTheta, eta) > choice) {
             direction = reflect(unitDir, hitRecord.normal);
         } else {
             gm::IVec3f refr;
@@ -169,8 +294,21 @@ public:
         return true;
     }
 
+    void scatterBatch(const Ray *inRays, const HitRecord *hitRecords, RTSampler *samplers, int count,
+                      gm::IVec3f *attenuations, Ray *scattered, bool *scatteredFlags) const override
+    {
+        scatterEach(*this, inRays, hitRecords, samplers, count, attenuations, scattered, scatteredFlags);
+    }
+
+    MaterialRecord record() const override {
+        return { MaterialKind::Dielectric, specular_local_, emission_, refractionIndex_ };
+    }
+
     std::string typeString() const override { return "Dielectric"; }
 
+    const gm::IVec3f &attenuation() const { return specular_local_; }
+    double refractionIndex() const { return refractionIndex_; }
+
     bool hasSpecular() const override { return true; }
 
 protected:
@@ -202,12 +340,24 @@ class RTEmissive : public RTMaterial {
 public:
     explicit RTEmissive(const gm::IVec3f& emission) { emission_ = emission; }
 
-    bool scatter(const Ray&, const HitRecord&, gm::IVec3f&, Ray&) const override {
+    bool scatter(const Ray&, const HitRecord&, RTSampler&, gm::IVec3f&, Ray&) const override {
         return false;
     }
 
+    void scatterBatch(const Ray *inRays, const HitRecord *hitRecords, RTSampler *samplers, int count,
+                      gm::IVec3f *attenuations, Ray *scattered, bool *scatteredFlags) const override
+    {
+        scatterEach(*this, inRays, hitRecords, samplers, count, attenuations, scattered, scatteredFlags);
+    }
+
     std::string typeString() const override { return "Emissive"; }
 
+    bool hasEmmision() const override { return true; }
+
+    MaterialRecord record() const override {
+        return { MaterialKind::Emissive, gm::IVec3f(0, 0, 0), emission_, 0.0 };
+    }
+
 protected:
     std::ostream &dump(std::ostream &os) const override {
         RTMaterial::dump(os);
@@ -220,55 +370,116 @@ protected:
     }
 };
 
+// Material evaluation on table records: one switch instead of a virtual call per bounce. The kernels are
+// the ones the classes use, so both paths scatter the same rays.
+inline bool scatterMaterial(const MaterialRecord &material, const Ray &inRay, const HitRecord &hitRecord,
+                            RTSampler &sampler, gm::IVec3f &attenuation, Ray &scattered)
+{
+    switch (material.kind) {
+        case MaterialKind::Lambertian: return RTLambertian::scatterDiffuse(material.albedo, hitRecord, sampler, attenuation, scattered);
+        case MaterialKind::Metal:      return RTMetal::scatterMetal(material.albedo, material.parameter, inRay, hitRecord, sampler, attenuation, scattered);
+        case MaterialKind::Dielectric: return RTDielectric::scatterDielectric(material.albedo, material.parameter, inRay, hitRecord, sampler, attenuation, scattered);
+        case MaterialKind::Emissive:   return false;
+        case MaterialKind::Custom:     break;
+    }
+    return hitRecord.material->scatter(inRay, hitRecord, sampler, attenuation, scattered);
+}
+
+inline bool evalScatterMaterial(const MaterialRecord &material, const Ray &inRay, const HitRecord &hitRecord,
+                                const gm::IVec3f &direction, gm::IVec3f &value, double &pdf)
+{
+    switch (material.kind) {
+        case MaterialKind::Lambertian: return RTLambertian::evalDiffuse(material.albedo, hitRecord, direction, value, pdf);
+        case MaterialKind::Metal:
+        case MaterialKind::Dielectric:
+        case MaterialKind::Emissive:   return false;
+        case MaterialKind::Custom:     break;
+    }
+    return hitRecord.material->evalScatter(inRay, hitRecord, direction, value, pdf);
+}
+
+inline gm::IVec3f emittedMaterial(const MaterialRecord &material, const HitRecord &hitRecord) {
+    return material.kind == MaterialKind::Custom ? hitRecord.material->emitted() : material.emitted;
+}
+
+// `count` hits of one material: the switch runs once and the loop over the rays is direct
+inline void scatterMaterialBatch(const MaterialRecord &material, const Ray *inRays, const HitRecord *hitRecords, RTSampler *samplers,
+                                 int count, gm::IVec3f *attenuations, Ray *scattered, bool *scatteredFlags)
+{
+    switch (material.kind) {
+        case MaterialKind::Lambertian:
+            for (int i = 0; i < count; ++i)
+                scatteredFlags[i] = RTLambertian::scatterDiffuse(material.albedo, hitRecords[i], samplers[i], attenuations[i], scattered[i]);
+            return;
+        case MaterialKind::Metal:
+            for (int i = 0; i < count; ++i)
+                scatteredFlags[i] = RTMetal::scatterMetal(material.albedo, material.parameter, inRays[i], hitRecords[i], samplers[i],
+                                                          attenuations[i], scattered[i]);
+            return;
+        case MaterialKind::Dielectric:
+            for (int i = 0; i < count; ++i)
+                scatteredFlags[i] = RTDielectric::scatterDielectric(material.albedo, material.parameter, inRays[i], hitRecords[i], samplers[i],
+                                                                    attenuations[i], scattered[i]);
+            return;
+        case MaterialKind::Emissive:
+            std::fill(scatteredFlags, scatteredFlags + count, false);
+            return;
+        case MaterialKind::Custom:
+            if (count > 0) hitRecords[0].material->scatterBatch(inRays, hitRecords, samplers, count, attenuations, scattered, scatteredFlags);
+            return;
+    }
+}
+
+
+// Materials live in an arena, one pool per class, and go away together with the manager
 class RTMaterialManager {
-    std::vector<std::unique_ptr<RTMaterial>> children;
+    ObjectArena children;
 
 public:
     RTMaterialManager() = default;
     ~RTMaterialManager() = default;
 
     RTMaterial *MakeLambertian(const gm::IVec3f& diffuse) {
-        children.push_back(std::make_unique<RTLambertian>(diffuse));
-        return children.back().get();
+        return children.create<RTLambertian>(diffuse);
     }
 
     RTMaterial *MakeMetal(const RTColor &specularColor, double fuzz) {
-        children.push_back(std::make_unique<RTMetal>(specularColor, fuzz));
-        return children.back().get();
+        return children.create<RTMetal>(specularColor, fuzz);
     }
 
     RTMaterial *MakeDielectric(gm::IVec3f specular, double refractionIndex) {
-        children.push_back(std::make_unique<RTDielectric>(specular, refractionIndex));
-        return children.back().get();
+        return children.create<RTDielectric>(specular, refractionIndex);
     }
 
     RTMaterial *MakeEmissive(const gm::IVec3f &emission) {
-        children.push_back(std::make_unique<RTEmissive>(emission));
-        return children.back().get();
+        return children.create<RTEmissive>(emission);
     }
 
+    size_t size() const { return children.size(); }
+
+    // Frees every material at once; no scene may still use them
+    void clear() { children.release(); }
+
     RTMaterial *deserializeMaterial(std::istream &iss) {
         std::string type;
         iss >> type;
 
-        std::unique_ptr<RTMaterial> mat;
+        RTMaterial *mat = nullptr;
 
         if (type == "Lambertian") {
-            mat = std::make_unique<RTLambertian>(gm::IVec3f{});
+            mat = MakeLambertian(gm::IVec3f{});
         } else if (type == "Metal") {
-            mat = std::make_unique<RTMetal>(gm::IVec3f{}, 0.0);
+            mat = MakeMetal(gm::IVec3f{}, 0.0);
         } else if (type == "Dielectric") {
-            mat = std::make_unique<RTDielectric>(gm::IVec3f{}, 1.0);
+            mat = MakeDielectric(gm::IVec3f{}, 1.0);
         } else if (type == "Emissive") {
-            mat = std::make_unique<RTEmissive>(gm::IVec3f{});
+            mat = MakeEmissive(gm::IVec3f{});
         } else {
             return nullptr;
         }
 
         iss >> *mat;
-
-        children.push_back(std::move(mat));
-        return children.back().get();
+        return mat;
     }
 };
 
@@ -0,0 +1,90 @@
+#ifndef RTMESH_H
+#define RTMESH_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "RTObjects.h"
+#include "RTBvh.h"
+
+
+// Vertex and index buffers of a triangle mesh and the BVH over its triangles, shared by every
+// TriangleMeshObject that places it in a scene. build() or assign() fills the tree once, before the mesh is
+// shared; the objects only add their position.
+struct TriangleMesh {
+    std::vector<float>    positions;    // x, y, z per vertex
+    std::vector<float>    normals;      // x, y, z per vertex, empty for flat shading
+    std::vector<uint32_t> indices;      // three vertex indices per triangle
+
+    // Filled from the buffers by build() or assign()
+    BVHTree               bvh;
+    std::vector<uint32_t> slotTriangles;    // BVH slot -> triangle
+    std::vector<double>   areaCdf;          // running triangle area, for sampling
+    AABB                  localBox;
+    double                area = 0.0;
+
+    size_t vertexCount()   const { return positions.size() / 3; }
+    size_t triangleCount() const { return indices.size() / 3; }
+    bool   hasNormals()    const { return !normals.empty() && normals.size() == positions.size(); }
+    bool   built()         const { return slotTriangles.size() == triangleCount() && areaCdf.size() == triangleCount(); }
+
+    void build();
+    // Takes a tree saved from bvh and slotTriangles instead of building one; false and a fresh build if it does not fit
+    bool assign(std::vector<BVHTree::Node> nodes, std::vector<uint32_t> slots);
+
+    void vertex(uint32_t index, double out[3]) const;
+
+private:
+    // Triangle bounds, area table and local box; clears the tree for the caller to build or assign
+    void prepare(std::vector<AABB> &bounds);
+};
+
+// Triangle mesh placed at position(). The scene BVH only sees the mesh bounds, so a mesh of any size is one
+// object for SceneManager. Intersection uses the watertight ray/triangle test, rays through shared edges and
+// vertices never slip between neighbouring triangles.
+class TriangleMeshObject : public Primitives {
+public:
+    TriangleMeshObject(const SceneManager *parent=nullptr): Primitives(parent) {}
+    TriangleMeshObject(std::shared_ptr<const TriangleMesh> mesh, RTMaterial *material, const SceneManager *parent=nullptr);
+
+    // Meshes are immutable once shared. One that was not built gets a built copy of its own.
+    void setMesh(std::shared_ptr<const TriangleMesh> mesh);
+    const std::shared_ptr<const TriangleMesh> &mesh() const { return mesh_; }
+
+    std::string typeString() const override { return "TriangleMesh"; }
+
+    AABB boundingBox() const override;
+
+    bool hit(const Ray& ray, Interval rayTime, HitRecord& rec) const override;
+    bool hitExpanded(const Ray& ray, Interval rayTime, HitRecord& rec) const override;
+    bool occludes(const Ray& ray, Interval rayTime) const override;
+    bool selfShadowing() const override { return true; }
+
+    double surfaceArea() const override { return mesh_ ? mesh_->area : 0.0; }
+
+    // Uniform over the area: a triangle picked by its area, then a uniform point inside it
+    bool sampleDirection(const gm::IPoint3 &origin, RTSampler &sampler, gm::IVec3f &direction, double &distance, double &pdf) const override;
+    // Uses the geometric normal of the hit triangle like sampleDirection, not the interpolated shading normal
+    double directionPdf(const gm::IPoint3 &origin, const HitRecord &hitRecord) const override;
+
+protected:
+    std::ostream &dump(std::ostream &stream) const override;
+    std::istream &scan(std::istream &stream) override;
+
+private:
+    struct ShearedRay;
+
+    std::shared_ptr<const TriangleMesh> mesh_;
+
+    bool hasTree() const { return mesh_ && !mesh_->bvh.empty(); }
+
+    // Closest hit in mesh space, the ray is scaled by 1 / scale around the mesh center for the selection outline
+    bool hitMesh(const Ray& ray, Interval rayTime, HitRecord& rec, double scale) const;
+    // Unnormalized, counter-clockwise corners give the outward side
+    gm::IVec3f triangleNormal(uint32_t triangle) const;
+    bool intersect(const ShearedRay &ray, uint32_t triangle, double tMin, double tMax, double &t, double &b1, double &b2) const;
+};
+
+
+#endif // RTMESH_H
@@ -0,0 +1,26 @@
+#ifndef RTMESHLOADER_H
+#define RTMESHLOADER_H
+
+#include <string>
+#include <cstddef>
+
+#include "RTMesh.h"
+
+
+// Triangle mesh readers working on a memory mapped file in a single pass, without allocating per line or face.
+// Polygons are split into triangle fans. The mesh comes back built, ready to share; on failure it is left empty.
+//
+// OBJ: v, vn and f records; negative indices count back from the last vertex, texture coordinates and
+//      everything else are skipped. Every distinct v/vn pair of the faces becomes one vertex, so hard edges
+//      keep their normals; corners without vn take the normal of their faces when others have one.
+// PLY: ascii and binary_little_endian; vertex x y z with optional nx ny nz, face list vertex_indices
+//      (or vertex_index). Other elements are skipped.
+
+// Picks the reader from the file extension (.obj or .ply)
+bool loadMesh(const std::string &path, TriangleMesh &mesh);
+
+bool loadObjMesh(const char *data, size_t size, TriangleMesh &mesh);
+bool loadPlyMesh(const char *data, size_t size, TriangleMesh &mesh);
+
+
+#endif // RTMESHLOADER_H
@@ -0,0 +1,173 @@
+#ifndef RTOBJECTARENA_H
+#define RTOBJECTARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Typed object pools released as a whole. Objects of one type are constructed next to each other in
+// blocks that double in size up to MAX_BLOCK objects, and blocks never move, so pointers stay valid
+// until release(). There is no per-object free: release() runs the destructors in one sweep over each
+// block (none for trivially destructible types) and frees one allocation per block.
+//
+// Not thread safe; parallel producers fill arenas of their own and merge() them afterwards.
+class ObjectArena {
+public:
+    static constexpr size_t FIRST_BLOCK = 64;
+    static constexpr size_t MAX_BLOCK   = 8192;
+
+    ObjectArena() = default;
+    ObjectArena(const ObjectArena &) = delete;
+    ObjectArena &operator=(const ObjectArena &) = delete;
+    ObjectArena(ObjectArena &&other) noexcept { swap(other); }
+    ObjectArena &operator=(ObjectArena &&other) noexcept { release(); swap(other); return *this; }
+    ~ObjectArena() { release(); }
+
+    template <typename T, typename... Args>
+    T *create(Args &&...args) {
+        Pool<T> &typePool = pool<T>();
+        if (typePool.blocks.empty() || typePool.blocks.back().used == typePool.blocks.back().capacity)
+            addRange(typePool.grow());
+
+        typename Pool<T>::Block &block = typePool.blocks.back();
+        T *object = ::new (static_cast<void *>(block.objects + block.used)) T(std::forward<Args>(args)...);
+        block.used++;
+        count_++;
+        return object;
+    }
+
+    // True for objects created by this arena or merged into it
+    bool owns(const void *object) const {
+        const char *address = static_cast<const char *>(object);
+        auto it = std::upper_bound(ranges_.begin(), ranges_.end(), address,
+                                   [](const char *a, const Range &range) { return before(a, range.begin); });
+        return it != ranges_.begin() && before(address, (it - 1)->end);
+    }
+
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+    // Takes over the blocks of other, the objects stay where they are
+    void merge(ObjectArena &&other) {
+        if (this == &other) return;
+        if (pools_.size() < other.pools_.size()) pools_.resize(other.pools_.size());
+        for (size_t i = 0; i < other.pools_.size(); ++i) {
+            if (!other.pools_[i]) continue;
+            if (!pools_[i]) pools_[i] = std::move(other.pools_[i]);
+            else pools_[i]->merge(*other.pools_[i]);
+        }
+        ranges_.insert(ranges_.end(), other.ranges_.begin(), other.ranges_.end());
+        std::sort(ranges_.begin(), ranges_.end(), [](const Range &a, const Range &b) { return before(a.begin, b.begin); });
+        count_ += other.count_;
+
+        other.pools_.clear();
+        other.ranges_.clear();
+        other.count_ = 0;
+    }
+
+    // Destroys every object, in creation order per type, and frees the blocks
+    void release() {
+        for (std::unique_ptr<PoolBase> &typePool : pools_)
+            if (typePool) typePool->release();
+        pools_.clear();
+        ranges_.clear();
+        count_ = 0;
+    }
+
+    void swap(ObjectArena &other) noexcept {
+        pools_.swap(other.pools_);
+        ranges_.swap(other.ranges_);
+        std::swap(count_, other.count_);
+    }
+
+private:
+    struct Range {
+        const char *begin;
+        const char *end;
+    };
+
+    struct PoolBase {
+        virtual ~PoolBase() = default;
+        virtual void release() = 0;
+        virtual void merge(PoolBase &other) = 0;
+    };
+
+    template <typename T>
+    struct Pool : PoolBase {
+        struct Block {
+            T *objects;
+            size_t used;
+            size_t capacity;
+        };
+        std::vector<Block> blocks;
+
+        ~Pool() override { release(); }
+
+        Range grow() {
+            size_t capacity = blocks.empty() ? FIRST_BLOCK : std::min(blocks.back().capacity * 2, MAX_BLOCK);
+            T *objects = std::allocator<T>().allocate(capacity);
+            blocks.push_back({ objects, 0, capacity });
+            return { reinterpret_cast<const char *>(objects), reinterpret_cast<const char *>(objects + capacity) };
+        }
+
+        void release() override {
+            for (Block &block : blocks) {
+                if constexpr (!std::is_trivially_destructible_v<T>)
+                    for (size_t i = 0; i < block.used; ++i) block.objects[i].~T();
+                std::allocator<T>().deallocate(block.objects, block.capacity);
+            }
+            blocks.clear();
+        }
+
+        // Blocks of other go before a partly filled last block, so that one keeps taking new objects
+        void merge(PoolBase &base) override {
+            Pool &other = static_cast<Pool &>(base);
+            if (!blocks.empty() && blocks.back().used < blocks.back().capacity && !other.blocks.empty())
+                blocks.insert(blocks.end() - 1, other.blocks.begin(), other.blocks.end());
+            else
+                blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+            other.blocks.clear();
+        }
+    };
+
+    static size_t nextTypeIndex() {
+        static std::atomic<size_t> next{0};
+        return next++;
+    }
+
+    template <typename T>
+    static size_t typeIndex() {
+        static const size_t index = nextTypeIndex();
+        return index;
+    }
+
+    template <typename T>
+    Pool<T> &pool() {
+        size_t index = typeIndex<T>();
+        if (index >= pools_.size()) pools_.resize(index + 1);
+        if (!pools_[index]) pools_[index] = std::make_unique<Pool<T>>();
+        return static_cast<Pool<T> &>(*pools_[index]);
+    }
+
+    // Blocks are separate allocations, only std::less orders pointers into them
+    static bool before(const char *a, const char *b) { return std::less<const char *>()(a, b); }
+
+    void addRange(Range range) {
+        auto it = std::upper_bound(ranges_.begin(), ranges_.end(), range.begin,
+                                   [](const char *a, const Range &r) { return before(a, r.begin); });
+        ranges_.insert(it, range);
+    }
+
+    std::vector<std::unique_ptr<PoolBase>> pools_;  // by typeIndex<T>()
+    std::vector<Range> ranges_;                     // every block, sorted by address, for owns()
+    size_t count_ = 0;
+};
+
+
+#endif // RTOBJECTARENA_H
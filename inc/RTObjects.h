@@ -30,6 +30,8 @@ protected:
 
     gm::IPoint3 position_{};
     bool selectFlag_ = false;
+    // Index in the scene's emitter list as of its last commit(), stale once the object stops emitting
+    mutable int emitterSlot_ = -1;
 
     Primitives(RTMaterial *material, const SceneManager *parent=nullptr): parent_(parent), material_(material) {
         assert(material);
@@ -56,6 +58,11 @@ protected:
         return stream;
     }
 
+    // Tells the owning scene that the object geometry changed (defined in RayTracer.cpp)
+    void markDirty() const;
+    // Same for the selection flag, which only the scene's selection index cares about
+    void markSelectionChanged() const;
+
     friend inline std::ostream &operator<<(std::ostream &os, const Primitives &p);
     friend inline std::istream &operator>>(std::istream &is, Primitives &p);
 
@@ -65,23 +72,63 @@ public:
     virtual bool hit(const Ray& ray, Interval rayTime, HitRecord& hitRecord) const = 0;
     virtual bool hitExpanded(const Ray& ray, Interval rayTime, HitRecord& hitRecord) const = 0;
 
+    // Any-hit test for shadow rays: true if the object blocks the ray inside rayTime.
+    // Overrides skip the normal and record work of hit().
+    virtual bool occludes(const Ray& ray, Interval rayTime) const {
+        HitRecord tmp;
+        return hit(ray, rayTime, tmp);
+    }
+
+    // Shadow rays from the object's own surface skip it unless it can shadow itself, like a mesh can
+    virtual bool selfShadowing() const { return false; }
+
+    // Infinite boxes keep the object out of the scene BVH
+    virtual AABB boundingBox() const { return AABB::universe; }
+
+    // Area light sampling: picks a direction from origin towards a point on the surface, returns the
+    // distance to that point and the pdf of the direction in solid angle. Objects without a finite
+    // surface return false and are never sampled as lights.
+    virtual bool sampleDirection(const gm::IPoint3 &/*origin*/, RTSampler &/*sampler*/, gm::IVec3f &/*direction*/, double &/*distance*/, double &/*pdf*/) const {
+        return false;
+    }
+
+    // Solid angle pdf of sampleDirection() producing the direction from origin to hitRecord.point
+    virtual double directionPdf(const gm::IPoint3 &/*origin*/, const HitRecord &/*hitRecord*/) const { return 0.0; }
+
+    virtual double surfaceArea() const { return 0.0; }
+
     virtual std::string typeString() const { return "Primitive"; }
 
-    virtual void setPosition(const gm::IPoint3 position) { position_ = position; }
+    virtual void setPosition(const gm::IPoint3 position) { position_ = position; markDirty(); }
     virtual gm::IPoint3 position() const { return position_; }
 
     void setMaterial(RTMaterial *material) {
         material_ = material;
+        markDirty();
     }
     const RTMaterial* material() const { return material_; }
     RTMaterial* material() { return material_; }
 
-    void setSelectFlag(bool val) {selectFlag_ = val; }
+    void setSelectFlag(bool val) {
+        if (selectFlag_ == val) return;
+        selectFlag_ = val;
+        markSelectionChanged();
+    }
     bool selected() const { return selectFlag_; }
 
 friend SceneManager;
 };
 
+// Converts the uniform area pdf 1 / area at point into a solid angle pdf seen from origin
+inline double areaToSolidAnglePdf(const gm::IPoint3 &origin, const gm::IPoint3 &point, const gm::IVec3f &normal, double area) {
+    gm::IVec3f toPoint = point - origin;
+    double distance2 = toPoint.length2();
+    if (area <= 0.0 || distance2 <= 0.0) return 0.0;
+
+    double cosine = std::fabs(dot(normal, toPoint)) / std::sqrt(distance2);
+    return (cosine > 1e-8) ? distance2 / (cosine * area) : 0.0;
+}
+
 class SphereObject : public Primitives {
     double radius_ = 0.0;
 
@@ -93,6 +140,52 @@ public:
         return hitDetail(ray, rayTime, rec, radius_, position_, material_);
     }
 
+    bool occludes(const Ray& ray, Interval rayTime) const override {
+        gm::IVec3f oc = ray.origin - position_;
+        double a = dot(ray.direction, ray.direction);
+        double half_b = dot(oc, ray.direction);
+        double c = dot(oc, oc) - radius_ * radius_;
+
+        double discriminant = half_b*half_b - a*c;
+        if (discriminant < 0.0) return false;
+
+        double sqrtd = std::sqrt(discriminant);
+        return rayTime.surrounds((-half_b - sqrtd) / a) || rayTime.surrounds((-half_b + sqrtd) / a);
+    }
+
+    // Uniform over the cone of directions the sphere subtends from origin
+    bool sampleDirection(const gm::IPoint3 &origin, RTSampler &sampler, gm::IVec3f &direction, double &distance, double &pdf) const override {
+        gm::IVec3f toCenter = position_ - origin;
+        double distance2 = toCenter.length2();
+        double coneSolidAngle = subtendedSolidAngle(distance2);
+        if (coneSolidAngle <= 0.0) return false;
+
+        double cosMax = 1.0 - coneSolidAngle / (2.0 * M_PI);
+        double cosSample, phiSample;
+        sampler.next2D(cosSample, phiSample);
+        double cosTheta = 1.0 - cosSample * (1.0 - cosMax);
+        double sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
+        double phi = 2.0 * M_PI * phiSample;
+
+        double centerDistance = std::sqrt(distance2);
+        gm::IVec3f w = toCenter * (1.0 / centerDistance);
+        gm::IVec3f helper = (std::fabs(w.x()) > 0.9) ? gm::IVec3f(0, 1, 0) : gm::IVec3f(1, 0, 0);
+        gm::IVec3f v = cross(w, helper).normalized();
+        gm::IVec3f u = cross(v, w);
+
+        direction = u * (std::cos(phi) * sinTheta) + v * (std::sin(phi) * sinTheta) + w * cosTheta;
+        distance = centerDistance * cosTheta - std::sqrt(std::max(0.0, radius_ * radius_ - distance2 * sinTheta * sinTheta));
+        pdf = 1.0 / coneSolidAngle;
+        return true;
+    }
+
+    double directionPdf(const gm::IPoint3 &origin, const HitRecord &) const override {
+        double coneSolidAngle = subtendedSolidAngle((position_ - origin).length2());
+        return (coneSolidAngle > 0.0) ? 1.0 / coneSolidAngle : 0.0;
+    }
+
+    double surfaceArea() const override { return 4.0 * M_PI * radius_ * radius_; }
+
     bool hitExpanded(const Ray& ray, Interval rayTime, HitRecord& rec) const override {
         if (!selected()) return false;
         if (hitDetail(ray, rayTime, rec, radius_, position_, material_)) {
@@ -104,12 +197,26 @@ public:
         return result;
     }
 
-    float getRadius() const { return radius_; }
-    void setRadius(const float val) { radius_ = val; }
+    AABB boundingBox() const override {
+        gm::IVec3f radiusVec(radius_, radius_, radius_);
+        return AABB(position_ - radiusVec, position_ + radiusVec);
+    }
+
+    double getRadius() const { return radius_; }
+    void setRadius(const float val) { radius_ = val; markDirty(); }
 
     std::string typeString() const override { return "Sphere"; }
 
 protected:
+    // Solid angle of the cone around the sphere seen from a point at squared distance distance2,
+    // zero from inside the sphere
+    double subtendedSolidAngle(double distance2) const {
+        double radius2 = radius_ * radius_;
+        if (distance2 <= radius2) return 0.0;
+        double cosMax = std::sqrt(1.0 - radius2 / distance2);
+        return 2.0 * M_PI * (1.0 - cosMax);
+    }
+
  
     std::ostream &dump(std::ostream &stream) const override {
         Primitives::dump(stream);
@@ -193,7 +300,11 @@ public:
         return hit(ray, rayTime, hitRecord);
     }
 
-    void setNormal(const gm::IVec3f normal) { normal_ = normal; }
+    bool occludes(const Ray& ray, Interval rayTime) const override {
+        return rayTime.surrounds(dot(normal_, position_ - ray.origin) * (1.0 / dot(normal_, ray.direction)));
+    }
+
+    void setNormal(const gm::IVec3f normal) { normal_ = normal; markDirty(); }
     gm::IVec3f getNormal() const { return normal_; }
 
     std::string typeString() const override { return "Plane"; }
@@ -259,6 +370,17 @@ public:
     void setPosition(const gm::IPoint3 position) { position_ = position; }
     gm::IPoint3 position() const { return position_; }
 
+    gm::IVec3f ambientIntensity()  const { return ambientIntensity_; }
+    gm::IVec3f defuseIntensity()   const { return defuseIntensity_; }
+    gm::IVec3f specularIntensity() const { return specularIntensity_; }
+    double viewLightPow() const { return viewLightPow_; }
+
+    // Importance of the light for stochastic light selection
+    virtual double power() const {
+        gm::IVec3f total = ambientIntensity_ + defuseIntensity_ + specularIntensity_;
+        return (total.x() + total.y() + total.z()) / 3.0;
+    }
+
     const SceneManager *parent() const { return parent_; }
     void setParent(const SceneManager *parent) { parent_ = parent; }
 
@@ -325,6 +447,13 @@ class PolygonObject : public Primitives {
     gm::IVec3f normal_; 
     gm::IPoint3 centroid_; 
 
+    // Derived from the vertices by updateProjection(): vertices and selection outline projected to the
+    // plane that drops projectionAxis_, as u, v pairs, so ray tests neither project nor allocate
+    int projectionAxis_ = 2;
+    std::vector<double> projected_;
+    std::vector<double> expandedProjected_;
+    double area_ = 0.0;
+
 public:
     PolygonObject(const SceneManager *parent=nullptr): Primitives(parent) {}
     PolygonObject(const std::vector<gm::IPoint3> &verts, RTMaterial *material, const SceneManager *parent=nullptr)
@@ -338,6 +467,7 @@ public:
         vertices_ = verts;
         computeNormalAndCentroid();
         if (!vertices_.empty()) position_ = vertices_[0];
+        markDirty();
     }
 
     const std::vector<gm::IPoint3>& vertices() const { return vertices_; }
@@ -355,32 +485,80 @@ public:
         }
         centroid_ = position;
         position_ = position;
+        updateProjection();
+        markDirty();
     }
 
     gm::IPoint3 position() const override {
         return centroid_;
     }
 
+    AABB boundingBox() const override {
+        AABB box;
+        for (const auto &v : vertices_)
+            box = AABB(box, AABB(v, v));
+        return box;
+    }
+
     std::string typeString() const override { return "Polygon"; }
 
     bool hit(const Ray& ray, Interval rayTime, HitRecord& rec) const override {
-        return hitDetail(ray, rayTime, rec, vertices_, normal_, centroid_, material_, /*markExpanded*/false);
+        return hitDetail(ray, rayTime, rec, projected_);
+    }
+
+    bool occludes(const Ray& ray, Interval rayTime) const override {
+        double t = 0.0;
+        if (!planeHit(ray, rayTime, t)) return false;
+
+        double px, py;
+        projectTo2D(projectionAxis_, ray.origin + ray.direction * t, px, py);
+        return pointInPolygon2D(projected_, px, py);
+    }
+
+    // Fan triangles around vertices_[0], exact for convex polygons
+    double surfaceArea() const override { return area_; }
+
+    // Uniform over the area: picks a fan triangle by its area, then a uniform point inside it
+    bool sampleDirection(const gm::IPoint3 &origin, RTSampler &sampler, gm::IVec3f &direction, double &distance, double &pdf) const override {
+        double area = surfaceArea();
+        if (area <= 0.0) return false;
+
+        double target = sampler.next() * area;
+        size_t triangle = 2;
+        for (; triangle + 1 < vertices_.size(); ++triangle) {
+            double triangleArea = fanTriangleArea(triangle);
+            if (target < triangleArea) break;
+            target -= triangleArea;
+        }
+
+        double su, sv;
+        sampler.next2D(su, sv);
+        su = std::sqrt(su);
+        gm::IVec3f edgeA = vertices_[triangle - 1] - vertices_[0];
+        gm::IVec3f edgeB = vertices_[triangle] - vertices_[0];
+        gm::IPoint3 point = vertices_[0] + edgeA * (su * (1.0 - sv)) + edgeB * (su * sv);
+
+        gm::IVec3f toPoint = point - origin;
+        double distance2 = toPoint.length2();
+        if (distance2 <= 0.0) return false;
+        distance = std::sqrt(distance2);
+        direction = toPoint * (1.0 / distance);
+
+        double cosine = std::fabs(dot(normal_, direction));
+        if (cosine <= 1e-8) return false;
+        pdf = distance2 / (cosine * area);
+        return true;
+    }
+
+    double directionPdf(const gm::IPoint3 &origin, const HitRecord &hitRecord) const override {
+        return areaToSolidAnglePdf(origin, hitRecord.point, normal_, surfaceArea());
     }
 
     bool hitExpanded(const Ray& ray, Interval rayTime, HitRecord& rec) const override {
         if (!selected()) return false;
         if (hit(ray, rayTime, rec)) return true;
 
-        if (vertices_.size() < 3) return false;
-        std::vector<gm::IPoint3> expanded;
-        expanded.reserve(vertices_.size());
-        for (const auto &v : vertices_) {
-            gm::IVec3f dir = v - centroid_;
-            gm::IVec3f scaled = dir * EXPAND_COEF;
-            expanded.emplace_back( centroid_.x() + scaled.x(), centroid_.y() + scaled.y(), centroid_.z() + scaled.z() );
-        }
-
-        bool result = hitDetail(ray, rayTime, rec, expanded, normal_, centroid_, material_, /*markExpanded*/true);
+        bool result = hitDetail(ray, rayTime, rec, expandedProjected_);
         if (result) rec.hitExpanded = true;
         return result;
     }
@@ -410,6 +588,13 @@ protected:
     }
 
 private:
+    // Area of the fan triangle (vertices_[0], vertices_[i - 1], vertices_[i])
+    double fanTriangleArea(size_t i) const {
+        gm::IVec3f edgeA = vertices_[i - 1] - vertices_[0];
+        gm::IVec3f edgeB = vertices_[i] - vertices_[0];
+        return 0.5 * std::sqrt(cross(edgeA, edgeB).length2());
+    }
+
     void computeNormalAndCentroid() {
         centroid_ = gm::IPoint3(0.0f, 0.0f, 0.0f);
         if (vertices_.empty()) {
@@ -439,25 +624,51 @@ private:
         } else {
             normal_ = gm::IVec3f(0.0, 0.0, 1.0);
         }
+        updateProjection();
+    }
+
+    void updateProjection() {
+        double ax = std::fabs(normal_.x()), ay = std::fabs(normal_.y()), az = std::fabs(normal_.z());
+        projectionAxis_ = (ax > ay && ax > az) ? 0 : (ay > az) ? 1 : 2;
+
+        projected_.clear();
+        expandedProjected_.clear();
+        for (const auto &v : vertices_) {
+            double u, w;
+            projectTo2D(projectionAxis_, v, u, w);
+            projected_.push_back(u);
+            projected_.push_back(w);
+
+            gm::IVec3f scaled = (v - centroid_) * EXPAND_COEF;
+            gm::IPoint3 expanded(centroid_.x() + scaled.x(), centroid_.y() + scaled.y(), centroid_.z() + scaled.z());
+            projectTo2D(projectionAxis_, expanded, u, w);
+            expandedProjected_.push_back(u);
+            expandedProjected_.push_back(w);
+        }
+
+        area_ = 0.0;
+        for (size_t i = 2; i < vertices_.size(); ++i)
+            area_ += fanTriangleArea(i);
     }
 
-    static void projectTo2D(const gm::IVec3f &normal, const gm::IPoint3 &p, double &u, double &v) {
-        double ax = std::fabs(normal.x()), ay = std::fabs(normal.y()), az = std::fabs(normal.z());
-        if (ax > ay && ax > az) {
+    // Drops the coordinate along axis
+    static void projectTo2D(int axis, const gm::IPoint3 &p, double &u, double &v) {
+        if (axis == 0) {
             u = p.y(); v = p.z();
-        } else if (ay > az) {
+        } else if (axis == 1) {
             u = p.x(); v = p.z();
         } else {
             u = p.x(); v = p.y();
         }
     }
 
-    static bool pointInPolygon2D(const std::vector<std::pair<double,double>> &poly, double px, double py) {
+    // Crossing test against u, v pairs
+    static bool pointInPolygon2D(const std::vector<double> &poly, double px, double py) {
         bool inside = false;
-        size_t n = poly.size();
+        size_t n = poly.size() / 2;
         for (size_t i = 0, j = n - 1; i < n; j = i++) {
-            double xi = poly[i].first, yi = poly[i].second;
-            double xj = poly[j].first, yj = poly[j].second;
+            double xi = poly[2 * i], yi = poly[2 * i + 1];
+            double xj = poly[2 * j], yj = poly[2 * j + 1];
 
             bool intersect = ((yi > py) != (yj > py)) &&
                              (px < (xj - xi) * (py - yi) / (yj - yi + 1e-20) + xi);
@@ -466,77 +677,39 @@ private:
         return inside;
     }
 
-    static bool hitDetail(
-        const Ray& ray, Interval rayTime, HitRecord& rec,
-        const std::vector<gm::IPoint3> &vertices,
-        const gm::IVec3f &normal,
-        const gm::IPoint3 &centroid,
-        RTMaterial *material,
-        bool markExpanded
-    ) {
-        if (vertices.size() < 3) return false;
+    // Ray parameter of the polygon plane, false for rays parallel to it or outside rayTime
+    bool planeHit(const Ray& ray, Interval rayTime, double &t) const {
+        if (vertices_.size() < 3) return false;
+
+        double denom = dot(normal_, ray.direction);
+        if (std::fabs(denom) < 1e-12) return false;
 
-        double denom = dot(normal, ray.direction);
-        if (std::fabs(denom) < 1e-12) return false; 
+        t = dot(normal_, centroid_ - ray.origin) / denom;
+        return rayTime.surrounds(t);
+    }
 
-        double t = dot(normal, centroid - ray.origin) / denom;
-        if (!rayTime.surrounds(t)) return false;
+    bool hitDetail(const Ray& ray, Interval rayTime, HitRecord& rec, const std::vector<double> &outline) const {
+        double t = 0.0;
+        if (!planeHit(ray, rayTime, t)) return false;
 
         gm::IPoint3 p = ray.origin + ray.direction * t;
 
-        std::vector<std::pair<double,double>> poly2d;
-        poly2d.reserve(vertices.size());
         double px, py;
-        projectTo2D(normal, p, px, py);
-        for (const auto &v : vertices) {
-            double u, v2;
-            projectTo2D(normal, v, u, v2);
-            poly2d.emplace_back(u, v2);
-        }
-
-        if (!pointInPolygon2D(poly2d, px, py)) return false;
+        projectTo2D(projectionAxis_, p, px, py);
+        if (!pointInPolygon2D(outline, px, py)) return false;
 
         rec.time = t;
         rec.point = p;
 
-        gm::IVec3f outwardNormal = normal;
-        if (dot(normal, ray.direction) > 0) outwardNormal = normal * (-1);
+        gm::IVec3f outwardNormal = normal_;
+        if (dot(normal_, ray.direction) > 0) outwardNormal = normal_ * (-1);
 
         rec.setFaceNormal(ray, outwardNormal);
-        rec.material = material;
-        rec.object = nullptr;
-        if (!markExpanded) {
-            
-        }
-        return true;
-    }
-
-    bool hitDetailWrapper(const Ray& ray, Interval rayTime, HitRecord& rec,
-                          const std::vector<gm::IPoint3> &vertices,
-                          const gm::IVec3f &normal,
-                          const gm::IPoint3 &centroid,
-                          RTMaterial *material,
-                          bool markExpanded) const
-    {
-        HitRecord localRec;
-        bool ok = hitDetail(ray, rayTime, localRec, vertices, normal, centroid, material, markExpanded);
-        if (!ok) return false;
-        rec = localRec;
-        rec.object = const_cast<PolygonObject*>(this);
+        rec.material = material_;
+        rec.object = this;
+        rec.hitExpanded = false;
         return true;
     }
-
-    bool hit(const Ray& ray, Interval rayTime, HitRecord& rec, const std::vector<gm::IPoint3> &verts, const gm::IVec3f &norm, const gm::IPoint3 &cent) const {
-        return hitDetailWrapper(ray, rayTime, rec, verts, norm, cent, material_, false);
-    }
-
-    bool hitExpandedWrapper(const Ray& ray, Interval rayTime, HitRecord& rec, const std::vector<gm::IPoint3> &verts, const gm::IVec3f &norm, const gm::IPoint3 &cent) const {
-        return hitDetailWrapper(ray, rayTime, rec, verts, norm, cent, material_, true);
-    }
-
-    bool hit(const Ray& ray, Interval rayTime, HitRecord& rec, bool) const {
-        return hitDetailWrapper(ray, rayTime, rec, vertices_, normal_, centroid_, material_, false);
-    }
 };
 
 /* ------------------ CubeObject (axis-aligned box) ------------------ */
@@ -544,17 +717,51 @@ class CubeObject : public Primitives {
     gm::IVec3f halfSize_; 
 
 public:
+    // Outward normal of the box face closest to a surface point
+    static gm::IVec3f faceNormal(const gm::IPoint3 &point, const double minB[3], const double maxB[3]) {
+        const double EPS = 1e-6;
+
+        if (std::fabs(point.x() - minB[0]) < EPS) return gm::IVec3f(-1, 0, 0);
+        if (std::fabs(point.x() - maxB[0]) < EPS) return gm::IVec3f(1, 0, 0);
+        if (std::fabs(point.y() - minB[1]) < EPS) return gm::IVec3f(0, -1, 0);
+        if (std::fabs(point.y() - maxB[1]) < EPS) return gm::IVec3f(0, 1, 0);
+        if (std::fabs(point.z() - minB[2]) < EPS) return gm::IVec3f(0, 0, -1);
+        if (std::fabs(point.z() - maxB[2]) < EPS) return gm::IVec3f(0, 0, 1);
+
+        double local[3] = {
+            point.x() - 0.5 * (minB[0] + maxB[0]),
+            point.y() - 0.5 * (minB[1] + maxB[1]),
+            point.z() - 0.5 * (minB[2] + maxB[2])
+        };
+        double ax = std::fabs(local[0]), ay = std::fabs(local[1]), az = std::fabs(local[2]);
+        if (ax > ay && ax > az) return gm::IVec3f((local[0] > 0) ? 1 : -1, 0, 0);
+        if (ay > az)            return gm::IVec3f(0, (local[1] > 0) ? 1 : -1, 0);
+        return gm::IVec3f(0, 0, (local[2] > 0) ? 1 : -1);
+    }
+
     CubeObject(const SceneManager *parent=nullptr): Primitives(parent), halfSize_(0.5, 0.5, 0.5) {}
     CubeObject(const gm::IVec3f &halfSize, RTMaterial *material, const SceneManager *parent=nullptr)
         : Primitives(material, parent), halfSize_(halfSize) {}
 
     std::string typeString() const override { return "Cube"; }
 
-    void setHalfSize(const gm::IVec3f &hs) { halfSize_ = hs; }
+    void setHalfSize(const gm::IVec3f &hs) { halfSize_ = hs; markDirty(); }
     gm::IVec3f getHalfSize() const { return halfSize_; }
 
+    AABB boundingBox() const override {
+        return AABB(position_ - halfSize_, position_ + halfSize_);
+    }
+
     bool hit(const Ray& ray, Interval rayTime, HitRecord& rec) const override {
-        return hitBox(ray, rayTime, rec, position_, halfSize_, material_, /*markExpanded*/false);
+        if (!hitBox(ray, rayTime, rec, position_, halfSize_, material_, /*markExpanded*/false)) return false;
+        rec.object = this;
+        return true;
+    }
+
+    bool occludes(const Ray& ray, Interval rayTime) const override {
+        double tmin = 0.0, tmax = 0.0;
+        if (!slabs(ray, position_, halfSize_, tmin, tmax)) return false;
+        return rayTime.surrounds(tmin) || rayTime.surrounds(tmax);
     }
 
     bool hitExpanded(const Ray& ray, Interval rayTime, HitRecord& rec) const override {
@@ -563,10 +770,54 @@ public:
 
         gm::IVec3f expandedHalf = halfSize_ * EXPAND_COEF;
         bool result = hitBox(ray, rayTime, rec, position_, expandedHalf, material_, /*markExpanded*/true);
-        if (result) rec.hitExpanded = true;
+        if (result) {
+            rec.hitExpanded = true;
+            rec.object = this;
+        }
         return result;
     }
 
+    double surfaceArea() const override {
+        return 8.0 * (halfSize_.x() * halfSize_.y() + halfSize_.y() * halfSize_.z() + halfSize_.z() * halfSize_.x());
+    }
+
+    // Uniform over the area of the six faces
+    bool sampleDirection(const gm::IPoint3 &origin, RTSampler &sampler, gm::IVec3f &direction, double &distance, double &pdf) const override {
+        double area = surfaceArea();
+        if (area <= 0.0) return false;
+
+        double half[3] = { halfSize_.x(), halfSize_.y(), halfSize_.z() };
+        double faceArea[3] = { half[1] * half[2], half[2] * half[0], half[0] * half[1] };
+        double target = sampler.next() * (faceArea[0] + faceArea[1] + faceArea[2]);
+        int axis = 0;
+        for (; axis < 2; ++axis) {
+            if (target < faceArea[axis]) break;
+            target -= faceArea[axis];
+        }
+
+        double local[3], u, v;
+        local[axis] = (sampler.next() < 0.5) ? -half[axis] : half[axis];
+        sampler.next2D(u, v);
+        local[(axis + 1) % 3] = (2.0 * u - 1.0) * half[(axis + 1) % 3];
+        local[(axis + 2) % 3] = (2.0 * v - 1.0) * half[(axis + 2) % 3];
+        gm::IPoint3 point = position_ + gm::IVec3f(local[0], local[1], local[2]);
+
+        gm::IVec3f toPoint = point - origin;
+        double distance2 = toPoint.length2();
+        if (distance2 <= 0.0) return false;
+        distance = std::sqrt(distance2);
+        direction = toPoint * (1.0 / distance);
+
+        double cosine = std::fabs((axis == 0) ? direction.x() : (axis == 1) ? direction.y() : direction.z());
+        if (cosine <= 1e-8) return false;
+        pdf = distance2 / (cosine * area);
+        return true;
+    }
+
+    double directionPdf(const gm::IPoint3 &origin, const HitRecord &hitRecord) const override {
+        return areaToSolidAnglePdf(origin, hitRecord.point, hitRecord.normal, surfaceArea());
+    }
+
 protected:
     std::ostream &dump(std::ostream &stream) const override {
         Primitives::dump(stream);
@@ -583,16 +834,10 @@ protected:
     }
 
 private:
-    static bool hitBox(
-        const Ray& ray, Interval rayTime, HitRecord& rec,
-        const gm::IPoint3 &center,
-        const gm::IVec3f &halfSize,
-        RTMaterial *material,
-        bool /*markExpanded*/
-    ) {
-        const double EPS = 1e-6;
-        double tmin = -std::numeric_limits<double>::infinity();
-        double tmax =  std::numeric_limits<double>::infinity();
+    // Entry and exit distances of the ray through the box, false if it misses
+    static bool slabs(const Ray& ray, const gm::IPoint3 &center, const gm::IVec3f &halfSize, double &tmin, double &tmax) {
+        tmin = -std::numeric_limits<double>::infinity();
+        tmax =  std::numeric_limits<double>::infinity();
 
         double orig[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
         double dir[3]  = { ray.direction.x(), ray.direction.y(), ray.direction.z() };
@@ -612,6 +857,21 @@ private:
                 if (tmax < tmin) return false;
             }
         }
+        return true;
+    }
+
+    static bool hitBox(
+        const Ray& ray, Interval rayTime, HitRecord& rec,
+        const gm::IPoint3 &center,
+        const gm::IVec3f &halfSize,
+        RTMaterial *material,
+        bool /*markExpanded*/
+    ) {
+        double tmin = 0.0, tmax = 0.0;
+        if (!slabs(ray, center, halfSize, tmin, tmax)) return false;
+
+        double minB[3] = { center.x() - halfSize.x(), center.y() - halfSize.y(), center.z() - halfSize.z() };
+        double maxB[3] = { center.x() + halfSize.x(), center.y() + halfSize.y(), center.z() + halfSize.z() };
 
         double t = tmin;
         if (!rayTime.surrounds(t)) {
@@ -622,21 +882,7 @@ private:
         rec.time = t;
         rec.point = ray.origin + ray.direction * t;
 
-        gm::IVec3f outwardNormal(0.0, 0.0, 0.0);
-        if (std::fabs(rec.point.x() - minB[0]) < EPS) outwardNormal = gm::IVec3f(-1, 0, 0);
-        else if (std::fabs(rec.point.x() - maxB[0]) < EPS) outwardNormal = gm::IVec3f(1, 0, 0);
-        else if (std::fabs(rec.point.y() - minB[1]) < EPS) outwardNormal = gm::IVec3f(0, -1, 0);
-        else if (std::fabs(rec.point.y() - maxB[1]) < EPS) outwardNormal = gm::IVec3f(0, 1, 0);
-        else if (std::fabs(rec.point.z() - minB[2]) < EPS) outwardNormal = gm::IVec3f(0, 0, -1);
-        else if (std::fabs(rec.point.z() - maxB[2]) < EPS) outwardNormal = gm::IVec3f(0, 0, 1);
-        else {
-            gm::IVec3f local = rec.point - center;
-            double ax = std::fabs(local.x()), ay = std::fabs(local.y()), az = std::fabs(local.z());
-            if (ax > ay && ax > az) outwardNormal = gm::IVec3f((local.x() > 0) ? 1 : -1, 0, 0);
-            else if (ay > az) outwardNormal = gm::IVec3f(0, (local.y() > 0) ? 1 : -1, 0);
-            else outwardNormal = gm::IVec3f(0, 0, (local.z() > 0) ? 1 : -1);
-        }
-
+        gm::IVec3f outwardNormal = faceNormal(rec.point, minB, maxB);
         rec.setFaceNormal(ray, outwardNormal);
         rec.material = material;
         rec.object = nullptr; 
@@ -0,0 +1,127 @@
+#ifndef RTPACKET_H
+#define RTPACKET_H
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "RTGeometry.h"
+
+
+// N coherent rays traced together. Lane loops are written for `omp simd`, so with SSE/AVX2 enabled
+// every lane operation of a kernel maps onto one vector instruction; in float twice as many lanes fit.
+template <int N, typename Real = RTReal>
+struct RayPacket {
+    static constexpr int SIZE = N;
+
+    // hitGroup values besides a group id
+    static constexpr int NO_HIT      = -1;
+    static constexpr int VIRTUAL_HIT = -2;    // records[lane] was already filled by a virtual hit
+
+    static constexpr Real EXIT_ROUNDING = Real(1) + Real(6) * std::numeric_limits<Real>::epsilon();
+
+    alignas(64) Real originX[N], originY[N], originZ[N];
+    alignas(64) Real dirX[N], dirY[N], dirZ[N];
+    alignas(64) Real invX[N], invY[N], invZ[N];
+    alignas(64) Real dirLength2[N];
+    alignas(64) Real tMin[N];
+    alignas(64) Real tMax[N];
+
+    int hitGroup[N];
+    int hitSlot[N];
+    HitRecord records[N];
+
+    const Ray *rays = nullptr;
+    int count = 0;
+
+    // Lanes past `count` get tMax = -inf and can never report a hit. tMin is raised per lane by SelfHitEpsilon.
+    void load(const Ray *packetRays, int rayCount, Interval rayTime) {
+        rays  = packetRays;
+        count = rayCount;
+
+        for (int lane = 0; lane < N; ++lane) {
+            const Ray &ray = packetRays[lane < rayCount ? lane : 0];
+            const double origin[3] = { ray.origin.x(), ray.origin.y(), ray.origin.z() };
+            const double length2 = ray.direction.length2();
+
+            originX[lane] = static_cast<Real>(origin[0]);
+            originY[lane] = static_cast<Real>(origin[1]);
+            originZ[lane] = static_cast<Real>(origin[2]);
+            dirX[lane] = static_cast<Real>(ray.direction.x());
+            dirY[lane] = static_cast<Real>(ray.direction.y());
+            dirZ[lane] = static_cast<Real>(ray.direction.z());
+            invX[lane] = Real(1) / dirX[lane];
+            invY[lane] = Real(1) / dirY[lane];
+            invZ[lane] = Real(1) / dirZ[lane];
+            dirLength2[lane] = dirX[lane] * dirX[lane] + dirY[lane] * dirY[lane] + dirZ[lane] * dirZ[lane];
+            tMin[lane] = static_cast<Real>(std::max(rayTime.min, SelfHitEpsilon<Real>::minT(origin, length2)));
+            tMax[lane] = (lane < rayCount) ? static_cast<Real>(rayTime.max) : -std::numeric_limits<Real>::infinity();
+            hitGroup[lane] = NO_HIT;
+            hitSlot[lane]  = -1;
+        }
+    }
+
+    // Packets pay off only while all rays walk the tree in the same order
+    bool coherent() const {
+        for (int lane = 1; lane < count; ++lane) {
+            if ((dirX[lane] < 0) != (dirX[0] < 0)) return false;
+            if ((dirY[lane] < 0) != (dirY[0] < 0)) return false;
+            if ((dirZ[lane] < 0) != (dirZ[0] < 0)) return false;
+        }
+        return true;
+    }
+
+    // Box bounds in Real rounded outward: a float box rounded to nearest can end inside the float-rounded
+    // primitives of its leaf and lose hits at their edges
+    static Real lowerBound(double value) {
+        Real rounded = static_cast<Real>(value);
+        return rounded > value ? std::nextafter(rounded, -std::numeric_limits<Real>::infinity()) : rounded;
+    }
+
+    static Real upperBound(double value) {
+        Real rounded = static_cast<Real>(value);
+        return rounded < value ? std::nextafter(rounded, std::numeric_limits<Real>::infinity()) : rounded;
+    }
+
+    // True if any lane enters the box before its current tMax; tEnter is the smallest entry distance.
+    // Like AABB::hit, empty boxes are missed and the exit is widened by the rounding bound of the slab
+    // arithmetic in Real.
+    bool hitBox(const AABB &box, Real &tEnter) const {
+        if (box.isEmpty()) return false;
+
+        const Real loX = lowerBound(box.x.min), hiX = upperBound(box.x.max);
+        const Real loY = lowerBound(box.y.min), hiY = upperBound(box.y.max);
+        const Real loZ = lowerBound(box.z.min), hiZ = upperBound(box.z.max);
+
+        int anyHit = 0;
+        Real minEnter = std::numeric_limits<Real>::infinity();
+
+        #pragma omp simd reduction(|:anyHit) reduction(min:minEnter)
+        for (int lane = 0; lane < N; ++lane) {
+            Real tx0 = (loX - originX[lane]) * invX[lane], tx1 = (hiX - originX[lane]) * invX[lane];
+            Real ty0 = (loY - originY[lane]) * invY[lane], ty1 = (hiY - originY[lane]) * invY[lane];
+            Real tz0 = (loZ - originZ[lane]) * invZ[lane], tz1 = (hiZ - originZ[lane]) * invZ[lane];
+
+            Real tNear = std::max(std::max(tMin[lane], std::min(tx0, tx1)), std::max(std::min(ty0, ty1), std::min(tz0, tz1)));
+            Real tExit = std::min(std::max(tx0, tx1), std::min(std::max(ty0, ty1), std::max(tz0, tz1))) * EXIT_ROUNDING;
+            Real tFar  = std::min(tMax[lane], tExit);
+
+            int laneHit = tNear <= tFar;
+            anyHit |= laneHit;
+            minEnter = laneHit ? std::min(minEnter, tNear) : minEnter;
+        }
+
+        tEnter = minEnter;
+        return anyHit != 0;
+    }
+
+    Real farthestTMax() const {
+        Real result = -std::numeric_limits<Real>::infinity();
+        for (int lane = 0; lane < count; ++lane)
+            result = std::max(result, tMax[lane]);
+        return result;
+    }
+};
+
+
+#endif // RTPACKET_H
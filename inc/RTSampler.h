@@ -0,0 +1,184 @@
+#ifndef RTSAMPLER_H
+#define RTSAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+
+#include "IVec3f.hpp"
+
+
+enum class RTSamplerType : uint8_t {
+    Random,       // independent values
+    Sobol,        // Owen-scrambled Sobol points, scrambled per pixel
+    BlueNoise,    // one Sobol set shared by all pixels, rotated per pixel by a blue-noise mask
+};
+
+// Counter-based random numbers for one camera sample. Every value is a function of (pixel, sample, bounce,
+// dimension), so an image does not depend on the thread count or on which thread renders which
+// tile. The sampler is the key plus a dimension counter, passed by reference through the sampling calls;
+// a copy replays the same sequence.
+//
+// The sample is the pixel's running sample index across accumulated passes, so a pixel never repeats a
+// point until its accumulation restarts. The Sobol samplers take it as the point index and pad the dimensions with independently
+// shuffled 4D Sobol sets (Burley, "Practical Hash-based Owen Scrambling"), so the samples of one pixel
+// are stratified in every pair of dimensions that next2D() draws together.
+class RTSampler {
+public:
+    static constexpr int BLUE_NOISE_SIZE = 64;
+
+    RTSampler() = default;
+
+    RTSampler(RTSamplerType type, uint32_t pixelX, uint32_t pixelY, uint32_t sample)
+        : type_(type), sample_(sample), pixelX_(pixelX), pixelY_(pixelY)
+    {
+        // The Sobol keys must not depend on the sample, its points only stratify within one scramble
+        uint64_t pixelKey = mix(SEQUENCE_KEY ^ ((static_cast<uint64_t>(pixelY) << 32) | pixelX));
+        switch (type) {
+            case RTSamplerType::Random:    key_ = mix(pixelKey + sample); break;
+            case RTSamplerType::Sobol:     key_ = pixelKey;               break;
+            case RTSamplerType::BlueNoise: key_ = SEQUENCE_KEY;           break;
+        }
+    }
+
+    // Path vertices number their draws from 0, so a bounce that takes more or fewer values does not
+    // shift those of the next one. Bounce 0 is the camera ray.
+    void setBounce(uint32_t bounce) {
+        bounce_ = bounce;
+        dimension_ = 0;
+    }
+
+    uint32_t bounce() const { return bounce_; }
+    uint32_t dimension() const { return dimension_; }
+
+    // Uniform in [0, 1)
+    double next() {
+        uint32_t dimension = dimension_++;
+        switch (type_) {
+            case RTSamplerType::Random:    break;
+            case RTSamplerType::Sobol:     return toUnit(sobol(dimension));
+            case RTSamplerType::BlueNoise: return toUnit(sobol(dimension) + blueNoiseRotation(dimension));
+        }
+        uint64_t counter = (static_cast<uint64_t>(bounce_) << 32) | dimension;
+        return static_cast<double>(mix(key_ + counter * GOLDEN_GAMMA) >> 11) * 0x1.0p-53;
+    }
+
+    double next(double min, double max) { return min + (max - min) * next(); }
+
+    // Two values from one 2D projection of the point set: starts at an even dimension
+    void next2D(double &u, double &v) {
+        dimension_ += dimension_ & 1;
+        u = next();
+        v = next();
+    }
+
+    // Uniform on the unit sphere
+    gm::IVec3f nextUnitVector() {
+        double u, v;
+        next2D(u, v);
+        double z = 1.0 - 2.0 * u;
+        double phi = 2.0 * M_PI * v;
+        double r = std::sqrt(std::fmax(0.0, 1.0 - z * z));
+        return gm::IVec3f(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    // BLUE_NOISE_SIZE^2 ranks, row by row: every value once, neighbouring cells far apart. Built on first use.
+    static const uint16_t *blueNoiseMask();
+
+private:
+    static constexpr uint64_t GOLDEN_GAMMA = 0x9E3779B97F4A7C15ull;
+    static constexpr uint64_t SEQUENCE_KEY = 0xD1B54A32D192ED03ull;
+
+    // SplitMix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    static double toUnit(uint32_t x) { return static_cast<double>(x) * 0x1.0p-32; }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+        x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Owen scrambling as a hash: a Laine-Karras permutation on the reversed bits
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        x ^= x * 0x3D20ADEAu;
+        x += seed;
+        x *= (seed >> 16) | 1u;
+        x ^= x * 0x05526C56u;
+        x ^= x * 0x53A22864u;
+        return reverseBits(x);
+    }
+
+    // Generator matrices of the first four Sobol dimensions (Joe and Kuo direction numbers)
+    struct SobolMatrices {
+        uint32_t columns[4][32];
+
+        constexpr SobolMatrices() : columns() {
+            const uint32_t degree[4]       = { 0, 1, 2, 3 };
+            const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+            const uint32_t initial[4][3]   = { {}, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+
+            for (int bit = 0; bit < 32; ++bit)
+                columns[0][bit] = 1u << (31 - bit);
+
+            for (int dimension = 1; dimension < 4; ++dimension) {
+                uint32_t s = degree[dimension];
+                for (uint32_t bit = 0; bit < 32; ++bit) {
+                    if (bit < s) {
+                        columns[dimension][bit] = initial[dimension][bit] << (31 - bit);
+                        continue;
+                    }
+                    uint32_t column = columns[dimension][bit - s] ^ (columns[dimension][bit - s] >> s);
+                    for (uint32_t k = 1; k < s; ++k)
+                        if ((coefficients[dimension] >> (s - 1 - k)) & 1u) column ^= columns[dimension][bit - k];
+                    columns[dimension][bit] = column;
+                }
+            }
+        }
+    };
+
+    static uint32_t sobolPoint(uint32_t index, int dimension) {
+        static constexpr SobolMatrices MATRICES;
+        uint32_t result = 0;
+        for (int bit = 0; index != 0; index >>= 1, ++bit)
+            if (index & 1u) result ^= MATRICES.columns[dimension][bit];
+        return result;
+    }
+
+    // Every group of four dimensions gets its own shuffle of the point order and its own scrambles
+    uint32_t sobol(uint32_t dimension) const {
+        uint64_t group = (static_cast<uint64_t>(bounce_) << 32) | (dimension >> 2);
+        uint64_t groupSeed = mix(key_ + group * GOLDEN_GAMMA);
+        uint32_t index = nestedUniformScramble(sample_, static_cast<uint32_t>(groupSeed));
+        uint32_t scrambleSeed = static_cast<uint32_t>(mix(groupSeed + (dimension & 3u)));
+        return nestedUniformScramble(sobolPoint(index, dimension & 3u), scrambleSeed);
+    }
+
+    // Per-pixel rotation in 32-bit fixed point, the mask shifted by a per-dimension offset
+    uint32_t blueNoiseRotation(uint32_t dimension) const {
+        static_assert(BLUE_NOISE_SIZE * BLUE_NOISE_SIZE == 1 << 12, "ranks are scaled by 2^20");
+        uint64_t shift = mix((static_cast<uint64_t>(bounce_) << 32) | dimension);
+        uint32_t x = (pixelX_ + static_cast<uint32_t>(shift)) % BLUE_NOISE_SIZE;
+        uint32_t y = (pixelY_ + static_cast<uint32_t>(shift >> 32)) % BLUE_NOISE_SIZE;
+        uint32_t rank = blueNoiseMask()[y * BLUE_NOISE_SIZE + x];
+        return (rank << 20) | (1u << 19);
+    }
+
+    uint64_t key_ = 0;
+    RTSamplerType type_ = RTSamplerType::Random;
+    uint32_t bounce_ = 0;
+    uint32_t dimension_ = 0;
+    uint32_t sample_ = 0;
+    uint32_t pixelX_ = 0;
+    uint32_t pixelY_ = 0;
+};
+
+
+#endif // RTSAMPLER_H
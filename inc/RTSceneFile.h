@@ -0,0 +1,27 @@
+#ifndef RTSCENEFILE_H
+#define RTSCENEFILE_H
+
+#include <string>
+
+#include "RayTracer.h"
+#include "RTMaterial.h"
+
+
+// Binary scene files: a header, a section table and flat arrays of fixed size records, 8-byte aligned,
+// so a memory mapped file is read in place instead of parsed. Holds materials, spheres, cubes, planes,
+// polygons, triangle meshes (shared vertex data stored once, with the triangle BVH) and lights.
+//
+// With storeAcceleration the scene BVHs built by the writer are stored too. Loading them into an empty
+// scene hands them to SceneManager::adoptAcceleration, so the first commit() has nothing to build.
+//
+// Version 1 files are little endian; readers reject other versions and mismatched record sizes.
+
+// False if the file cannot be written or the scene holds a type the format does not know
+bool saveSceneBinary(const std::string &path, const SceneManager &scene, bool storeAcceleration = true);
+
+// Adds the stored materials to `materials` and the objects and lights to `scene`.
+// False on a missing or malformed file, in which case nothing is added to the scene.
+bool loadSceneBinary(const std::string &path, SceneManager &scene, RTMaterialManager &materials);
+
+
+#endif // RTSCENEFILE_H
@@ -0,0 +1,28 @@
+#ifndef RTSCENETEXT_H
+#define RTSCENETEXT_H
+
+#include <string>
+
+#include "RayTracer.h"
+#include "RTMaterial.h"
+
+
+// Text scenes made of the dump records of materials, objects and lights, one record per line:
+//
+//   Lambertian 0.5 0.5 0.5 0 0 0 0 0 0      material 0, materials are numbered in file order
+//   Sphere 1 2 3 0 0.5 0                    object dump followed by the index of its material
+//   Light 5 0 10 0.05 0.05 0.05 ...
+//
+// An object line without a material index uses the material defined last before it. Empty lines and
+// lines starting with '#' are skipped.
+
+// Writes every material once, before the first object that uses it
+bool saveSceneText(const std::string &path, const SceneManager &scene);
+
+// Maps the file, parses record-aligned chunks of it in parallel and then adds the materials, objects and
+// lights in file order. Numbers are read into the same types the scan() functions use, so the scene is
+// the one the istream operators would build. False on a missing or malformed file, with nothing added.
+bool loadSceneText(const std::string &path, SceneManager &scene, RTMaterialManager &materials);
+
+
+#endif // RTSCENETEXT_H
@@ -0,0 +1,49 @@
+#ifndef RTTEXTCURSOR_H
+#define RTTEXTCURSOR_H
+
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+
+// Cursor over a text buffer; every parse function stops at the end of the buffer, which need not be terminated
+struct TextCursor {
+    const char *at;
+    const char *end;
+
+    bool done() const { return at >= end; }
+
+    void skipSpaces() {
+        while (at < end && (*at == ' ' || *at == '\t' || *at == '\r')) ++at;
+    }
+
+    void skipLine() {
+        const char *newline = static_cast<const char *>(std::memchr(at, '\n', end - at));
+        at = newline ? newline + 1 : end;
+    }
+
+    bool atLineEnd() {
+        skipSpaces();
+        return at >= end || *at == '\n' || *at == '#';
+    }
+
+    std::string_view word() {
+        skipSpaces();
+        const char *begin = at;
+        while (at < end && *at != ' ' && *at != '\t' && *at != '\r' && *at != '\n') ++at;
+        return std::string_view(begin, at - begin);
+    }
+
+    template <typename T>
+    bool number(T &value) {
+        skipSpaces();
+        if (at < end && *at == '+') ++at;
+        auto result = std::from_chars(at, end, value);
+        if (result.ec != std::errc()) return false;
+        at = result.ptr;
+        return true;
+    }
+};
+
+
+#endif // RTTEXTCURSOR_H
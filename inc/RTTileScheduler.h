@@ -0,0 +1,46 @@
+#ifndef RTTILESCHEDULER_H
+#define RTTILESCHEDULER_H
+
+#include <vector>
+#include <mutex>
+
+
+struct RenderTile {
+    int x, y;
+    int width, height;
+};
+
+// Splits the screen into tiles, orders them along a Morton curve and deals contiguous runs of that order
+// to per-thread queues. A thread pops tiles from the front of its own queue; once it is empty it steals
+// the back half of the fullest queue, so neighbouring tiles stay on one thread for as long as possible.
+class TileScheduler {
+public:
+    TileScheduler() = default;
+
+    // tileWidth is rounded up to a multiple of `alignment`, tileHeight fills up to pixelsPerTile pixels
+    void build(int screenWidth, int screenHeight, int pixelsPerTile, int alignment, int threadCount);
+
+    // Returns false once no queue has tiles left
+    bool next(int threadId, RenderTile &tile);
+
+    int tileCount()   const { return static_cast<int>(tiles_.size()); }
+    int stolenTiles() const { return stolenTiles_; }
+
+private:
+    // Tiles [begin, end) of tiles_, front is taken by the owner and the back half by thieves
+    struct alignas(64) TileQueue {
+        std::mutex mutex;
+        int begin = 0;
+        int end   = 0;
+    };
+
+    std::vector<RenderTile> tiles_;
+    std::vector<TileQueue>  queues_;
+    std::mutex stealMutex_;
+    int stolenTiles_ = 0;
+
+    bool steal(int threadId);
+};
+
+
+#endif // RTTILESCHEDULER_H
@@ -1,35 +1,143 @@
 #ifndef RAY_TRACER_H
 #define RAY_TRACER_H
 
+#include <cstdint>
+#include <type_traits>
+
 #include "RTObjects.h"
+#include "RTCompiledScene.h"
+#include "RTLightTree.h"
+#include "RTObjectArena.h"
 class Camera;
 
 
+struct AccelerationStats {
+    double rebuildMs       = 0.0;
+    double refitMs         = 0.0;
+    int    refittedObjects = 0;
+    int    evictedObjects  = 0;
+    int    rebuiltSubtrees = 0;
+    int    rebuiltGroups   = 0;
+    bool   fullRebuild     = false;
+};
+
+// Scene BVHs built ahead of time, e.g. stored in a binary scene file. Every bounded primitive of the
+// scene appears in exactly one slot list, in the slot order of the matching tree.
+struct PrebuiltAcceleration {
+    std::vector<Primitives *> sphereSlots, boxSlots, otherSlots;
+    std::vector<BVHTree::Node> sphereNodes, boxNodes, otherNodes;
+};
+
 class SceneManager {
     std::vector<Primitives *> primitives_;
     std::vector<Light *> directLightSources_;
+    // Objects and lights made by make(), everything else in the lists was allocated with new
+    ObjectArena arena_;
+
+    // Compiled representation of primitives_, kept up to date by commit()
+    mutable MaterialRegistry materials_;
+    mutable PrimitiveGroup<SphereStorage> spheres_;
+    mutable PrimitiveGroup<BoxStorage>    boxes_;
+    mutable PrimitiveGroup<ObjectStorage> others_;
+    mutable std::vector<Primitives *> unboundedPrimitives_;
+    mutable std::vector<const Primitives *> dirtyPrimitives_;
+    // Objects with the select flag, the only ones hitExpanded can report
+    mutable std::vector<const Primitives *> selectedPrimitives_;
+    mutable bool accelerationDirty_ = true;
+
+    mutable uint64_t revision_ = 0;
+
+    mutable LightTree lightTree_;
+
+    // Emissive objects with a finite surface, picked in proportion to emitted power times area
+    mutable std::vector<const Primitives *> emitters_;
+    mutable std::vector<double> emitterCdf_;
+    mutable std::vector<double> emitterPmf_;    // parallel to emitters_
+
+    mutable AccelerationStats accelerationStats_;
+
 public:
     SceneManager() = default;
 
     ~SceneManager();
 
+    // Objects and lights are either allocated with new or made by this scene's make(); the scene deletes
+    // the ones it does not own through its arena in clear(). Adding one made by another scene's make()
+    // would delete arena memory.
     void addObject(const gm::IPoint3 position, Primitives *object);
     void eraseObject(Primitives *primitive);
     void addLight(const gm::IPoint3 position, Light *light);
     void addObject(Primitives *object);
     void addLight(Light *light);
+    // Deletes the objects and lights allocated with new and releases the arena in one go
     void clear();
 
+    // Object or light constructed in the scene arena, next to the others of its type. It still has to be
+    // added; the scene frees it in clear() or its destructor, erased or not, and never before.
+    template <typename T, typename... Args>
+    T *make(Args &&...args) {
+        static_assert(std::is_base_of_v<Primitives, T> || std::is_base_of_v<Light, T>, "make() builds objects and lights");
+        return arena_.create<T>(std::forward<Args>(args)...);
+    }
+    // Takes over objects built in a separate arena, e.g. by parallel loaders; they are still to be added
+    void adoptObjects(ObjectArena &&arena) { arena_.merge(std::move(arena)); }
+
+    // Flattens the primitives into per-type arrays and brings their BVHs up to date: edited objects are
+    // refitted, degraded subtrees rebuilt, and a group is rebuilt only when its flat list grows too long.
+    // Camera::render commits every frame; until then hitClosest falls back to a linear scan.
+    void commit() const;
+    void markDirty(const Primitives *object) const;
+    void selectionChanged(const Primitives *object) const;
+    void invalidateAcceleration() const;
+    // Uses prebuilt trees instead of building on the next commit(). On false the scene builds as usual.
+    bool adoptAcceleration(PrebuiltAcceleration &&prebuilt) const;
+    const AccelerationStats &accelerationStats() const { return accelerationStats_; }
+
+    // Bumped by every object/light list change and primitive setter; cameras restart accumulation when it moves
+    uint64_t revision() const { return revision_; }
 
     bool hitClosest(const Ray& ray, Interval rayTime, HitRecord& hitRecord, bool hitExpandedState) const;
 
+    // Table record of the hit material as of the last commit(), Custom for materials it has not seen
+    const MaterialRecord &materialRecord(const HitRecord &hitRecord) const { return materials_.record(hitRecord.materialId); }
+
+    // Shadow query: true as soon as any object other than `ignore` blocks the ray inside rayTime
+    bool occluded(const Ray& ray, Interval rayTime, const Primitives *ignore = nullptr) const;
+
+    // hitClosest for up to N (4, 8 or 16) coherent rays at once; divergent packets are traced one ray at a time
+    template <int N>
+    void hitClosestPacket(const Ray *rays, int count, Interval rayTime, HitRecord *hitRecords, bool *hits, bool hitExpandedState) const;
+
     const std::vector<Light *> &inderectLightSources() const;
 
+    // Light tree over the light sources as of the last commit()
+    const LightTree &lightTree() const { return lightTree_; }
+
+    // Area lights as of the last commit(): picks an emissive object with a uniform random number u
+    // in [0, 1) and returns its selection probability, nullptr when the scene has none
+    const Primitives *sampleEmitter(double u, double &pmf) const;
+    // Selection probability of object in sampleEmitter(), 0 for objects that are not area lights
+    double emitterPmf(const Primitives *object) const;
+    bool hasEmitters() const { return !emitters_.empty(); }
 
+
+    // Changing the list size through this reference forces a full rebuild on the next commit
     std::vector<Primitives *> &primitives() { return primitives_; }
     std::vector<Light *> &lights() { return directLightSources_; }
     const std::vector<Primitives *> &primitives() const { return primitives_; }
+    const std::vector<const Primitives *> &selectedPrimitives() const { return selectedPrimitives_; }
     const std::vector<Light *> &lights() const { return directLightSources_; }
+
+private:
+    void rebuildAcceleration() const;
+    void refitAcceleration() const;
+    void gatherEmitters() const;
+    void trackObject(Primitives *object) const;
+    void untrackObject(const Primitives *object) const;
+    bool accelerationValid() const;
+    bool hitSelected(const Ray& ray, Interval rayTime, HitRecord& hitRecord) const;
+    void resolveMaterial(HitRecord &hitRecord) const;
+    size_t trackedObjects() const;
 };
 
 
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <omp.h>
 #include <cassert>
 
@@ -7,7 +9,23 @@
 #include "Output.h"
 
 // Utilities
-static constexpr double CLOSEST_HIT_MIN_T = 0.001;
+static constexpr double CLOSEST_HIT_MIN_T = SelfHitEpsilon<RTReal>::MIN_T;
+
+// Id of a pixel whose first sample has not been traced yet, -1 is a miss
+static constexpr int NO_FIRST_HIT = -2;
+
+// Adaptive sampling measures the standard error against at least this luminance, so black pixels can converge
+static constexpr double ADAPTIVE_LUMINANCE_FLOOR = 0.05;
+
+inline double luminance(const RTColor &color) {
+    return 0.2126 * color.x() + 0.7152 * color.y() + 0.0722 * color.z();
+}
+
+// Object a shadow ray from the hit point may skip; self-shadowing ones rely on CLOSEST_HIT_MIN_T instead
+inline const Primitives *shadowIgnore(const HitRecord &rec) {
+    return (rec.object && !rec.object->selfShadowing()) ? rec.object : nullptr;
+}
+
 inline double linearToGamma(double linear_component)
 {
     if (linear_component > 0)
@@ -37,28 +55,298 @@ RTPixelColor convertRTColor(const RTColor &color) {
 // Constructors
 Camera::Camera() { 
     updateViewPort(); 
+    threadCounters_.assign(std::max(1, omp_get_max_threads()), RenderCounters{});
 }
 
 // Camera control
 void Camera::move(const gm::IVec3f motionVec) {
     center_ = center_ + motionVec;
     updateViewPort();
+    resetAccumulation();
 }
 
 void Camera::rotate(const double widthRadians, const double heightRadians) {
     direction_.rotate(viewPort_.downDir_, -widthRadians);
     direction_.rotate(viewPort_.rightDir_, heightRadians);
     updateViewPort();
+    resetAccumulation();
 }
 
 
 // Render
+namespace {
+
+bool sameImageSettings(const CameraRenderProperties &a, const CameraRenderProperties &b) {
+    return a.samplesPerScatter   == b.samplesPerScatter   &&
+           a.maxRayDepth         == b.maxRayDepth         &&
+           a.enableLDirect       == b.enableLDirect       &&
+           a.enableRayTracerMode == b.enableRayTracerMode &&
+           a.integrator          == b.integrator          &&
+           a.enableDenoiser      == b.enableDenoiser      &&
+           a.samplerType         == b.samplerType;
+}
+
+} // namespace
+
+void Camera::resetAccumulation() {
+    accumulatedPasses_ = 0;
+}
+
+void Camera::beginPass(const SceneManager& sceneManager, const std::pair<int, int> screenResolution) {
+    bool restart = !renderProperties.enableAccumulation                         ||
+                   accumulationResolution_    != screenResolution               ||
+                   accumulationScene_         != &sceneManager                  ||
+                   accumulationSceneRevision_ != sceneManager.revision()        ||
+                   !sameImageSettings(accumulationProperties_, renderProperties);
+    if (restart) resetAccumulation();
+
+    accumulationResolution_    = screenResolution;
+    accumulationScene_         = &sceneManager;
+    accumulationSceneRevision_ = sceneManager.revision();
+    accumulationProperties_    = renderProperties;
+
+    threadCounters_.assign(std::max(1, omp_get_max_threads()), RenderCounters{});
+    passStart_ = std::chrono::steady_clock::now();
+
+    if (accumulatedPasses_ == 0) {
+        size_t pixelCount = static_cast<size_t>(screenResolution.first) * screenResolution.second;
+        accumulation_.assign(pixelCount, RTColor(0, 0, 0));
+        luminanceSquares_.assign(pixelCount, 0.0);
+        sampleCounts_.assign(pixelCount, 0);
+        resetFirstHits(sceneManager, pixelCount);
+    }
+}
+
+void Camera::finishPass(std::vector<RTPixelColor> &outputBufer) {
+    accumulatedPasses_++;
+
+    size_t pixelCount = std::min(outputBufer.size(), accumulation_.size());
+    bool denoise = renderProperties.enableDenoiser && firstHitDepth_.size() == pixelCount;
+    if (denoise) filterAccumulation();
+    writeAovs(pixelCount);
+
+    long long totalSamples = 0;
+    for (size_t pixelId = 0; pixelId < pixelCount; ++pixelId) {
+        int samples = sampleCounts_[pixelId];
+        if (denoise)
+            outputBufer[pixelId] = convertRTColor(denoiser_.color(pixelId));
+        else
+            outputBufer[pixelId] = convertRTColor(samples > 0 ? accumulation_[pixelId] * (1.0 / samples) : RTColor(0, 0, 0));
+        totalSamples += samples;
+    }
+    averageSamplesPerPixel_ = pixelCount > 0 ? static_cast<double>(totalSamples) / pixelCount : 0.0;
+
+    renderStats_ = {};
+    for (const RenderCounters &counters : threadCounters_) {
+        renderStats_.pathRays            += counters.pathRays;
+        renderStats_.shadowRays          += counters.shadowRays;
+        renderStats_.rouletteTerminations += counters.rouletteTerminations;
+    }
+    renderStats_.samples  = totalSamples;
+    renderStats_.renderMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - passStart_).count();
+
+    if (!renderProperties.enableAccumulation) resetAccumulation();
+}
+
+void Camera::addSample(int pixelId, const RTColor &color) {
+    double sampleLuminance = luminance(color);
+    accumulation_[pixelId] += color;
+    luminanceSquares_[pixelId] += sampleLuminance * sampleLuminance;
+    sampleCounts_[pixelId]++;
+}
+
+void Camera::setAovBuffer(RTAov aov, std::vector<float> *buffer) {
+    std::vector<float> *&registered = aovBuffers_[static_cast<int>(aov)];
+    if (registered == buffer) return;
+
+    registered = buffer;
+    resetAccumulation();
+}
+
+// Only what the denoiser and the registered AOVs read is captured, the rest stays empty
+void Camera::resetFirstHits(const SceneManager& sceneManager, size_t pixelCount) {
+    auto captured = [&](auto &buffer, bool enabled, const auto &value) {
+        if (enabled) buffer.assign(pixelCount, value);
+        else         buffer.clear();
+    };
+    auto registered = [&](RTAov aov) { return aovBuffers_[static_cast<int>(aov)] != nullptr; };
+
+    bool denoise = renderProperties.enableDenoiser;
+    captured(firstHitAlbedo_,     denoise || registered(RTAov::Albedo), RTColor(0, 0, 0));
+    captured(firstHitNormal_,     denoise || registered(RTAov::Normal), gm::IVec3f(0, 0, 0));
+    captured(firstHitDepth_,      denoise || registered(RTAov::Depth),  0.0);
+    captured(firstHitMaterials_,  registered(RTAov::MaterialId),        NO_FIRST_HIT);
+    captured(firstHitPrimitives_, registered(RTAov::PrimitiveId),       NO_FIRST_HIT);
+
+    primitiveIds_.clear();
+    if (!registered(RTAov::PrimitiveId)) return;
+    const std::vector<Primitives *> &primitives = sceneManager.primitives();
+    for (size_t index = 0; index < primitives.size(); ++index)
+        primitiveIds_[primitives[index]] = static_cast<int>(index);
+}
+
+void Camera::addFirstHit(int pixelId, const Ray &ray, const HitRecord *rec, const SceneManager& sceneManager) {
+    if (!firstHitMaterials_.empty() && firstHitMaterials_[pixelId] == NO_FIRST_HIT)
+        firstHitMaterials_[pixelId] = rec ? static_cast<int>(rec->materialId) : -1;
+
+    if (!firstHitPrimitives_.empty() && firstHitPrimitives_[pixelId] == NO_FIRST_HIT) {
+        auto id = rec ? primitiveIds_.find(rec->object) : primitiveIds_.end();
+        firstHitPrimitives_[pixelId] = id != primitiveIds_.end() ? id->second : -1;
+    }
+
+    if (!firstHitAlbedo_.empty())
+        firstHitAlbedo_[pixelId] += rec ? firstHitAlbedo(*rec, sceneManager) : getBackgroundColor(ray);
+
+    if (!rec) return;
+    if (!firstHitNormal_.empty()) firstHitNormal_[pixelId] += rec->normal;
+    if (!firstHitDepth_.empty())  firstHitDepth_[pixelId]  += rec->time;
+}
+
+// Emitters keep their own color as albedo, like misses, so demodulating them leaves about 1
+RTColor Camera::firstHitAlbedo(const HitRecord &rec, const SceneManager& sceneManager) const {
+    if (rec.hitExpanded) return RTColor(1.0, 0.0, 0.0);
+
+    const MaterialRecord &material = sceneManager.materialRecord(rec);
+    RTColor albedo = material.kind == MaterialKind::Custom ? rec.material->diffuse() : material.albedo;
+    if (albedo.x() <= 0 && albedo.y() <= 0 && albedo.z() <= 0) albedo = emittedMaterial(material, rec);
+    return albedo;
+}
+
+void Camera::writeAovs(size_t pixelCount) {
+    for (int aovIndex = 0; aovIndex < RT_AOV_COUNT; ++aovIndex) {
+        std::vector<float> *buffer = aovBuffers_[aovIndex];
+        if (!buffer) continue;
+
+        RTAov aov = static_cast<RTAov>(aovIndex);
+        int channels = aovChannels(aov);
+        buffer->resize(pixelCount * channels);
+        float *out = buffer->data();
+
+        #pragma omp parallel for schedule(static)
+        for (long long pixelId = 0; pixelId < static_cast<long long>(pixelCount); ++pixelId) {
+            int samples = sampleCounts_[pixelId];
+            double inverse = samples > 0 ? 1.0 / samples : 0.0;
+            float *pixel = out + pixelId * channels;
+
+            switch (aov) {
+                case RTAov::Depth:
+                    pixel[0] = static_cast<float>(firstHitDepth_[pixelId] * inverse);
+                    break;
+                case RTAov::Normal:
+                case RTAov::Albedo: {
+                    const gm::IVec3f &sum = aov == RTAov::Normal ? firstHitNormal_[pixelId] : firstHitAlbedo_[pixelId];
+                    pixel[0] = static_cast<float>(sum.x() * inverse);
+                    pixel[1] = static_cast<float>(sum.y() * inverse);
+                    pixel[2] = static_cast<float>(sum.z() * inverse);
+                    break;
+                }
+                case RTAov::MaterialId:
+                    pixel[0] = static_cast<float>(std::max(-1, firstHitMaterials_[pixelId]));
+                    break;
+                case RTAov::PrimitiveId:
+                    pixel[0] = static_cast<float>(std::max(-1, firstHitPrimitives_[pixelId]));
+                    break;
+                case RTAov::SampleCount:
+                    pixel[0] = static_cast<float>(samples);
+                    break;
+            }
+        }
+    }
+}
+
+// Means of the accumulated samples and their guides, filtered by the denoiser
+void Camera::filterAccumulation() {
+    int width = accumulationResolution_.first, height = accumulationResolution_.second;
+    denoiser_.resize(width, height);
+
+    #pragma omp parallel for schedule(static)
+    for (int pixelId = 0; pixelId < width * height; ++pixelId) {
+        int samples = sampleCounts_[pixelId];
+        if (samples == 0) {
+            denoiser_.setPixel(pixelId, RTColor(0, 0, 0), 0.0, RTColor(0, 0, 0), gm::IVec3f(0, 0, 0), 0.0);
+            continue;
+        }
+
+        double inverse = 1.0 / samples;
+        RTColor mean = accumulation_[pixelId] * inverse;
+        // Variance of the mean luminance; a single sample has none to measure, it is taken as fully uncertain
+        double meanLuminance = luminance(mean);
+        double variance = meanLuminance * meanLuminance;
+        if (samples > 1)
+            variance = std::max(0.0, luminanceSquares_[pixelId] * inverse - meanLuminance * meanLuminance) / (samples - 1);
+
+        denoiser_.setPixel(pixelId, mean, variance, firstHitAlbedo_[pixelId] * inverse,
+                           firstHitNormal_[pixelId] * inverse, firstHitDepth_[pixelId] * inverse);
+    }
+
+    denoiser_.filter(renderProperties.denoiserIterations);
+}
+
+bool Camera::pixelConverged(int pixelId) const {
+    int samples = sampleCounts_[pixelId];
+    if (samples < std::max(2, renderProperties.samplesPerPixel)) return false;
+
+    double mean = luminance(accumulation_[pixelId]) / samples;
+    double variance = (luminanceSquares_[pixelId] / samples - mean * mean) * samples / (samples - 1);
+    double standardError = std::sqrt(std::max(0.0, variance) / samples);
+    return standardError <= renderProperties.noiseThreshold * std::max(mean, ADAPTIVE_LUMINANCE_FLOOR);
+}
+
+// Without adaptive sampling every pixel takes samplesPerPixel samples per pass. With it, pixels that are
+// already converged are skipped and noisy ones keep sampling up to maxSamplesPerPixel.
+bool Camera::pixelNeedsSample(int pixelId, int passSamples) const {
+    if (renderProperties.maxRayDepth == 0) return false;
+    if (renderProperties.noiseThreshold <= 0.0) return passSamples < renderProperties.samplesPerPixel;
+
+    if (passSamples >= std::max(renderProperties.samplesPerPixel, renderProperties.maxSamplesPerPixel)) return false;
+    return !pixelConverged(pixelId);
+}
+
+void Camera::sampleHeatmap(std::vector<RTPixelColor> &outputBufer) const {
+    int maxSamples = 1;
+    for (int samples : sampleCounts_)
+        maxSamples = std::max(maxSamples, samples);
+
+    size_t pixelCount = std::min(outputBufer.size(), sampleCounts_.size());
+    for (size_t pixelId = 0; pixelId < pixelCount; ++pixelId) {
+        double heat = static_cast<double>(sampleCounts_[pixelId]) / maxSamples;
+        uint8_t value = static_cast<uint8_t>(255 * heat);
+        outputBufer[pixelId] = { value, 0, static_cast<uint8_t>(255 - value), 255 };
+    }
+}
+
+Camera::RenderCounters &Camera::counters() const {
+    return threadCounters_[omp_get_thread_num() % threadCounters_.size()];
+}
+
+// Continues a path with probability max(throughput) and divides the survivor's throughput by that
+// probability, which keeps the estimate unbiased while dark paths die early.
+bool Camera::survivesRoulette(int bounce, RTColor &throughput, RTSampler &sampler) const {
+    if (!renderProperties.enableRussianRoulette || bounce < renderProperties.rouletteMinDepth) return true;
+
+    double survival = std::min(1.0, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+    if (survival <= 0.0 || sampler.next() >= survival) {
+        counters().rouletteTerminations++;
+        return false;
+    }
+
+    throughput = throughput * (1.0 / survival);
+    return true;
+}
+
+RTSampler Camera::makeSampler(int pixelX, int pixelY, int sample) const {
+    return RTSampler(renderProperties.samplerType,
+                     static_cast<uint32_t>(pixelX), static_cast<uint32_t>(pixelY), static_cast<uint32_t>(sample));
+}
+
 void Camera::render
 (
     const SceneManager& sceneManager,
     const std::pair<int, int> screenResolution,
     std::vector<RTPixelColor> &outputBufer
 ) {
+    sceneManager.commit();
+
     if (renderProperties.enableParallelRender) {
         renderParallel(sceneManager, screenResolution, outputBufer);
         return;
@@ -76,15 +364,35 @@ void Camera::renderParallel
     assert(pixelCount == static_cast<int>(outputBufer.size()));
     pixelCount = std::min(pixelCount, static_cast<int>(outputBufer.size()));
     
-    gm::setThreadsNum(omp_get_max_threads());
+    int width = screenResolution.first;
+    int height = (width > 0) ? pixelCount / width : 0;
+    int spanSize = std::max(1, renderProperties.primaryPacketSize);
+
+    beginPass(sceneManager, screenResolution);
+
+    TileScheduler scheduler;
+    scheduler.build(width, height, renderProperties.threadPixelbunchSize, spanSize, omp_get_max_threads());
+
     #pragma omp parallel
     {
-        #pragma omp for schedule(static)
-        for (int pixelId = 0; pixelId < pixelCount; ++pixelId) {
-            gm::setThreadSeed(pixelId);
-            outputBufer[pixelId] = renderPixelColor(sceneManager, pixelId, screenResolution);
+        RenderTile tile = {};
+        while (scheduler.next(omp_get_thread_num(), tile)) {
+            if (renderProperties.integrator == RTIntegrator::Wavefront) {
+                renderTileWavefront(sceneManager, tile, screenResolution);
+                continue;
+            }
+
+            for (int pixelY = tile.y; pixelY < tile.y + tile.height; ++pixelY) {
+                for (int pixelX = tile.x; pixelX < tile.x + tile.width; pixelX += spanSize) {
+                    int pixelId = pixelY * width + pixelX;
+                    int count = std::min(spanSize, tile.x + tile.width - pixelX);
+                    renderPixelSpan(sceneManager, pixelId, count, screenResolution);
+                }
+            }
         }
     }
+
+    finishPass(outputBufer);
 }
 
 void Camera::renderSerial
@@ -97,8 +405,298 @@ void Camera::renderSerial
     assert(pixelCount == static_cast<int>(outputBufer.size()));
     pixelCount = std::min(pixelCount, static_cast<int>(outputBufer.size()));
 
-    for (int pixelId = 0; pixelId < pixelCount; ++pixelId) {
-        outputBufer[pixelId] = renderPixelColor(sceneManager, pixelId, screenResolution);
+    int width = screenResolution.first;
+    int spanSize = std::max(1, renderProperties.primaryPacketSize);
+
+    beginPass(sceneManager, screenResolution);
+
+    if (renderProperties.integrator == RTIntegrator::Wavefront) {
+        TileScheduler scheduler;
+        scheduler.build(width, (width > 0) ? pixelCount / width : 0, renderProperties.threadPixelbunchSize, spanSize, 1);
+
+        RenderTile tile = {};
+        while (scheduler.next(0, tile))
+            renderTileWavefront(sceneManager, tile, screenResolution);
+
+        finishPass(outputBufer);
+        return;
+    }
+
+    for (int pixelId = 0; pixelId < pixelCount; pixelId += width) {
+        for (int pixelX = 0; pixelX < width; pixelX += spanSize) {
+            int count = std::min(spanSize, width - pixelX);
+            renderPixelSpan(sceneManager, pixelId + pixelX, count, screenResolution);
+        }
+    }
+
+    finishPass(outputBufer);
+}
+
+void Camera::renderPixelSpan
+(
+    const SceneManager& sceneManager,
+    const int firstPixelId,
+    const int count,
+    const std::pair<int, int> screenResolution
+) {
+    switch (renderProperties.primaryPacketSize) {
+        case 4:  renderPixelPacket<4>(sceneManager, firstPixelId, count, screenResolution);  return;
+        case 8:  renderPixelPacket<8>(sceneManager, firstPixelId, count, screenResolution);  return;
+        case 16: renderPixelPacket<16>(sceneManager, firstPixelId, count, screenResolution); return;
+        default: break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int pixelId = firstPixelId + i;
+        int pixelX = pixelId % screenResolution.first;
+        int pixelY = pixelId / screenResolution.first;
+
+        const int firstSample = sampleCounts_[pixelId];
+        for (int passSamples = 0; pixelNeedsSample(pixelId, passSamples); ++passSamples) {
+            RTSampler sampler = makeSampler(pixelX, pixelY, firstSample + passSamples);
+            Ray ray = genRay(pixelX, pixelY, screenResolution, sampler);
+
+            HitRecord rec = {};
+            counters().pathRays++;
+            if (!sceneManager.hitClosest(ray, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), rec, true)) {
+                addFirstHit(pixelId, ray, nullptr, sceneManager);
+                addSample(pixelId, getBackgroundColor(ray));
+                continue;
+            }
+            addFirstHit(pixelId, ray, &rec, sceneManager);
+            addSample(pixelId, getPrimaryHitColor(ray, rec, sceneManager, sampler));
+        }
+    }
+}
+
+struct Camera::WavefrontPath {
+    Ray ray;
+    RTColor throughput;
+    int sample;    // index into the round's sample colors
+    RTSampler sampler;
+    double scatterPdf = 0.0;    // pdf of the scatter that produced ray, see emissionWeight
+};
+
+namespace {
+
+int directionOctant(const Ray &ray) {
+    return (ray.direction.x() < 0) | ((ray.direction.y() < 0) << 1) | ((ray.direction.z() < 0) << 2);
+}
+
+// Kind first so the shading loop walks one switch case after the other
+struct WavefrontHit {
+    MaterialKind kind;
+    uint32_t materialId;
+    const RTMaterial *material;
+    int path;
+
+    bool operator<(const WavefrontHit &other) const {
+        if (kind != other.kind) return kind < other.kind;
+        if (materialId != other.materialId) return materialId < other.materialId;
+        if (material != other.material) return material < other.material;
+        return path < other.path;
+    }
+};
+
+} // namespace
+
+// Every bounce of all the tile's paths is one stage: intersect the whole queue in packets, sort the hits
+// by material and shade each run of equal materials with one scatterMaterialBatch call, queueing the next bounce.
+// Adaptive sampling repeats this in rounds of ADAPTIVE_ROUND samples for the pixels that are still noisy.
+void Camera::renderTileWavefront
+(
+    const SceneManager& sceneManager,
+    const RenderTile &tile,
+    const std::pair<int, int> screenResolution
+) {
+    static constexpr int ADAPTIVE_ROUND = 4;
+
+    const int width = screenResolution.first;
+
+    std::vector<int> passSamples(tile.width * tile.height, 0);
+    std::vector<int> firstSamples(tile.width * tile.height);
+    for (int y = 0; y < tile.height; ++y)
+        for (int x = 0; x < tile.width; ++x)
+            firstSamples[y * tile.width + x] = sampleCounts_[(tile.y + y) * width + tile.x + x];
+    std::vector<RTColor> sampleColors;
+    std::vector<int> samplePixels;
+    std::vector<WavefrontPath> queue;
+
+    while (true) {
+        queue.clear();
+        sampleColors.clear();
+        samplePixels.clear();
+
+        for (int y = 0; y < tile.height; ++y) {
+            for (int x = 0; x < tile.width; ++x) {
+                int pixelId = (tile.y + y) * width + tile.x + x;
+                int &taken = passSamples[y * tile.width + x];
+
+                int roundEnd = taken < renderProperties.samplesPerPixel ? renderProperties.samplesPerPixel : taken + ADAPTIVE_ROUND;
+                for (; taken < roundEnd && pixelNeedsSample(pixelId, taken); ++taken) {
+                    RTSampler sampler = makeSampler(tile.x + x, tile.y + y, firstSamples[y * tile.width + x] + taken);
+                    Ray ray = genRay(tile.x + x, tile.y + y, screenResolution, sampler);
+                    queue.push_back({ ray, RTColor(1, 1, 1), static_cast<int>(samplePixels.size()), sampler });
+                    samplePixels.push_back(pixelId);
+                }
+            }
+        }
+        if (queue.empty()) break;
+
+        sampleColors.assign(samplePixels.size(), RTColor(0, 0, 0));
+        traceWavefront(sceneManager, queue, sampleColors, samplePixels);
+
+        for (size_t sample = 0; sample < samplePixels.size(); ++sample)
+            addSample(samplePixels[sample], sampleColors[sample]);
+    }
+}
+
+void Camera::traceWavefront
+(
+    const SceneManager& sceneManager,
+    std::vector<WavefrontPath> &queue,
+    std::vector<RTColor> &sampleColors,
+    const std::vector<int> &samplePixels
+) {
+    static constexpr int PACKET_SIZE = 8;
+    static constexpr int SHADE_BATCH = 64;
+
+    const Interval rayTime(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity());
+
+    std::vector<WavefrontPath> nextQueue;
+    std::vector<HitRecord> records;
+    std::vector<WavefrontHit> hits;
+
+    for (int depth = 0; depth < renderProperties.maxRayDepth && !queue.empty(); ++depth) {
+        int pathCount = static_cast<int>(queue.size());
+        records.assign(pathCount, HitRecord{});
+        hits.clear();
+
+        Ray packetRays[PACKET_SIZE];
+        bool packetHits[PACKET_SIZE];
+        for (int first = 0; first < pathCount; first += PACKET_SIZE) {
+            int count = std::min(PACKET_SIZE, pathCount - first);
+            for (int i = 0; i < count; ++i)
+                packetRays[i] = queue[first + i].ray;
+
+            sceneManager.hitClosestPacket<PACKET_SIZE>(packetRays, count, rayTime, &records[first], packetHits, depth == 0);
+            counters().pathRays += count;
+
+            for (int i = 0; i < count; ++i) {
+                const WavefrontPath &path = queue[first + i];
+                const HitRecord &rec = records[first + i];
+                if (depth == 0) addFirstHit(samplePixels[path.sample], path.ray, packetHits[i] ? &rec : nullptr, sceneManager);
+                if (!packetHits[i]) {
+                    sampleColors[path.sample] += path.throughput * getBackgroundColor(path.ray);
+                    continue;
+                }
+                hits.push_back({ sceneManager.materialRecord(rec).kind, rec.materialId, rec.material, first + i });
+            }
+        }
+
+        std::sort(hits.begin(), hits.end());
+
+        nextQueue.clear();
+        Ray inRays[SHADE_BATCH], scattered[SHADE_BATCH];
+        HitRecord batchRecords[SHADE_BATCH];
+        RTSampler samplers[SHADE_BATCH];
+        RTColor attenuations[SHADE_BATCH];
+        bool scatteredFlags[SHADE_BATCH];
+
+        for (size_t begin = 0; begin < hits.size();) {
+            const WavefrontHit &head = hits[begin];
+            const MaterialRecord &material = sceneManager.materialRecord(records[head.path]);
+            int count = 0;
+            while (begin + count < hits.size() && count < SHADE_BATCH &&
+                   hits[begin + count].materialId == head.materialId && hits[begin + count].material == head.material)
+                ++count;
+
+            // Same draws in the same order as getPathHitColor, so both integrators trace the same paths
+            for (int i = 0; i < count; ++i) {
+                const WavefrontPath &path = queue[hits[begin + i].path];
+                const HitRecord &rec = records[hits[begin + i].path];
+                RTSampler &pathSampler = samplers[i];
+                pathSampler = path.sampler;
+                pathSampler.setBounce(depth + 1);
+
+                gm::IVec3f emitted = rec.hitExpanded ? RTColor(1.0, 0.0, 0.0) : emittedMaterial(material, rec);
+                emitted = emitted * emissionWeight(path.ray, rec, path.scatterPdf, sceneManager);
+                gm::IVec3f LDirect = renderProperties.enableLDirect ? computeDirectLighting(rec, sceneManager, pathSampler) : gm::IVec3f{0, 0, 0};
+                if (depth + 1 < renderProperties.maxRayDepth)
+                    LDirect += sampleAreaLights(path.ray, rec, sceneManager, pathSampler);
+                sampleColors[path.sample] += path.throughput * (emitted + LDirect);
+
+                inRays[i] = path.ray;
+                batchRecords[i] = rec;
+            }
+
+            scatterMaterialBatch(material, inRays, batchRecords, samplers, count, attenuations, scattered, scatteredFlags);
+
+            for (int i = 0; i < count; ++i) {
+                if (!scatteredFlags[i]) continue;
+                const WavefrontPath &path = queue[hits[begin + i].path];
+                RTColor throughput = path.throughput * attenuations[i];
+                if (survivesRoulette(depth + 1, throughput, samplers[i]))
+                    nextQueue.push_back({ scattered[i], throughput, path.sample, samplers[i], scatterPdf(inRays[i], batchRecords[i], scattered[i], sceneManager) });
+            }
+            begin += count;
+        }
+
+        // Rays of one direction octant form coherent packets for the next intersection stage
+        std::stable_sort(nextQueue.begin(), nextQueue.end(), [](const WavefrontPath &a, const WavefrontPath &b) {
+            return directionOctant(a.ray) < directionOctant(b.ray);
+        });
+        std::swap(queue, nextQueue);
+    }
+}
+
+template <int N>
+void Camera::renderPixelPacket
+(
+    const SceneManager& sceneManager,
+    const int firstPixelId,
+    const int count,
+    const std::pair<int, int> screenResolution
+) {
+    assert(count <= N);
+
+    int pixelX = firstPixelId % screenResolution.first;
+    int pixelY = firstPixelId / screenResolution.first;
+
+    int passSamples[N] = {};
+    int firstSamples[N];
+    for (int i = 0; i < count; ++i)
+        firstSamples[i] = sampleCounts_[firstPixelId + i];
+    int lanes[N];
+    RTSampler samplers[N];
+    Ray rays[N];
+    HitRecord records[N];
+    bool hits[N];
+
+    // Pixels that stop sampling early drop out and the packet shrinks to the remaining ones
+    while (true) {
+        int activeCount = 0;
+        for (int i = 0; i < count; ++i)
+            if (pixelNeedsSample(firstPixelId + i, passSamples[i])) lanes[activeCount++] = i;
+        if (activeCount == 0) break;
+
+        for (int lane = 0; lane < activeCount; ++lane) {
+            int pixel = lanes[lane];
+            samplers[lane] = makeSampler(pixelX + pixel, pixelY, firstSamples[pixel] + passSamples[pixel]);
+            rays[lane] = genRay(pixelX + lanes[lane], pixelY, screenResolution, samplers[lane]);
+        }
+
+        sceneManager.hitClosestPacket<N>(rays, activeCount, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), records, hits, true);
+        counters().pathRays += activeCount;
+
+        for (int lane = 0; lane < activeCount; ++lane) {
+            addFirstHit(firstPixelId + lanes[lane], rays[lane], hits[lane] ? &records[lane] : nullptr, sceneManager);
+            RTColor color = hits[lane] ? getPrimaryHitColor(rays[lane], records[lane], sceneManager, samplers[lane])
+                                       : getBackgroundColor(rays[lane]);
+
+            addSample(firstPixelId + lanes[lane], color);
+            passSamples[lanes[lane]]++;
+        }
     }
 }
 
@@ -113,80 +711,258 @@ RTPixelColor Camera::renderPixelColor
 
     RTColor sampleSumColor = RTColor(0,0,0);
     for (int sample = 0; sample < renderProperties.samplesPerPixel; sample++) {
-        Ray ray = genRay(pixelX, pixelY, screenResolution);
-        RTColor rayColor = getRayColor(ray, renderProperties.maxRayDepth, sceneManager);
+        RTSampler sampler = makeSampler(pixelX, pixelY, sample);
+        Ray ray = genRay(pixelX, pixelY, screenResolution, sampler);
+        RTColor rayColor = getSampleColor(ray, sceneManager, sampler);
 
         sampleSumColor += rayColor;
     }
     return convertRTColor(sampleSumColor * 1.0 / renderProperties.samplesPerPixel);
 }
 
-Ray Camera::genRay(int pixelX, int pixelY, std::pair<int, int> screenResolution) {
+RTColor Camera::getSampleColor(const Ray& ray, const SceneManager& sceneManager, RTSampler &sampler) const {
+    if (renderProperties.integrator == RTIntegrator::Branching)
+        return getRayColor(ray, renderProperties.maxRayDepth, sceneManager, sampler);
+
+    return getPathColor(ray, sceneManager, sampler);
+}
+
+Ray Camera::genRay(int pixelX, int pixelY, std::pair<int, int> screenResolution, RTSampler &sampler) const {
+    double jitterX, jitterY;
+    sampler.next2D(jitterX, jitterY);
+    return rayThrough(pixelX + jitterX, pixelY + jitterY, screenResolution);
+}
+
+Ray Camera::rayThrough(double x, double y, std::pair<int, int> screenResolution) const {
     double deltaWidth = viewPort_.VIEWPORT_WIDTH / screenResolution.first;
     double deltaHeight = viewPort_.VIEWPORT_HEIGHT / screenResolution.second;
 
-    gm::IPoint3 viewPortPoint =  viewPort_.upperLeft_                                                 +
-                                        viewPort_.rightDir_ * (pixelX + gm::randomDouble(0.0, 1.0)) * deltaWidth +
-                                        viewPort_.downDir_  * (pixelY + gm::randomDouble(0.0, 1.0)) * deltaHeight;
+    gm::IPoint3 viewPortPoint =  viewPort_.upperLeft_                    +
+                                        viewPort_.rightDir_ * x * deltaWidth +
+                                        viewPort_.downDir_  * y * deltaHeight;
     
     gm::IVec3f rayDirection = viewPortPoint - center_;
 
     return Ray(center_, rayDirection.normalized());
 }
 
-RTColor Camera::getRayColor(const Ray& ray, const int depth, const SceneManager& sceneManager) const {
+const Primitives *Camera::pick
+(
+    const SceneManager& sceneManager,
+    const int pixelX,
+    const int pixelY,
+    const std::pair<int, int> screenResolution
+) const {
+    assert(pixelX >= 0 && pixelX < screenResolution.first);
+    assert(pixelY >= 0 && pixelY < screenResolution.second);
+
+    Ray ray = rayThrough(pixelX + 0.5, pixelY + 0.5, screenResolution);
+    HitRecord rec = {};
+    if (!sceneManager.hitClosest(ray, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), rec, false))
+        return nullptr;
+    return rec.object;
+}
+
+Primitives *Camera::pick
+(
+    SceneManager& sceneManager,
+    const int pixelX,
+    const int pixelY,
+    const std::pair<int, int> screenResolution
+) const {
+    // The scene owns the object and is mutable here
+    return const_cast<Primitives *>(pick(static_cast<const SceneManager&>(sceneManager), pixelX, pixelY, screenResolution));
+}
+
+RTColor Camera::getRayColor(const Ray& ray, const int depth, const SceneManager& sceneManager, RTSampler &sampler) const {
     if (depth == 0) return RTColor(0,0,0);
 
     HitRecord rec = {};
-    if (sceneManager.hitClosest(ray, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), rec, depth == renderProperties.maxRayDepth)) {
-        gm::IVec3f emitted = rec.material->emitted();
+    counters().pathRays++;
+    if (sceneManager.hitClosest(ray, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), rec, depth == renderProperties.maxRayDepth))
+        return getHitColor(ray, rec, depth, sceneManager, sampler);
 
-        if (rec.hitExpanded) {
-            RTColor selectionColor(1.0, 0.0, 0.0);
-            emitted = selectionColor;
-        }
+    return getBackgroundColor(ray);
+}
 
-        gm::IVec3f LIndirect = computeMultipleScatterLInderect(ray, rec, depth, sceneManager);
-        gm::IVec3f LDirect   = (renderProperties.enableLDirect ? computeDirectLighting(rec, sceneManager) : gm::IVec3f{0, 0, 0});
-        
-        return emitted + LIndirect + LDirect;
+// The branches of one sample draw one after the other from its sampler, in recursion order
+RTColor Camera::getHitColor(const Ray& ray, const HitRecord &rec, const int depth, const SceneManager& sceneManager, RTSampler &sampler) const {
+    gm::IVec3f emitted = emittedMaterial(sceneManager.materialRecord(rec), rec);
+
+    if (rec.hitExpanded) {
+        RTColor selectionColor(1.0, 0.0, 0.0);
+        emitted = selectionColor;
     }
 
+    gm::IVec3f LIndirect = computeMultipleScatterLInderect(ray, rec, depth, sceneManager, sampler);
+    gm::IVec3f LDirect   = (renderProperties.enableLDirect ? computeDirectLighting(rec, sceneManager, sampler) : gm::IVec3f{0, 0, 0});
+    
+    return emitted + LIndirect + LDirect;
+}
+
+RTColor Camera::getPrimaryHitColor(const Ray& ray, const HitRecord &rec, const SceneManager& sceneManager, RTSampler &sampler) const {
+    if (renderProperties.integrator == RTIntegrator::Branching)
+        return getHitColor(ray, rec, renderProperties.maxRayDepth, sceneManager, sampler);
+
+    return getPathHitColor(ray, rec, sceneManager, sampler);
+}
+
+RTColor Camera::getBackgroundColor(const Ray& ray) const {
     auto a = 0.5*(ray.direction.y() + 1.0);
     return RTColor(1.0, 1.0, 1.0) * (1.0-a) + RTColor(0.5, 0.7, 1.0) * a;   
 }
 
+RTColor Camera::getPathColor(const Ray& ray, const SceneManager& sceneManager, RTSampler &sampler) const {
+    if (renderProperties.maxRayDepth == 0) return RTColor(0,0,0);
+
+    HitRecord rec = {};
+    counters().pathRays++;
+    if (sceneManager.hitClosest(ray, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), rec, true))
+        return getPathHitColor(ray, rec, sceneManager, sampler);
+
+    return getBackgroundColor(ray);
+}
+
+// Same estimate as getHitColor with samplesPerScatter == 1, unrolled into a loop: every bounce adds its
+// emitted and direct light weighted by the product of the attenuations along the path so far.
+// Vertex k draws from bounce k + 1 of the sampler.
+RTColor Camera::getPathHitColor(const Ray& ray, const HitRecord &rec, const SceneManager& sceneManager, RTSampler &sampler) const {
+    RTColor radiance   = RTColor(0, 0, 0);
+    RTColor throughput = RTColor(1, 1, 1);
+
+    Ray currentRay = ray;
+    HitRecord currentRec = rec;
+    double currentScatterPdf = 0.0;
+
+    for (int depth = renderProperties.maxRayDepth; depth > 0; --depth) {
+        if (depth < renderProperties.maxRayDepth) {
+            counters().pathRays++;
+            if (!sceneManager.hitClosest(currentRay, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), currentRec, false)) {
+                radiance += throughput * getBackgroundColor(currentRay);
+                break;
+            }
+        }
+
+        sampler.setBounce(renderProperties.maxRayDepth - depth + 1);
+
+        const MaterialRecord &material = sceneManager.materialRecord(currentRec);
+        gm::IVec3f emitted = currentRec.hitExpanded ? RTColor(1.0, 0.0, 0.0) : emittedMaterial(material, currentRec);
+        radiance += throughput * emitted * emissionWeight(currentRay, currentRec, currentScatterPdf, sceneManager);
+        if (renderProperties.enableLDirect)
+            radiance += throughput * computeDirectLighting(currentRec, sceneManager, sampler);
+        // The last vertex has no bounce left to find emitters the other way, keep both estimates to the same depth
+        if (depth > 1)
+            radiance += throughput * sampleAreaLights(currentRay, currentRec, sceneManager, sampler);
+
+        Ray scattered = {};
+        RTColor attenuation = {};
+        if (!scatterMaterial(material, currentRay, currentRec, sampler, attenuation, scattered))
+            break;
+
+        currentScatterPdf = scatterPdf(currentRay, currentRec, scattered, sceneManager);
+        throughput = throughput * attenuation;
+        currentRay = scattered;
+
+        if (!survivesRoulette(renderProperties.maxRayDepth - depth + 1, throughput, sampler))
+            break;
+    }
+
+    return radiance;
+}
+
 
 // Light???
-gm::IVec3f Camera::computeDirectLighting(const HitRecord &rec, const SceneManager& sceneManager) const {
+gm::IVec3f Camera::computeDirectLighting(const HitRecord &rec, const SceneManager& sceneManager, RTSampler &sampler) const {
     gm::IVec3f summaryLighting = {0, 0, 0};
 
     gm::IVec3f toView = center_ - rec.point;
-    for (Light *lightSrc : sceneManager.inderectLightSources()) {
-        Ray toLightRay = Ray(rec.point, lightSrc->position() - rec.point);
-    
-        HitRecord tmp;
-        bool hitted = sceneManager.hitClosest(toLightRay, Interval(CLOSEST_HIT_MIN_T, std::numeric_limits<double>::infinity()), tmp, false);
-        if (hitted && tmp.object == rec.object) {
-            hitted = false;
+    const std::vector<Light *> &lights = sceneManager.inderectLightSources();
+    const LightTree &lightTree = sceneManager.lightTree();
+
+    int lightSamples = renderProperties.lightSamples;
+    bool stochastic = lightSamples > 0 && static_cast<size_t>(lightSamples) < lights.size() && lightTree.size() == lights.size();
+    int sampleCount = stochastic ? lightSamples : static_cast<int>(lights.size());
+
+    // Stochastic mode weights every picked light by 1 / (pdf * sampleCount), which keeps the sum unbiased
+    for (int i = 0; i < sampleCount; ++i) {
+        double weight = 1.0;
+        Light *lightSrc = lights[i];
+        if (stochastic) {
+            double pdf = 0.0;
+            lightSrc = lightTree.sample(rec.point, rec.normal, sampler.next(), pdf);
+            if (!lightSrc || pdf <= 0.0) continue;
+            weight = 1.0 / (pdf * sampleCount);
         }
+
+        // The light sits at t = 1 along the unnormalized direction, blockers behind it do not count
+        Ray toLightRay = Ray(rec.point, lightSrc->position() - rec.point);
+
+        counters().shadowRays++;
+        bool hitted = sceneManager.occluded(toLightRay, Interval(CLOSEST_HIT_MIN_T, 1.0), shadowIgnore(rec));
         
-        summaryLighting += lightSrc->getDirectLighting(toView, rec, hitted);    
+        summaryLighting += lightSrc->getDirectLighting(toView, rec, hitted) * weight;
     }
 
     return summaryLighting;
 }
 
+RTColor Camera::sampleAreaLights(const Ray& ray, const HitRecord &rec, const SceneManager& sceneManager, RTSampler &sampler) const {
+    if (!renderProperties.enableAreaLights || !sceneManager.hasEmitters() || rec.hitExpanded)
+        return RTColor(0, 0, 0);
+
+    double pmf = 0.0;
+    const Primitives *emitter = sceneManager.sampleEmitter(sampler.next(), pmf);
+    if (!emitter || emitter == rec.object || pmf <= 0.0) return RTColor(0, 0, 0);
+
+    gm::IVec3f direction;
+    double distance = 0.0, directionPdf = 0.0;
+    if (!emitter->sampleDirection(rec.point, sampler, direction, distance, directionPdf) || directionPdf <= 0.0)
+        return RTColor(0, 0, 0);
+
+    RTColor value;
+    double bsdfPdf = 0.0;
+    if (!evalScatterMaterial(sceneManager.materialRecord(rec), ray, rec, direction, value, bsdfPdf) || bsdfPdf <= 0.0)
+        return RTColor(0, 0, 0);
+
+    // Stop just short of the sampled point so the emitter does not block itself
+    counters().shadowRays++;
+    if (sceneManager.occluded(Ray(rec.point, direction), Interval(CLOSEST_HIT_MIN_T, distance * (1.0 - 1e-6)), shadowIgnore(rec)))
+        return RTColor(0, 0, 0);
+
+    double lightPdf = pmf * directionPdf;
+    double weight = lightPdf * lightPdf / (lightPdf * lightPdf + bsdfPdf * bsdfPdf);
+    return value * emitter->material()->emitted() * (weight / lightPdf);
+}
+
+double Camera::emissionWeight(const Ray& ray, const HitRecord &rec, double scatterPdf, const SceneManager& sceneManager) const {
+    if (scatterPdf <= 0.0 || rec.hitExpanded) return 1.0;
+
+    double lightPdf = sceneManager.emitterPmf(rec.object);
+    if (lightPdf <= 0.0) return 1.0;
+    lightPdf *= rec.object->directionPdf(ray.origin, rec);
+
+    return scatterPdf * scatterPdf / (scatterPdf * scatterPdf + lightPdf * lightPdf);
+}
+
+double Camera::scatterPdf(const Ray& ray, const HitRecord &rec, const Ray& scattered, const SceneManager& sceneManager) const {
+    if (!renderProperties.enableAreaLights || !sceneManager.hasEmitters() || rec.hitExpanded) return 0.0;
+
+    RTColor value;
+    double pdf = 0.0;
+    return evalScatterMaterial(sceneManager.materialRecord(rec), ray, rec, scattered.direction, value, pdf) ? pdf : 0.0;
+}
+
 gm::IVec3f Camera::computeMultipleScatterLInderect(const Ray& ray, const HitRecord &hitRecord, 
-                                                  const int depth, const SceneManager& sceneManager) const
+                                                  const int depth, const SceneManager& sceneManager, RTSampler &sampler) const
 {
+    const MaterialRecord &material = sceneManager.materialRecord(hitRecord);
     gm::IVec3f LIndirect = {0, 0, 0};
     for (int i = 0; i < renderProperties.samplesPerScatter; i++) {
         Ray scattered = {};
         RTColor attenuation = {};
         
-        if (hitRecord.material->scatter(ray, hitRecord, attenuation, scattered)) {
-            LIndirect += attenuation * getRayColor(scattered, depth-1, sceneManager);
+        if (scatterMaterial(material, ray, hitRecord, sampler, attenuation, scattered)) {
+            LIndirect += attenuation * getRayColor(scattered, depth-1, sceneManager, sampler);
         }
     }
     
@@ -229,8 +1005,10 @@ Viewport Camera::viewPort() const { return viewPort_; }
 void Camera::setCenter(const gm::IPoint3 center) { 
     center_ = center; 
     updateViewPort();
+    resetAccumulation();
 }
 void Camera::setDirection(const gm::IVec3f direction) {
     direction_ = direction.normalized();
     updateViewPort();
+    resetAccumulation();
 }
\ No newline at end of file
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <numeric>
+#include <limits>
+
+#include "RTBvh.h"
+
+
+namespace {
+
+bool sameBox(const AABB &a, const AABB &b) {
+    return a.x.min == b.x.min && a.x.max == b.x.max &&
+           a.y.min == b.y.min && a.y.max == b.y.max &&
+           a.z.min == b.z.min && a.z.max == b.z.max;
+}
+
+} // namespace
+
+
+void BVHTree::clear() {
+    nodes_.clear();
+    slotLeaf_.clear();
+    garbageNodes_ = 0;
+}
+
+void BVHTree::build(const std::vector<AABB> &bounds, std::vector<int> &order) {
+    clear();
+
+    order.resize(bounds.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (bounds.empty()) return;
+
+    nodes_.reserve(2 * bounds.size());
+    slotLeaf_.resize(bounds.size());
+    buildNode(bounds, order, 0, static_cast<int>(bounds.size()), 0, 0);
+}
+
+bool BVHTree::assign(std::vector<Node> nodes, int slotCount) {
+    clear();
+    if (nodes.empty()) return slotCount == 0;
+
+    std::vector<int> slotLeaf(slotCount, -1);
+    std::vector<char> visited(nodes.size(), 0);
+    int nodeCount = static_cast<int>(nodes.size());
+
+    struct StackEntry {
+        int node;
+        int parent;
+        int depth;
+    };
+    std::vector<StackEntry> stack = { {0, -1, 0} };
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        if (entry.node < 0 || entry.node >= nodeCount || visited[entry.node] || entry.depth > MAX_DEPTH) return false;
+        visited[entry.node] = 1;
+
+        const Node &node = nodes[entry.node];
+        if (node.parent != entry.parent) return false;
+        if (!node.isLeaf()) {
+            if (node.right < 0) return false;
+            stack.push_back({node.left, entry.node, entry.depth + 1});
+            stack.push_back({node.right, entry.node, entry.depth + 1});
+            continue;
+        }
+
+        if (node.first < 0 || node.count < 0 || node.first + node.count > slotCount) return false;
+        for (int slot = node.first; slot < node.first + node.count; ++slot) {
+            if (slotLeaf[slot] >= 0) return false;
+            slotLeaf[slot] = entry.node;
+        }
+    }
+    if (std::find(slotLeaf.begin(), slotLeaf.end(), -1) != slotLeaf.end()) return false;
+
+    nodes_ = std::move(nodes);
+    slotLeaf_ = std::move(slotLeaf);
+    garbageNodes_ = std::count(visited.begin(), visited.end(), 0);
+    return true;
+}
+
+void BVHTree::refit(const std::vector<int> &slots, const std::vector<AABB> &slotBounds, std::vector<int> &degraded) {
+    degraded.clear();
+    if (nodes_.empty()) return;
+
+    std::vector<int> leaves;
+    leaves.reserve(slots.size());
+    for (int slot : slots)
+        leaves.push_back(slotLeaf_[slot]);
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+    std::vector<int> candidates;
+    for (int leaf : leaves) {
+        int nodeId = leaf;
+        while (nodeId >= 0) {
+            Node &node = nodes_[nodeId];
+
+            AABB box;
+            if (node.isLeaf()) {
+                for (int slot = node.first; slot < node.first + node.count; ++slot)
+                    box = AABB(box, slotBounds[slot]);
+            } else {
+                box = AABB(nodes_[node.left].box, nodes_[node.right].box);
+            }
+
+            if (sameBox(box, node.box)) break;
+            node.box = box;
+
+            if (box.surfaceArea() > REBUILD_AREA_RATIO * node.buildArea)
+                candidates.push_back(nodeId);
+            nodeId = node.parent;
+        }
+    }
+
+    // Keep only the topmost degraded nodes, rebuilding one of them covers its descendants
+    std::vector<char> isCandidate(nodes_.size(), 0);
+    for (int nodeId : candidates) isCandidate[nodeId] = 1;
+
+    for (int nodeId : candidates) {
+        if (isCandidate[nodeId] != 1) continue;
+
+        bool covered = false;
+        for (int parent = nodes_[nodeId].parent; parent >= 0; parent = nodes_[parent].parent) {
+            if (isCandidate[parent]) {
+                covered = true;
+                break;
+            }
+        }
+
+        isCandidate[nodeId] = 2;
+        if (!covered) degraded.push_back(nodeId);
+    }
+}
+
+void BVHTree::rebuildSubtree(int nodeId, const std::vector<AABB> &slotBounds, std::vector<int> &order) {
+    Node root = nodes_[nodeId];
+
+    std::vector<AABB> localBounds(slotBounds.begin() + root.first, slotBounds.begin() + root.first + root.count);
+    order.resize(root.count);
+    std::iota(order.begin(), order.end(), 0);
+
+    // The old subtree minus its reused root, plus the new root's original copy
+    garbageNodes_ += subtreeSize(nodeId);
+
+    int newRoot = buildNode(localBounds, order, 0, root.count, root.first, nodeDepth(nodeId));
+
+    // Move the new root into the old slot so the parent link stays valid
+    nodes_[nodeId] = nodes_[newRoot];
+    nodes_[nodeId].parent = root.parent;
+    if (!nodes_[nodeId].isLeaf()) {
+        nodes_[nodes_[nodeId].left].parent  = nodeId;
+        nodes_[nodes_[nodeId].right].parent = nodeId;
+    } else {
+        for (int slot = root.first; slot < root.first + root.count; ++slot)
+            slotLeaf_[slot] = nodeId;
+    }
+}
+
+int BVHTree::nodeDepth(int nodeId) const {
+    int depth = 0;
+    for (int parent = nodes_[nodeId].parent; parent >= 0; parent = nodes_[parent].parent)
+        depth++;
+    return depth;
+}
+
+size_t BVHTree::subtreeSize(int nodeId) const {
+    const Node &node = nodes_[nodeId];
+    if (node.isLeaf()) return 1;
+    return 1 + subtreeSize(node.left) + subtreeSize(node.right);
+}
+
+int BVHTree::buildNode(const std::vector<AABB> &bounds, std::vector<int> &order, int first, int count, int slotOffset, int depth) {
+    int nodeId = static_cast<int>(nodes_.size());
+    nodes_.emplace_back();
+
+    AABB box;
+    Interval centroidBounds[3];
+    for (int i = first; i < first + count; ++i) {
+        const AABB &itemBox = bounds[order[i]];
+        if (itemBox.isEmpty()) continue;
+
+        box = AABB(box, itemBox);
+        for (int axis = 0; axis < 3; ++axis) {
+            double c = itemBox.centroid(axis);
+            centroidBounds[axis] = Interval(centroidBounds[axis], Interval(c, c));
+        }
+    }
+
+    nodes_[nodeId].box       = box;
+    nodes_[nodeId].first     = slotOffset + first;
+    nodes_[nodeId].count     = count;
+    nodes_[nodeId].buildArea = box.surfaceArea();
+
+    auto makeLeaf = [&]() {
+        for (int slot = slotOffset + first; slot < slotOffset + first + count; ++slot)
+            slotLeaf_[slot] = nodeId;
+        return nodeId;
+    };
+
+    if (count == 1 || depth >= MAX_DEPTH) return makeLeaf();
+
+    // Binned SAH: pick the cheapest bin boundary over all three axes
+    struct Bin {
+        AABB box;
+        int count = 0;
+    };
+
+    double bestCost = std::numeric_limits<double>::infinity();
+    int bestAxis = -1;
+    int bestSplit = 0;
+
+    // Empty boxes (removed items) have no centroid and always land in the first bin
+    auto binIndex = [&](const AABB &itemBox, int axis) {
+        if (itemBox.isEmpty()) return 0;
+        const Interval &extent = centroidBounds[axis];
+        double scale = SAH_BIN_COUNT / extent.size();
+        return std::min(SAH_BIN_COUNT - 1, static_cast<int>((itemBox.centroid(axis) - extent.min) * scale));
+    };
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const Interval &extent = centroidBounds[axis];
+        if (!(extent.size() > 0.0)) continue;
+
+        Bin bins[SAH_BIN_COUNT];
+        for (int i = first; i < first + count; ++i) {
+            const AABB &itemBox = bounds[order[i]];
+            int binId = binIndex(itemBox, axis);
+            bins[binId].box = AABB(bins[binId].box, itemBox);
+            bins[binId].count++;
+        }
+
+        double rightArea[SAH_BIN_COUNT] = {};
+        int rightCount[SAH_BIN_COUNT] = {};
+        AABB rightBox;
+        int rightAcc = 0;
+        for (int b = SAH_BIN_COUNT - 1; b > 0; --b) {
+            rightBox = AABB(rightBox, bins[b].box);
+            rightAcc += bins[b].count;
+            rightArea[b] = rightBox.surfaceArea();
+            rightCount[b] = rightAcc;
+        }
+
+        AABB leftBox;
+        int leftAcc = 0;
+        for (int b = 0; b < SAH_BIN_COUNT - 1; ++b) {
+            leftBox = AABB(leftBox, bins[b].box);
+            leftAcc += bins[b].count;
+            if (leftAcc == 0 || rightCount[b + 1] == 0) continue;
+
+            double cost = leftBox.surfaceArea() * leftAcc + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    double boxArea = box.surfaceArea();
+    double leafCost = INTERSECTION_COST * count;
+    double splitCost = (boxArea > 0.0)
+                     ? TRAVERSAL_COST + INTERSECTION_COST * bestCost / boxArea
+                     : std::numeric_limits<double>::infinity();
+
+    if (count <= MAX_LEAF_SIZE && splitCost >= leafCost) return makeLeaf();
+
+    int mid = first + count / 2;
+    if (bestAxis >= 0) {
+        auto midIt = std::partition(order.begin() + first, order.begin() + first + count, [&](int item) {
+            return binIndex(bounds[item], bestAxis) <= bestSplit;
+        });
+        mid = static_cast<int>(midIt - order.begin());
+    }
+
+    // Coincident centroids: no spatial split exists, fall back to halving the range
+    if (mid == first || mid == first + count) mid = first + count / 2;
+
+    int left  = buildNode(bounds, order, first, mid - first, slotOffset, depth + 1);
+    int right = buildNode(bounds, order, mid, first + count - mid, slotOffset, depth + 1);
+    nodes_[nodeId].left  = left;
+    nodes_[nodeId].right = right;
+    nodes_[left].parent  = nodeId;
+    nodes_[right].parent = nodeId;
+    return nodeId;
+}
@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "RTDenoiser.h"
+
+
+namespace {
+
+// B3-spline taps of the à-trous kernel
+constexpr float KERNEL[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+// Edge-stopping strengths, SVGF defaults: depth in multiples of the local depth slope, luminance in
+// standard deviations, normal as the squared distance of the unit normals
+constexpr float SIGMA_DEPTH     = 1.0f;
+constexpr float SIGMA_LUMINANCE = 4.0f;
+constexpr float SIGMA_NORMAL2   = 0.1f;
+
+// Floors that keep the weights finite: a share of the depth itself, a luminance deviation and the albedo
+// that black surfaces are demodulated by
+constexpr float DEPTH_FLOOR     = 1e-3f;
+constexpr float LUMINANCE_FLOOR = 1e-4f;
+constexpr float ALBEDO_FLOOR    = 1e-3f;
+
+inline float luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+inline int32_t floatBits(float value) {
+    int32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float bitsFloat(int32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// exp(-x) for x >= 0 to about 1e-5 relative, branch-free so the tap loops vectorize: 2^t = 2^i * 2^f
+// with the integer part in the exponent bits and a polynomial for the fraction f in (-1, 0]. The argument
+// is clamped on its bits, which order like the values for x >= 0; a float compare keeps the loop scalar.
+inline float negativeExp(float x) {
+    int32_t clamped = std::min(floatBits(x * 1.44269504f), floatBits(126.0f));
+    float t = -bitsFloat(clamped);
+    int32_t whole = static_cast<int32_t>(t);
+    float f = t - static_cast<float>(whole);
+    float fraction = 1.0f + f * (0.693147f + f * (0.240227f + f * (0.0555041f + f * (0.00961813f + f * 0.00133336f))));
+    return bitsFloat((whole + 127) << 23) * fraction;
+}
+
+} // namespace
+
+
+void RTDenoiser::resize(int width, int height) {
+    width_  = width;
+    height_ = height;
+
+    size_t size = static_cast<size_t>(width) * height;
+    color_.resize(size);
+    nextColor_.resize(size);
+    variance_.resize(size);
+    nextVariance_.resize(size);
+    blurredVariance_.resize(size);
+    luminance_.resize(size);
+    albedo_.resize(size);
+    normal_.resize(size);
+    depth_.resize(size);
+    depthGradient_.resize(size);
+}
+
+void RTDenoiser::setPixel(int pixelId, const gm::IVec3f &color, double variance,
+                          const gm::IVec3f &albedo, const gm::IVec3f &normal, double depth) {
+    float albedoX = std::max(static_cast<float>(albedo.x()), ALBEDO_FLOOR);
+    float albedoY = std::max(static_cast<float>(albedo.y()), ALBEDO_FLOOR);
+    float albedoZ = std::max(static_cast<float>(albedo.z()), ALBEDO_FLOOR);
+    float albedoLuminance = luminance(albedoX, albedoY, albedoZ);
+
+    albedo_.x[pixelId] = albedoX;
+    albedo_.y[pixelId] = albedoY;
+    albedo_.z[pixelId] = albedoZ;
+    color_.x[pixelId] = static_cast<float>(color.x()) / albedoX;
+    color_.y[pixelId] = static_cast<float>(color.y()) / albedoY;
+    color_.z[pixelId] = static_cast<float>(color.z()) / albedoZ;
+    variance_[pixelId] = static_cast<float>(variance) / (albedoLuminance * albedoLuminance);
+
+    normal_.x[pixelId] = static_cast<float>(normal.x());
+    normal_.y[pixelId] = static_cast<float>(normal.y());
+    normal_.z[pixelId] = static_cast<float>(normal.z());
+    depth_[pixelId] = static_cast<float>(depth);
+}
+
+gm::IVec3f RTDenoiser::color(int pixelId) const {
+    return gm::IVec3f(color_.x[pixelId] * albedo_.x[pixelId],
+                      color_.y[pixelId] * albedo_.y[pixelId],
+                      color_.z[pixelId] * albedo_.z[pixelId]);
+}
+
+void RTDenoiser::filter(int iterations) {
+    computeDepthGradient();
+
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        prepareIteration();
+
+        #pragma omp parallel
+        {
+            RowSums sums(width_);
+            #pragma omp for schedule(static)
+            for (int y = 0; y < height_; ++y)
+                filterRow(y, 1 << iteration, sums);
+        }
+
+        std::swap(color_, nextColor_);
+        std::swap(variance_, nextVariance_);
+    }
+}
+
+// Depth change per pixel of the surface around a pixel. Each axis takes the smaller one-sided difference,
+// so pixels on a silhouette get the slope of their own surface instead of the jump to the one behind it.
+void RTDenoiser::computeDepthGradient() {
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height_; ++y) {
+        const float *row  = &depth_[static_cast<size_t>(y) * width_];
+        const float *up   = &depth_[static_cast<size_t>(std::max(y - 1, 0)) * width_];
+        const float *down = &depth_[static_cast<size_t>(std::min(y + 1, height_ - 1)) * width_];
+        float *gradient = &depthGradient_[static_cast<size_t>(y) * width_];
+
+        for (int x = 0; x < width_; ++x) {
+            float left  = row[std::max(x - 1, 0)];
+            float right = row[std::min(x + 1, width_ - 1)];
+            float dx = std::min(std::fabs(right - row[x]), std::fabs(row[x] - left));
+            float dy = std::min(std::fabs(down[x] - row[x]), std::fabs(row[x] - up[x]));
+            gradient[x] = std::sqrt(dx * dx + dy * dy);
+        }
+    }
+}
+
+// Luminance of the current colors and a 3x3 gaussian of their variance: a few samples give noisy variance
+// estimates, the luminance weight uses the blurred one
+void RTDenoiser::prepareIteration() {
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height_; ++y) {
+        const size_t row = static_cast<size_t>(y) * width_;
+        const float *rows[3] = {
+            &variance_[static_cast<size_t>(std::max(y - 1, 0)) * width_],
+            &variance_[row],
+            &variance_[static_cast<size_t>(std::min(y + 1, height_ - 1)) * width_],
+        };
+        float *blurred = &blurredVariance_[row];
+
+        for (int x = 0; x < width_; ++x) {
+            int left = std::max(x - 1, 0), right = std::min(x + 1, width_ - 1);
+            float sum = 0.0f;
+            for (int tap = 0; tap < 3; ++tap) {
+                float weight = tap == 1 ? 0.5f : 0.25f;
+                sum += weight * (0.25f * rows[tap][left] + 0.5f * rows[tap][x] + 0.25f * rows[tap][right]);
+            }
+            blurred[x] = sum;
+        }
+
+        #pragma omp simd
+        for (size_t p = row; p < row + width_; ++p)
+            luminance_[p] = luminance(color_.x[p], color_.y[p], color_.z[p]);
+    }
+}
+
+// Every tap (dx, dy) is one pass over the row, restricted to the pixels whose tap lies inside the image, so
+// the loads are contiguous and the loop has no branches. The weights are normalized by their sum, the
+// filtered variance is the weighted sum of variances with squared weights.
+void RTDenoiser::filterRow(int y, int step, RowSums &sums) {
+    const size_t row = static_cast<size_t>(y) * width_;
+
+    std::fill(sums.weight.begin(), sums.weight.end(), 0.0f);
+    std::fill(sums.x.begin(), sums.x.end(), 0.0f);
+    std::fill(sums.y.begin(), sums.y.end(), 0.0f);
+    std::fill(sums.z.begin(), sums.z.end(), 0.0f);
+    std::fill(sums.variance.begin(), sums.variance.end(), 0.0f);
+
+    const float *blurred = blurredVariance_.data() + row;
+    #pragma omp simd
+    for (int x = 0; x < width_; ++x)
+        sums.luminanceScale[x] = 1.0f / (SIGMA_LUMINANCE * std::sqrt(blurred[x]) + LUMINANCE_FLOOR);
+
+    const float *depth = depth_.data() + row, *gradient = depthGradient_.data() + row;
+    const float *normalX = normal_.x.data() + row, *normalY = normal_.y.data() + row, *normalZ = normal_.z.data() + row;
+    const float *luminanceP = luminance_.data() + row;
+    const float *luminanceScale = sums.luminanceScale.data();
+    float *sumWeight = sums.weight.data(), *sumX = sums.x.data(), *sumY = sums.y.data(), *sumZ = sums.z.data();
+    float *sumVariance = sums.variance.data();
+
+    for (int dy = -2; dy <= 2; ++dy) {
+        int tapY = y + dy * step;
+        if (tapY < 0 || tapY >= height_) continue;
+
+        for (int dx = -2; dx <= 2; ++dx) {
+            const int offset = dx * step;
+            const int begin = std::max(0, -offset), end = std::min(width_, width_ - offset);
+            const float kernel = KERNEL[dx + 2] * KERNEL[dy + 2];
+            const float depthSlope = SIGMA_DEPTH * step * std::sqrt(static_cast<float>(dx * dx + dy * dy));
+
+            // Tap q of pixel x is x + offset in these rows
+            const size_t tapRow = static_cast<size_t>(tapY) * width_;
+            const float *depthQ = depth_.data() + tapRow;
+            const float *normalQX = normal_.x.data() + tapRow, *normalQY = normal_.y.data() + tapRow, *normalQZ = normal_.z.data() + tapRow;
+            const float *luminanceQ = luminance_.data() + tapRow;
+            const float *colorX = color_.x.data() + tapRow, *colorY = color_.y.data() + tapRow, *colorZ = color_.z.data() + tapRow;
+            const float *variance = variance_.data() + tapRow;
+
+            #pragma omp simd
+            for (int x = begin; x < end; ++x) {
+                const int q = x + offset;
+                float depthTerm = std::fabs(depth[x] - depthQ[q]) / (depthSlope * gradient[x] + DEPTH_FLOOR * depth[x] + 1e-6f);
+
+                float nx = normalX[x] - normalQX[q], ny = normalY[x] - normalQY[q], nz = normalZ[x] - normalQZ[q];
+                float normalTerm = (nx * nx + ny * ny + nz * nz) * (1.0f / SIGMA_NORMAL2);
+
+                float luminanceTerm = std::fabs(luminanceP[x] - luminanceQ[q]) * luminanceScale[x];
+
+                float weight = kernel * negativeExp(depthTerm + normalTerm + luminanceTerm);
+                sumWeight[x]   += weight;
+                sumX[x]        += weight * colorX[q];
+                sumY[x]        += weight * colorY[q];
+                sumZ[x]        += weight * colorZ[q];
+                sumVariance[x] += weight * weight * variance[q];
+            }
+        }
+    }
+
+    float *outX = nextColor_.x.data() + row, *outY = nextColor_.y.data() + row, *outZ = nextColor_.z.data() + row;
+    float *outVariance = nextVariance_.data() + row;
+
+    // The center tap always has weight KERNEL[2]^2, the sum is never zero
+    #pragma omp simd
+    for (int x = 0; x < width_; ++x) {
+        float inverse = 1.0f / sumWeight[x];
+        outX[x] = sumX[x] * inverse;
+        outY[x] = sumY[x] * inverse;
+        outZ[x] = sumZ[x] * inverse;
+        outVariance[x] = sumVariance[x] * inverse * inverse;
+    }
+}
@@ -3,3 +3,7 @@
 
 const Interval Interval::empty    = Interval(+std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity());
 const Interval Interval::universe = Interval(-std::numeric_limits<double>::infinity(), +std::numeric_limits<double>::infinity());
+
+
+const AABB AABB::empty    = AABB(Interval::empty, Interval::empty, Interval::empty);
+const AABB AABB::universe = AABB(Interval::universe, Interval::universe, Interval::universe);
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+#include "RTLightTree.h"
+#include "RTObjects.h"
+
+
+namespace {
+
+// Upper bound of the cosine between the normal and the direction from point to anything inside box
+double cosineBound(const AABB &box, const gm::IPoint3 &point, const gm::IVec3f &normal) {
+    gm::IPoint3 center(box.centroid(0), box.centroid(1), box.centroid(2));
+    gm::IVec3f toCenter = center - point;
+
+    double halfX = 0.5 * box.x.size(), halfY = 0.5 * box.y.size(), halfZ = 0.5 * box.z.size();
+    double radius = std::sqrt(halfX * halfX + halfY * halfY + halfZ * halfZ);
+    double distance = std::sqrt(toCenter.length2());
+    if (distance <= radius) return 1.0;
+
+    double cosTheta = dot(normal, toCenter) / distance;
+    double sinHalf = radius / distance;
+    double cosHalf = std::sqrt(std::max(0.0, 1.0 - sinHalf * sinHalf));
+    if (cosTheta >= cosHalf) return 1.0;
+
+    double sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
+    return std::max(0.0, cosTheta * cosHalf + sinTheta * sinHalf);
+}
+
+} // namespace
+
+
+void LightTree::clear() {
+    nodes_.clear();
+    lights_.clear();
+}
+
+void LightTree::build(const std::vector<Light *> &lights) {
+    clear();
+    lights_ = lights;
+    if (lights_.empty()) return;
+
+    std::vector<int> order(lights_.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    nodes_.reserve(2 * lights_.size());
+    buildNode(order, 0, static_cast<int>(order.size()));
+}
+
+int LightTree::buildNode(std::vector<int> &order, int first, int count) {
+    int nodeId = static_cast<int>(nodes_.size());
+    nodes_.emplace_back();
+
+    AABB box;
+    double power = 0.0;
+    for (int i = first; i < first + count; ++i) {
+        const Light *light = lights_[order[i]];
+        box = AABB(box, AABB(light->position(), light->position()));
+        power += std::max(light->power(), MIN_LIGHT_POWER);
+    }
+
+    if (count == 1) {
+        nodes_[nodeId].box = box;
+        nodes_[nodeId].power = power;
+        nodes_[nodeId].light = order[first];
+        return nodeId;
+    }
+
+    // Median split along the longest axis of the light positions
+    int axis = box.longestAxis();
+    int middle = first + count / 2;
+    std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + first + count, [&](int a, int b) {
+        gm::IPoint3 pa = lights_[a]->position(), pb = lights_[b]->position();
+        double ca = (axis == 0) ? pa.x() : (axis == 1) ? pa.y() : pa.z();
+        double cb = (axis == 0) ? pb.x() : (axis == 1) ? pb.y() : pb.z();
+        return ca < cb;
+    });
+
+    int left  = buildNode(order, first, middle - first);
+    int right = buildNode(order, middle, first + count - middle);
+
+    Node &node = nodes_[nodeId];
+    node.box = box;
+    node.power = power;
+    node.left = left;
+    node.right = right;
+    return nodeId;
+}
+
+double LightTree::importance(const Node &node, const gm::IPoint3 &point, const gm::IVec3f &normal) const {
+    double orientation = ORIENTATION_FLOOR + (1.0 - ORIENTATION_FLOOR) * cosineBound(node.box, point, normal);
+    return node.power * orientation;
+}
+
+Light *LightTree::sample(const gm::IPoint3 &point, const gm::IVec3f &normal, double u, double &pdf) const {
+    pdf = 0.0;
+    if (nodes_.empty()) return nullptr;
+
+    pdf = 1.0;
+    int nodeId = 0;
+    while (!nodes_[nodeId].isLeaf()) {
+        const Node &node = nodes_[nodeId];
+        double leftImportance  = importance(nodes_[node.left], point, normal);
+        double rightImportance = importance(nodes_[node.right], point, normal);
+        double total = leftImportance + rightImportance;
+
+        double leftProbability = (total > 0.0) ? leftImportance / total : 0.5;
+        if (u < leftProbability) {
+            pdf *= leftProbability;
+            u = u / leftProbability;
+            nodeId = node.left;
+        } else {
+            pdf *= 1.0 - leftProbability;
+            u = (u - leftProbability) / (1.0 - leftProbability);
+            nodeId = node.right;
+        }
+        u = std::min(u, std::nextafter(1.0, 0.0));
+    }
+
+    return lights_[nodes_[nodeId].light];
+}
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+
+#include "RTMesh.h"
+
+
+// Ray in mesh space, sheared so that it runs along +z from the origin (Woop, Benthin, Wald 2013)
+struct TriangleMeshObject::ShearedRay {
+    double origin[3];
+    int kx, ky, kz;
+    double shearX, shearY, shearZ;
+
+    ShearedRay(const double rayOrigin[3], const double direction[3]) {
+        std::copy(rayOrigin, rayOrigin + 3, origin);
+
+        kz = 0;
+        if (std::fabs(direction[1]) > std::fabs(direction[kz])) kz = 1;
+        if (std::fabs(direction[2]) > std::fabs(direction[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (direction[kz] < 0.0) std::swap(kx, ky);    // keeps the winding of the triangles
+
+        shearX = direction[kx] / direction[kz];
+        shearY = direction[ky] / direction[kz];
+        shearZ = 1.0 / direction[kz];
+    }
+};
+
+
+void TriangleMesh::build() {
+    std::vector<AABB> bounds;
+    prepare(bounds);
+    if (bounds.empty()) return;
+
+    std::vector<int> order;
+    bvh.build(bounds, order);
+    slotTriangles.assign(order.begin(), order.end());
+}
+
+bool TriangleMesh::assign(std::vector<BVHTree::Node> nodes, std::vector<uint32_t> slots) {
+    std::vector<AABB> bounds;
+    prepare(bounds);
+
+    bool fits = slots.size() == bounds.size() && !bounds.empty();
+    std::vector<bool> seen(bounds.size(), false);
+    for (size_t slot = 0; fits && slot < slots.size(); ++slot) {
+        fits = slots[slot] < bounds.size() && !seen[slots[slot]];
+        if (fits) seen[slots[slot]] = true;
+    }
+    if (fits) fits = bvh.assign(std::move(nodes), static_cast<int>(slots.size()));
+
+    if (fits) {
+        slotTriangles = std::move(slots);
+    }
+    else if (!bounds.empty()) {
+        std::vector<int> order;
+        bvh.build(bounds, order);
+        slotTriangles.assign(order.begin(), order.end());
+    }
+    return fits;
+}
+
+void TriangleMesh::prepare(std::vector<AABB> &bounds) {
+    bvh.clear();
+    slotTriangles.clear();
+    areaCdf.clear();
+    localBox = AABB();
+    area = 0.0;
+    bounds.clear();
+
+    if (triangleCount() == 0) return;
+    assert(positions.size() % 3 == 0);
+
+    bounds.resize(triangleCount());
+    areaCdf.resize(triangleCount());
+    for (size_t triangle = 0; triangle < triangleCount(); ++triangle) {
+        double v[3][3];
+        for (int corner = 0; corner < 3; ++corner)
+            vertex(indices[3 * triangle + corner], v[corner]);
+
+        gm::IPoint3 a(v[0][0], v[0][1], v[0][2]), b(v[1][0], v[1][1], v[1][2]), c(v[2][0], v[2][1], v[2][2]);
+        bounds[triangle] = AABB(AABB(a, b), AABB(c, c));
+        localBox = AABB(localBox, bounds[triangle]);
+
+        area += 0.5 * std::sqrt(cross(b - a, c - a).length2());
+        areaCdf[triangle] = area;
+    }
+}
+
+void TriangleMesh::vertex(uint32_t index, double out[3]) const {
+    assert(3 * static_cast<size_t>(index) + 2 < positions.size());
+    const float *position = &positions[3 * static_cast<size_t>(index)];
+    out[0] = position[0];
+    out[1] = position[1];
+    out[2] = position[2];
+}
+
+
+TriangleMeshObject::TriangleMeshObject(std::shared_ptr<const TriangleMesh> mesh, RTMaterial *material, const SceneManager *parent)
+    : Primitives(material, parent)
+{
+    setMesh(std::move(mesh));
+}
+
+void TriangleMeshObject::setMesh(std::shared_ptr<const TriangleMesh> mesh) {
+    if (mesh && !mesh->built()) {
+        auto built = std::make_shared<TriangleMesh>(*mesh);
+        built->build();
+        mesh = std::move(built);
+    }
+    mesh_ = std::move(mesh);
+    markDirty();
+}
+
+AABB TriangleMeshObject::boundingBox() const {
+    if (!hasTree()) return AABB(position_, position_);
+    return AABB(
+        gm::IPoint3(mesh_->localBox.x.min + position_.x(), mesh_->localBox.y.min + position_.y(), mesh_->localBox.z.min + position_.z()),
+        gm::IPoint3(mesh_->localBox.x.max + position_.x(), mesh_->localBox.y.max + position_.y(), mesh_->localBox.z.max + position_.z())
+    );
+}
+
+bool TriangleMeshObject::hit(const Ray& ray, Interval rayTime, HitRecord& rec) const {
+    return hitMesh(ray, rayTime, rec, 1.0);
+}
+
+bool TriangleMeshObject::hitExpanded(const Ray& ray, Interval rayTime, HitRecord& rec) const {
+    if (!selected()) return false;
+    if (hitMesh(ray, rayTime, rec, 1.0)) return true;
+
+    if (!hitMesh(ray, rayTime, rec, EXPAND_COEF)) return false;
+    rec.hitExpanded = true;
+    return true;
+}
+
+bool TriangleMeshObject::hitMesh(const Ray& ray, Interval rayTime, HitRecord& rec, double scale) const {
+    if (!hasTree()) return false;
+
+    // Scaling around the mesh center keeps t: center + (p - center) / scale moves along the ray at the same rate
+    const double rayOrigin[3] = { ray.origin.x() - position_.x(), ray.origin.y() - position_.y(), ray.origin.z() - position_.z() };
+    const double rayDirection[3] = { ray.direction.x(), ray.direction.y(), ray.direction.z() };
+    double origin[3], direction[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        double center = mesh_->localBox.centroid(axis);
+        origin[axis] = center + (rayOrigin[axis] - center) / scale;
+        direction[axis] = rayDirection[axis] / scale;
+    }
+
+    Ray localRay(gm::IPoint3(origin[0], origin[1], origin[2]), gm::IVec3f(direction[0], direction[1], direction[2]));
+    ShearedRay sheared(origin, direction);
+
+    bool found = false;
+    uint32_t hitTriangle = 0;
+    double hitB1 = 0.0, hitB2 = 0.0;
+    double tMax = rayTime.max;
+    mesh_->bvh.traverse(localRay, rayTime.min, tMax, [&](int first, int count, double &leafTMax) {
+        for (int slot = first; slot < first + count; ++slot) {
+            double t = 0.0, b1 = 0.0, b2 = 0.0;
+            if (!intersect(sheared, mesh_->slotTriangles[slot], rayTime.min, leafTMax, t, b1, b2)) continue;
+            leafTMax = t;
+            hitTriangle = mesh_->slotTriangles[slot];
+            hitB1 = b1;
+            hitB2 = b2;
+            found = true;
+        }
+    });
+    if (!found) return false;
+
+    const uint32_t *corners = &mesh_->indices[3 * static_cast<size_t>(hitTriangle)];
+    gm::IVec3f outwardNormal = triangleNormal(hitTriangle);
+
+    if (mesh_->hasNormals()) {
+        double weights[3] = { 1.0 - hitB1 - hitB2, hitB1, hitB2 };
+        double n[3] = { 0.0, 0.0, 0.0 };
+        for (int corner = 0; corner < 3; ++corner) {
+            const float *normal = &mesh_->normals[3 * static_cast<size_t>(corners[corner])];
+            for (int axis = 0; axis < 3; ++axis)
+                n[axis] += weights[corner] * normal[axis];
+        }
+        gm::IVec3f interpolated(n[0], n[1], n[2]);
+        if (interpolated.length2() > 0.0) outwardNormal = interpolated;
+    }
+
+    rec.time = tMax;
+    rec.point = ray.origin + ray.direction * tMax;
+    rec.setFaceNormal(ray, outwardNormal);
+    rec.material = material_;
+    rec.object = this;
+    rec.triangle = hitTriangle;
+    return true;
+}
+
+gm::IVec3f TriangleMeshObject::triangleNormal(uint32_t triangle) const {
+    const uint32_t *corners = &mesh_->indices[3 * static_cast<size_t>(triangle)];
+    double v[3][3];
+    for (int corner = 0; corner < 3; ++corner)
+        mesh_->vertex(corners[corner], v[corner]);
+    gm::IVec3f edgeA(v[1][0] - v[0][0], v[1][1] - v[0][1], v[1][2] - v[0][2]);
+    gm::IVec3f edgeB(v[2][0] - v[0][0], v[2][1] - v[0][1], v[2][2] - v[0][2]);
+    return cross(edgeA, edgeB);
+}
+
+bool TriangleMeshObject::occludes(const Ray& ray, Interval rayTime) const {
+    if (!hasTree()) return false;
+
+    const double origin[3] = { ray.origin.x() - position_.x(), ray.origin.y() - position_.y(), ray.origin.z() - position_.z() };
+    const double direction[3] = { ray.direction.x(), ray.direction.y(), ray.direction.z() };
+    Ray localRay(gm::IPoint3(origin[0], origin[1], origin[2]), ray.direction);
+    ShearedRay sheared(origin, direction);
+
+    return mesh_->bvh.traverseAny(localRay, rayTime.min, rayTime.max, [&](int first, int count) {
+        double t = 0.0, b1 = 0.0, b2 = 0.0;
+        for (int slot = first; slot < first + count; ++slot) {
+            if (intersect(sheared, mesh_->slotTriangles[slot], rayTime.min, rayTime.max, t, b1, b2)) return true;
+        }
+        return false;
+    });
+}
+
+// Edge functions are evaluated in the sheared space where the ray is the +z axis: the ray hits the triangle
+// when all three have the same sign, and an edge shared by two triangles is exactly the same function in both
+bool TriangleMeshObject::intersect(const ShearedRay &ray, uint32_t triangle, double tMin, double tMax, double &t, double &b1, double &b2) const {
+    const uint32_t *corners = &mesh_->indices[3 * static_cast<size_t>(triangle)];
+    double a[3], b[3], c[3];
+    mesh_->vertex(corners[0], a);
+    mesh_->vertex(corners[1], b);
+    mesh_->vertex(corners[2], c);
+    for (int axis = 0; axis < 3; ++axis) {
+        a[axis] -= ray.origin[axis];
+        b[axis] -= ray.origin[axis];
+        c[axis] -= ray.origin[axis];
+    }
+
+    double ax = a[ray.kx] - ray.shearX * a[ray.kz], ay = a[ray.ky] - ray.shearY * a[ray.kz];
+    double bx = b[ray.kx] - ray.shearX * b[ray.kz], by = b[ray.ky] - ray.shearY * b[ray.kz];
+    double cx = c[ray.kx] - ray.shearX * c[ray.kz], cy = c[ray.ky] - ray.shearY * c[ray.kz];
+
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) return false;
+
+    double det = u + v + w;
+    if (det == 0.0) return false;
+
+    double scaledT = u * ray.shearZ * a[ray.kz] + v * ray.shearZ * b[ray.kz] + w * ray.shearZ * c[ray.kz];
+    t = scaledT / det;
+    if (!(t > tMin && t < tMax)) return false;
+
+    b1 = v / det;
+    b2 = w / det;
+    return true;
+}
+
+bool TriangleMeshObject::sampleDirection(const gm::IPoint3 &origin, RTSampler &sampler, gm::IVec3f &direction, double &distance, double &pdf) const {
+    if (!mesh_ || mesh_->area <= 0.0) return false;
+
+    size_t triangle = std::upper_bound(mesh_->areaCdf.begin(), mesh_->areaCdf.end(), sampler.next() * mesh_->area) - mesh_->areaCdf.begin();
+    triangle = std::min(triangle, mesh_->areaCdf.size() - 1);
+
+    const uint32_t *corners = &mesh_->indices[3 * triangle];
+    double v[3][3];
+    for (int corner = 0; corner < 3; ++corner)
+        mesh_->vertex(corners[corner], v[corner]);
+    gm::IVec3f edgeA(v[1][0] - v[0][0], v[1][1] - v[0][1], v[1][2] - v[0][2]);
+    gm::IVec3f edgeB(v[2][0] - v[0][0], v[2][1] - v[0][1], v[2][2] - v[0][2]);
+
+    double su, sv;
+    sampler.next2D(su, sv);
+    su = std::sqrt(su);
+    gm::IPoint3 point = gm::IPoint3(v[0][0] + position_.x(), v[0][1] + position_.y(), v[0][2] + position_.z())
+                      + edgeA * (su * (1.0 - sv)) + edgeB * (su * sv);
+
+    gm::IVec3f toPoint = point - origin;
+    double distance2 = toPoint.length2();
+    if (distance2 <= 0.0) return false;
+    distance = std::sqrt(distance2);
+    direction = toPoint * (1.0 / distance);
+
+    gm::IVec3f normal = triangleNormal(static_cast<uint32_t>(triangle)).normalized();
+    double cosine = std::fabs(dot(normal, direction));
+    if (cosine <= 1e-8) return false;
+    pdf = distance2 / (cosine * mesh_->area);
+    return true;
+}
+
+double TriangleMeshObject::directionPdf(const gm::IPoint3 &origin, const HitRecord &hitRecord) const {
+    if (!mesh_ || hitRecord.triangle >= mesh_->triangleCount()) return 0.0;
+    return areaToSolidAnglePdf(origin, hitRecord.point, triangleNormal(hitRecord.triangle).normalized(), mesh_->area);
+}
+
+std::ostream &TriangleMeshObject::dump(std::ostream &stream) const {
+    Primitives::dump(stream);
+    if (!mesh_) return stream << " 0 0 0";
+
+    stream << ' ' << mesh_->vertexCount();
+    for (float coordinate : mesh_->positions)
+        stream << ' ' << coordinate;
+
+    stream << ' ' << mesh_->hasNormals();
+    if (mesh_->hasNormals()) {
+        for (float coordinate : mesh_->normals)
+            stream << ' ' << coordinate;
+    }
+
+    stream << ' ' << mesh_->triangleCount();
+    for (uint32_t index : mesh_->indices)
+        stream << ' ' << index;
+    return stream;
+}
+
+std::istream &TriangleMeshObject::scan(std::istream &stream) {
+    Primitives::scan(stream);
+
+    auto mesh = std::make_shared<TriangleMesh>();
+    size_t vertexCount = 0, triangleCount = 0;
+    bool hasNormals = false;
+
+    stream >> vertexCount;
+    mesh->positions.resize(3 * vertexCount);
+    for (float &coordinate : mesh->positions)
+        stream >> coordinate;
+
+    stream >> hasNormals;
+    if (hasNormals) {
+        mesh->normals.resize(3 * vertexCount);
+        for (float &coordinate : mesh->normals)
+            stream >> coordinate;
+    }
+
+    stream >> triangleCount;
+    if (!stream) return stream;
+    mesh->indices.resize(3 * triangleCount);
+    for (uint32_t &index : mesh->indices) {
+        // Indices past the vertices are rejected like in the text scene parser, the mesh stays as it was
+        if (!(stream >> index) || index >= vertexCount) {
+            stream.setstate(std::ios::failbit);
+            return stream;
+        }
+    }
+
+    mesh->build();
+    setMesh(std::move(mesh));
+    return stream;
+}
@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "RTMeshLoader.h"
+#include "RTMappedFile.h"
+#include "RTTextCursor.h"
+
+
+namespace {
+
+void clearMesh(TriangleMesh &mesh) {
+    mesh = TriangleMesh();
+}
+
+void addFanTriangle(TriangleMesh &mesh, uint32_t first, uint32_t previous, uint32_t current) {
+    mesh.indices.push_back(first);
+    mesh.indices.push_back(previous);
+    mesh.indices.push_back(current);
+}
+
+// OBJ indices are 1-based, negative ones count back from the last element read so far
+bool resolveObjIndex(long long index, size_t count, uint32_t &resolved) {
+    long long absolute = (index < 0) ? static_cast<long long>(count) + index : index - 1;
+    if (absolute < 0 || absolute >= static_cast<long long>(count)) return false;
+    resolved = static_cast<uint32_t>(absolute);
+    return true;
+}
+
+
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+enum class PlyRole { Other, X, Y, Z, NX, NY, NZ, VertexIndices };
+
+struct PlyProperty {
+    PlyType type = PlyType::Invalid;
+    PlyType countType = PlyType::Invalid;    // list properties only
+    bool list = false;
+    PlyRole role = PlyRole::Other;
+};
+
+struct PlyElement {
+    std::string_view name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+PlyType plyType(std::string_view name) {
+    if (name == "char"   || name == "int8")    return PlyType::Int8;
+    if (name == "uchar"  || name == "uint8")   return PlyType::UInt8;
+    if (name == "short"  || name == "int16")   return PlyType::Int16;
+    if (name == "ushort" || name == "uint16")  return PlyType::UInt16;
+    if (name == "int"    || name == "int32")   return PlyType::Int32;
+    if (name == "uint"   || name == "uint32")  return PlyType::UInt32;
+    if (name == "float"  || name == "float32") return PlyType::Float32;
+    if (name == "double" || name == "float64") return PlyType::Float64;
+    return PlyType::Invalid;
+}
+
+size_t plyTypeSize(PlyType type) {
+    switch (type) {
+        case PlyType::Int8:    case PlyType::UInt8:   return 1;
+        case PlyType::Int16:   case PlyType::UInt16:  return 2;
+        case PlyType::Int32:   case PlyType::UInt32:  case PlyType::Float32: return 4;
+        case PlyType::Float64: return 8;
+        default: return 0;
+    }
+}
+
+PlyRole plyRole(std::string_view element, std::string_view property) {
+    if (element == "vertex") {
+        if (property == "x")  return PlyRole::X;
+        if (property == "y")  return PlyRole::Y;
+        if (property == "z")  return PlyRole::Z;
+        if (property == "nx") return PlyRole::NX;
+        if (property == "ny") return PlyRole::NY;
+        if (property == "nz") return PlyRole::NZ;
+    }
+    if (element == "face" && (property == "vertex_indices" || property == "vertex_index"))
+        return PlyRole::VertexIndices;
+    return PlyRole::Other;
+}
+
+// Binary values are little endian like the hosts this renderer runs on
+double readPlyBinary(PlyType type, const char *at) {
+    switch (type) {
+        case PlyType::Int8:    { int8_t   v; std::memcpy(&v, at, 1); return v; }
+        case PlyType::UInt8:   { uint8_t  v; std::memcpy(&v, at, 1); return v; }
+        case PlyType::Int16:   { int16_t  v; std::memcpy(&v, at, 2); return v; }
+        case PlyType::UInt16:  { uint16_t v; std::memcpy(&v, at, 2); return v; }
+        case PlyType::Int32:   { int32_t  v; std::memcpy(&v, at, 4); return v; }
+        case PlyType::UInt32:  { uint32_t v; std::memcpy(&v, at, 4); return v; }
+        case PlyType::Float32: { float    v; std::memcpy(&v, at, 4); return v; }
+        case PlyType::Float64: { double   v; std::memcpy(&v, at, 8); return v; }
+        default: return 0.0;
+    }
+}
+
+// Reads one value of a PLY body, ascii or binary, and advances the cursor
+class PlyReader {
+public:
+    PlyReader(const char *at, const char *end, bool binary): cursor_{at, end}, binary_(binary) {}
+
+    bool value(PlyType type, double &out) {
+        if (!binary_) return cursor_.number(out);
+
+        size_t size = plyTypeSize(type);
+        if (static_cast<size_t>(cursor_.end - cursor_.at) < size) return false;
+        out = readPlyBinary(type, cursor_.at);
+        cursor_.at += size;
+        return true;
+    }
+
+    void endRecord() {
+        if (!binary_) cursor_.skipLine();
+    }
+
+private:
+    TextCursor cursor_;
+    bool binary_;
+};
+
+bool readPlyFace(PlyReader &reader, const PlyProperty &property, TriangleMesh &mesh, size_t vertexCount) {
+    double count = 0.0;
+    if (!reader.value(property.countType, count) || count < 0.0) return false;
+
+    uint32_t first = 0, previous = 0;
+    for (int corner = 0; corner < static_cast<int>(count); ++corner) {
+        double value = 0.0;
+        if (!reader.value(property.type, value)) return false;
+        if (property.role != PlyRole::VertexIndices) continue;
+
+        if (value < 0.0 || value >= static_cast<double>(vertexCount)) return false;
+        uint32_t index = static_cast<uint32_t>(value);
+        if (corner == 0) first = index;
+        else if (corner >= 2) addFanTriangle(mesh, first, previous, index);
+        previous = index;
+    }
+    return true;
+}
+
+} // namespace
+
+
+bool loadMesh(const std::string &path, TriangleMesh &mesh) {
+    clearMesh(mesh);
+
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) return false;
+    std::string extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    MappedFile file(path);
+    if (!file.valid()) return false;
+
+    if (extension == "obj") return loadObjMesh(file.data(), file.size(), mesh);
+    if (extension == "ply") return loadPlyMesh(file.data(), file.size(), mesh);
+    return false;
+}
+
+bool loadObjMesh(const char *data, size_t size, TriangleMesh &mesh) {
+    clearMesh(mesh);
+
+    TextCursor cursor{data, data + size};
+    std::vector<float> objPositions, objNormals;
+    // Mesh vertex of every v/vn pair, keyed by v << 32 | (vn + 1); vn + 1 = 0 for corners without a normal
+    std::unordered_map<uint64_t, uint32_t> vertexOfPair;
+    std::vector<char> withoutNormal;
+    bool anyNormal = false;
+
+    auto fail = [&mesh]() { clearMesh(mesh); return false; };
+
+    while (!cursor.done()) {
+        std::string_view keyword = cursor.word();
+
+        if (keyword == "v" || keyword == "vn") {
+            float xyz[3];
+            if (!cursor.number(xyz[0]) || !cursor.number(xyz[1]) || !cursor.number(xyz[2])) return fail();
+            std::vector<float> &target = (keyword == "v") ? objPositions : objNormals;
+            target.insert(target.end(), xyz, xyz + 3);
+        }
+        else if (keyword == "f") {
+            size_t positionCount = objPositions.size() / 3;
+            uint32_t first = 0, previous = 0;
+            for (int corner = 0; !cursor.atLineEnd(); ++corner) {
+                long long vertexIndex = 0, normalIndex = 0;
+                bool hasNormal = false;
+
+                uint32_t position = 0;
+                if (!cursor.number(vertexIndex) || !resolveObjIndex(vertexIndex, positionCount, position)) return fail();
+
+                // v/vt/vn, v//vn or v/vt
+                if (!cursor.done() && *cursor.at == '/') {
+                    ++cursor.at;
+                    if (!cursor.done() && *cursor.at != '/') {
+                        long long textureIndex = 0;
+                        if (!cursor.number(textureIndex)) return fail();
+                    }
+                    if (!cursor.done() && *cursor.at == '/') {
+                        ++cursor.at;
+                        if (!cursor.number(normalIndex)) return fail();
+                        hasNormal = true;
+                    }
+                }
+
+                uint32_t normal = 0;
+                if (hasNormal && !resolveObjIndex(normalIndex, objNormals.size() / 3, normal)) return fail();
+
+                uint64_t pair = static_cast<uint64_t>(position) << 32 | (hasNormal ? uint64_t(normal) + 1 : 0);
+                auto inserted = vertexOfPair.emplace(pair, static_cast<uint32_t>(mesh.vertexCount()));
+                uint32_t index = inserted.first->second;
+                if (inserted.second) {
+                    const float *xyz = &objPositions[3 * static_cast<size_t>(position)];
+                    mesh.positions.insert(mesh.positions.end(), xyz, xyz + 3);
+                    if (hasNormal) {
+                        const float *n = &objNormals[3 * static_cast<size_t>(normal)];
+                        mesh.normals.insert(mesh.normals.end(), n, n + 3);
+                    }
+                    else mesh.normals.insert(mesh.normals.end(), { 0.0f, 0.0f, 0.0f });
+                    withoutNormal.push_back(!hasNormal);
+                    anyNormal = anyNormal || hasNormal;
+                }
+
+                if (corner == 0) first = index;
+                else if (corner >= 2) addFanTriangle(mesh, first, previous, index);
+                previous = index;
+            }
+        }
+        cursor.skipLine();
+    }
+
+    // Corners without vn in a mesh with normals get the area weighted normal of their triangles
+    if (!anyNormal) mesh.normals.clear();
+    else {
+        for (size_t triangle = 0; triangle < mesh.triangleCount(); ++triangle) {
+            const uint32_t *corners = &mesh.indices[3 * triangle];
+            if (!withoutNormal[corners[0]] && !withoutNormal[corners[1]] && !withoutNormal[corners[2]]) continue;
+
+            const float *a = &mesh.positions[3 * static_cast<size_t>(corners[0])];
+            const float *b = &mesh.positions[3 * static_cast<size_t>(corners[1])];
+            const float *c = &mesh.positions[3 * static_cast<size_t>(corners[2])];
+            float ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            float ac[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+            float n[3] = { ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0] };
+
+            for (int corner = 0; corner < 3; ++corner) {
+                if (!withoutNormal[corners[corner]]) continue;
+                float *target = &mesh.normals[3 * static_cast<size_t>(corners[corner])];
+                for (int axis = 0; axis < 3; ++axis) target[axis] += n[axis];
+            }
+        }
+
+        for (size_t vertex = 0; vertex < mesh.vertexCount(); ++vertex) {
+            float *n = &mesh.normals[3 * vertex];
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (!withoutNormal[vertex] || length <= 0.0f) continue;
+            for (int axis = 0; axis < 3; ++axis) n[axis] /= length;
+        }
+    }
+
+    mesh.build();
+    return true;
+}
+
+bool loadPlyMesh(const char *data, size_t size, TriangleMesh &mesh) {
+    clearMesh(mesh);
+
+    TextCursor cursor{data, data + size};
+    auto fail = [&mesh]() { clearMesh(mesh); return false; };
+
+    if (cursor.word() != "ply") return fail();
+    cursor.skipLine();
+
+    bool binary = false;
+    std::vector<PlyElement> elements;
+    while (true) {
+        if (cursor.done()) return fail();
+        std::string_view keyword = cursor.word();
+
+        if (keyword == "format") {
+            std::string_view format = cursor.word();
+            if (format == "binary_little_endian") binary = true;
+            else if (format != "ascii") return fail();
+        }
+        else if (keyword == "element") {
+            PlyElement element;
+            element.name = cursor.word();
+            if (!cursor.number(element.count)) return fail();
+            elements.push_back(element);
+        }
+        else if (keyword == "property") {
+            if (elements.empty()) return fail();
+            PlyProperty property;
+            std::string_view type = cursor.word();
+            if (type == "list") {
+                property.list = true;
+                property.countType = plyType(cursor.word());
+                type = cursor.word();
+                if (property.countType == PlyType::Invalid) return fail();
+            }
+            property.type = plyType(type);
+            if (property.type == PlyType::Invalid) return fail();
+            property.role = plyRole(elements.back().name, cursor.word());
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header") {
+            cursor.skipLine();
+            break;
+        }
+        cursor.skipLine();
+    }
+
+    size_t vertexCount = 0;
+    bool hasNormals = false;
+    for (const PlyElement &element : elements) {
+        if (element.name != "vertex") continue;
+        vertexCount = element.count;
+        for (const PlyProperty &property : element.properties)
+            hasNormals = hasNormals || property.role == PlyRole::NX;
+    }
+
+    mesh.positions.reserve(3 * vertexCount);
+    if (hasNormals) mesh.normals.reserve(3 * vertexCount);
+
+    PlyReader reader(cursor.at, cursor.end, binary);
+    for (const PlyElement &element : elements) {
+        for (size_t item = 0; item < element.count; ++item) {
+            double xyz[3] = { 0.0, 0.0, 0.0 }, normal[3] = { 0.0, 0.0, 0.0 };
+
+            for (const PlyProperty &property : element.properties) {
+                if (property.list) {
+                    if (!readPlyFace(reader, property, mesh, vertexCount)) return fail();
+                    continue;
+                }
+
+                double value = 0.0;
+                if (!reader.value(property.type, value)) return fail();
+                switch (property.role) {
+                    case PlyRole::X:  xyz[0] = value;    break;
+                    case PlyRole::Y:  xyz[1] = value;    break;
+                    case PlyRole::Z:  xyz[2] = value;    break;
+                    case PlyRole::NX: normal[0] = value; break;
+                    case PlyRole::NY: normal[1] = value; break;
+                    case PlyRole::NZ: normal[2] = value; break;
+                    default: break;
+                }
+            }
+            reader.endRecord();
+
+            if (element.name == "vertex") {
+                mesh.positions.insert(mesh.positions.end(), { float(xyz[0]), float(xyz[1]), float(xyz[2]) });
+                if (hasNormals)
+                    mesh.normals.insert(mesh.normals.end(), { float(normal[0]), float(normal[1]), float(normal[2]) });
+            }
+        }
+    }
+    mesh.build();
+    return true;
+}
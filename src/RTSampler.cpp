@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "RTSampler.h"
+
+
+namespace {
+
+constexpr int SIZE  = RTSampler::BLUE_NOISE_SIZE;
+constexpr int CELLS = SIZE * SIZE;
+
+// Share of the cells set in the initial pattern of void-and-cluster
+constexpr int INITIAL_DIVISOR = 10;
+constexpr double SIGMA = 1.5;
+
+// Void-and-cluster (Ulichney). Every set cell spreads a gaussian over the torus; the set cell with the
+// highest energy is the tightest cluster, the empty cell with the lowest the largest void. Ranks below the
+// relaxed initial pattern remove clusters from it, ranks above fill voids until the mask is full.
+class BlueNoiseBuilder {
+public:
+    BlueNoiseBuilder() : kernel_(CELLS), energy_(CELLS, 0.0), set_(CELLS, 0) {
+        for (int y = 0; y < SIZE; ++y) {
+            for (int x = 0; x < SIZE; ++x) {
+                int dx = std::min(x, SIZE - x), dy = std::min(y, SIZE - y);
+                kernel_[y * SIZE + x] = std::exp(-(dx * dx + dy * dy) / (2.0 * SIGMA * SIGMA));
+            }
+        }
+    }
+
+    std::vector<uint16_t> build() {
+        const int initialCount = CELLS / INITIAL_DIVISOR;
+        seedPattern(initialCount);
+        relax();
+
+        std::vector<uint16_t> ranks(CELLS);
+        std::vector<double> prototypeEnergy = energy_;
+        std::vector<uint8_t> prototypeSet = set_;
+
+        for (int rank = initialCount - 1; rank >= 0; --rank) {
+            int cell = tightestCluster();
+            toggle(cell);
+            ranks[cell] = static_cast<uint16_t>(rank);
+        }
+
+        energy_ = prototypeEnergy;
+        set_ = prototypeSet;
+        for (int rank = initialCount; rank < CELLS; ++rank) {
+            int cell = largestVoid();
+            toggle(cell);
+            ranks[cell] = static_cast<uint16_t>(rank);
+        }
+        return ranks;
+    }
+
+private:
+    std::vector<double> kernel_;
+    std::vector<double> energy_;
+    std::vector<uint8_t> set_;
+
+    void toggle(int cell) {
+        double sign = set_[cell] ? -1.0 : 1.0;
+        set_[cell] ^= 1;
+
+        int cx = cell % SIZE, cy = cell / SIZE;
+        for (int y = 0; y < SIZE; ++y) {
+            const double *row = &kernel_[((y - cy + SIZE) % SIZE) * SIZE];
+            for (int x = 0; x < SIZE; ++x)
+                energy_[y * SIZE + x] += sign * row[(x - cx + SIZE) % SIZE];
+        }
+    }
+
+    int tightestCluster() const {
+        int best = -1;
+        for (int cell = 0; cell < CELLS; ++cell)
+            if (set_[cell] && (best < 0 || energy_[cell] > energy_[best])) best = cell;
+        return best;
+    }
+
+    int largestVoid() const {
+        int best = -1;
+        for (int cell = 0; cell < CELLS; ++cell)
+            if (!set_[cell] && (best < 0 || energy_[cell] < energy_[best])) best = cell;
+        return best;
+    }
+
+    // Fixed-seed LCG, the mask is the same in every run
+    void seedPattern(int count) {
+        uint32_t state = 0x2545F491u;
+        for (int placed = 0; placed < count;) {
+            state = state * 1664525u + 1013904223u;
+            int cell = static_cast<int>((state >> 8) % CELLS);
+            if (set_[cell]) continue;
+            toggle(cell);
+            ++placed;
+        }
+    }
+
+    // Moves the tightest cluster into the largest void until that changes nothing
+    void relax() {
+        for (int iteration = 0; iteration < CELLS; ++iteration) {
+            int cluster = tightestCluster();
+            toggle(cluster);
+            int empty = largestVoid();
+            toggle(empty);
+            if (empty == cluster) break;
+        }
+    }
+};
+
+} // namespace
+
+const uint16_t *RTSampler::blueNoiseMask() {
+    static const std::vector<uint16_t> mask = BlueNoiseBuilder().build();
+    return mask.data();
+}
@@ -0,0 +1,733 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#include "RTSceneFile.h"
+#include "RTMappedFile.h"
+#include "RTMesh.h"
+
+
+namespace {
+
+constexpr char     SCENE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+constexpr uint32_t SCENE_VERSION  = 1;
+
+enum class SectionKind : uint32_t {
+    Materials = 1,
+    Lights,
+    Spheres,
+    Boxes,
+    Planes,
+    Polygons,
+    PolygonVertices,
+    MeshObjects,
+    Meshes,
+    MeshPositions,
+    MeshNormals,
+    MeshTriangles,
+    MeshNodes,
+    MeshSlots,
+    SphereNodes,
+    SphereSlots,
+    BoxNodes,
+    BoxSlots,
+    OtherNodes,
+    OtherSlots,
+};
+
+struct FileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+};
+
+struct SectionEntry {
+    uint32_t kind;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t offset;    // from the start of the file, 8-byte aligned
+};
+
+enum class MaterialType : uint32_t { Lambertian, Metal, Dielectric, Emissive };
+
+struct MaterialFileRecord {
+    uint32_t type;
+    uint32_t reserved;
+    double   diffuse[3];
+    double   specular[3];
+    double   emitted[3];
+    double   attenuation[3];    // dielectric only
+    double   parameter;         // metal fuzz or dielectric refraction index
+};
+
+struct LightRecord {
+    double position[3];
+    double ambient[3];
+    double diffuse[3];
+    double specular[3];
+    double viewLightPow;
+};
+
+struct SphereRecord {
+    double   position[3];
+    double   radius;
+    uint32_t material;
+    uint32_t selected;
+};
+
+struct BoxRecord {
+    double   position[3];
+    double   halfSize[3];
+    uint32_t material;
+    uint32_t selected;
+};
+
+struct PlaneRecord {
+    double   position[3];
+    double   normal[3];
+    uint32_t material;
+    uint32_t selected;
+};
+
+// Vertices [firstVertex, firstVertex + vertexCount) of the PolygonVertices section
+struct PolygonRecord {
+    double   position[3];
+    uint64_t firstVertex;
+    uint64_t vertexCount;
+    uint32_t material;
+    uint32_t selected;
+};
+
+struct VertexRecord {
+    double xyz[3];
+};
+
+struct MeshObjectRecord {
+    double   position[3];
+    uint32_t mesh;
+    uint32_t material;
+    uint32_t selected;
+    uint32_t reserved;
+};
+
+// Ranges into the mesh pool sections. Normals are absent when firstNormal is UINT64_MAX.
+struct MeshRecord {
+    uint64_t firstVertex;
+    uint64_t vertexCount;
+    uint64_t firstNormal;
+    uint64_t firstTriangle;
+    uint64_t triangleCount;
+    uint64_t firstNode;
+    uint64_t nodeCount;
+    uint64_t firstSlot;     // triangleCount slots
+};
+
+struct Float3Record {
+    float xyz[3];
+};
+
+struct TriangleRecord {
+    uint32_t corners[3];
+};
+
+struct NodeRecord {
+    double  min[3];
+    double  max[3];
+    double  buildArea;
+    int32_t left, right, parent, first, count;
+    int32_t reserved;
+};
+
+// Object stored in slot i of a scene BVH: a record of one of the object sections
+struct SlotRecord {
+    uint32_t section;
+    uint32_t index;
+};
+
+static_assert(sizeof(FileHeader) == 24 && sizeof(SectionEntry) == 24, "scene file header layout");
+static_assert(sizeof(MaterialFileRecord) == 112 && sizeof(LightRecord) == 104, "scene file record layout");
+static_assert(sizeof(SphereRecord) == 40 && sizeof(BoxRecord) == 56 && sizeof(PlaneRecord) == 56, "scene file record layout");
+static_assert(sizeof(PolygonRecord) == 48 && sizeof(VertexRecord) == 24 && sizeof(MeshObjectRecord) == 40, "scene file record layout");
+static_assert(sizeof(MeshRecord) == 64 && sizeof(Float3Record) == 12 && sizeof(TriangleRecord) == 12, "scene file record layout");
+static_assert(sizeof(NodeRecord) == 80 && sizeof(SlotRecord) == 8, "scene file record layout");
+
+
+void storeVector(const gm::IVec3f &v, double out[3]) {
+    out[0] = v.x();
+    out[1] = v.y();
+    out[2] = v.z();
+}
+
+void storePoint(const gm::IPoint3 &p, double out[3]) {
+    out[0] = p.x();
+    out[1] = p.y();
+    out[2] = p.z();
+}
+
+gm::IVec3f loadVector(const double in[3]) {
+    return gm::IVec3f(in[0], in[1], in[2]);
+}
+
+gm::IPoint3 loadPoint(const double in[3]) {
+    return gm::IPoint3(in[0], in[1], in[2]);
+}
+
+NodeRecord storeNode(const BVHTree::Node &node) {
+    NodeRecord record = {};
+    record.min[0] = node.box.x.min;  record.max[0] = node.box.x.max;
+    record.min[1] = node.box.y.min;  record.max[1] = node.box.y.max;
+    record.min[2] = node.box.z.min;  record.max[2] = node.box.z.max;
+    record.buildArea = node.buildArea;
+    record.left   = node.left;
+    record.right  = node.right;
+    record.parent = node.parent;
+    record.first  = node.first;
+    record.count  = node.count;
+    return record;
+}
+
+// Boxes are restored interval by interval, the AABB constructors would pad them
+std::vector<BVHTree::Node> loadNodes(const NodeRecord *records, size_t count) {
+    std::vector<BVHTree::Node> nodes(count);
+    for (size_t i = 0; i < count; ++i) {
+        const NodeRecord &record = records[i];
+        BVHTree::Node &node = nodes[i];
+        node.box.x = Interval(record.min[0], record.max[0]);
+        node.box.y = Interval(record.min[1], record.max[1]);
+        node.box.z = Interval(record.min[2], record.max[2]);
+        node.buildArea = record.buildArea;
+        node.left   = record.left;
+        node.right  = record.right;
+        node.parent = record.parent;
+        node.first  = record.first;
+        node.count  = record.count;
+    }
+    return nodes;
+}
+
+
+// Sections collected by the writer, each a flat array of one record type
+class SectionWriter {
+public:
+    template <typename Record>
+    void add(SectionKind kind, const std::vector<Record> &records) {
+        sections_.push_back({ kind, sizeof(Record), records.size(), records.data() });
+    }
+
+    bool write(const std::string &path) const {
+        std::vector<SectionEntry> table(sections_.size());
+        uint64_t offset = alignUp(sizeof(FileHeader) + table.size() * sizeof(SectionEntry));
+        for (size_t i = 0; i < sections_.size(); ++i) {
+            table[i] = { static_cast<uint32_t>(sections_[i].kind), sections_[i].recordSize, sections_[i].count, offset };
+            offset = alignUp(offset + sections_[i].count * sections_[i].recordSize);
+        }
+
+        FileHeader header = {};
+        std::memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+        header.version = SCENE_VERSION;
+        header.sectionCount = static_cast<uint32_t>(table.size());
+        header.fileSize = offset;
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+
+        uint64_t written = 0;
+        auto put = [&](const void *data, uint64_t size) {
+            file.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+            written += size;
+        };
+        auto pad = [&]() {
+            static const char zeros[8] = {};
+            put(zeros, alignUp(written) - written);
+        };
+
+        put(&header, sizeof(header));
+        put(table.data(), table.size() * sizeof(SectionEntry));
+        pad();
+        for (const Section &section : sections_) {
+            put(section.data, section.count * section.recordSize);
+            pad();
+        }
+        return static_cast<bool>(file.flush());
+    }
+
+private:
+    struct Section {
+        SectionKind kind;
+        uint32_t    recordSize;
+        uint64_t    count;
+        const void *data;
+    };
+    std::vector<Section> sections_;
+
+    static uint64_t alignUp(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+};
+
+// Typed view of a section inside the mapped file
+template <typename Record>
+struct RecordSpan {
+    const Record *data = nullptr;
+    size_t count = 0;
+
+    const Record &operator[](size_t i) const { return data[i]; }
+    const Record *begin() const { return data; }
+    const Record *end() const { return data + count; }
+    bool contains(uint64_t first, uint64_t size) const { return first <= count && size <= count - first; }
+};
+
+class SectionReader {
+public:
+    bool open(const MappedFile &file) {
+        if (!file.valid() || file.size() < sizeof(FileHeader)) return false;
+        data_ = file.data();
+        size_ = file.size();
+
+        FileHeader header;
+        std::memcpy(&header, data_, sizeof(header));
+        if (std::memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0) return false;
+        if (header.version != SCENE_VERSION || header.fileSize > size_) return false;
+        if (header.sectionCount > (size_ - sizeof(FileHeader)) / sizeof(SectionEntry)) return false;
+
+        table_.resize(header.sectionCount);
+        std::memcpy(table_.data(), data_ + sizeof(FileHeader), table_.size() * sizeof(SectionEntry));
+        for (const SectionEntry &entry : table_) {
+            if (entry.offset % 8 != 0 || entry.offset > size_ || entry.recordSize == 0) return false;
+            if (entry.count > (size_ - entry.offset) / entry.recordSize) return false;
+        }
+        return true;
+    }
+
+    bool has(SectionKind kind) const { return find(kind) != nullptr; }
+
+    // A missing section reads as empty; a section with another record size fails
+    template <typename Record>
+    bool read(SectionKind kind, RecordSpan<Record> &span) const {
+        span = {};
+        const SectionEntry *entry = find(kind);
+        if (!entry) return true;
+        if (entry->recordSize != sizeof(Record)) return false;
+        span.data = reinterpret_cast<const Record *>(data_ + entry->offset);
+        span.count = static_cast<size_t>(entry->count);
+        return true;
+    }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<SectionEntry> table_;
+
+    const SectionEntry *find(SectionKind kind) const {
+        for (const SectionEntry &entry : table_)
+            if (entry.kind == static_cast<uint32_t>(kind)) return &entry;
+        return nullptr;
+    }
+};
+
+} // namespace
+
+
+bool saveSceneBinary(const std::string &path, const SceneManager &scene, bool storeAcceleration) {
+    std::vector<MaterialFileRecord> materials;
+    std::unordered_map<const RTMaterial *, uint32_t> materialIndex;
+
+    // Index of the material, written on first use. False for materials the format does not know.
+    auto addMaterial = [&](const RTMaterial *material, uint32_t &index) {
+        if (!material) return false;
+        auto it = materialIndex.find(material);
+        if (it != materialIndex.end()) {
+            index = it->second;
+            return true;
+        }
+
+        MaterialFileRecord record = {};
+        if (typeid(*material) == typeid(RTMetal)) {
+            auto *metal = static_cast<const RTMetal *>(material);
+            record.type = static_cast<uint32_t>(MaterialType::Metal);
+            record.parameter = metal->fuzz();
+        }
+        else if (typeid(*material) == typeid(RTDielectric)) {
+            auto *dielectric = static_cast<const RTDielectric *>(material);
+            record.type = static_cast<uint32_t>(MaterialType::Dielectric);
+            record.parameter = dielectric->refractionIndex();
+            storeVector(dielectric->attenuation(), record.attenuation);
+        }
+        else if (typeid(*material) == typeid(RTLambertian)) record.type = static_cast<uint32_t>(MaterialType::Lambertian);
+        else if (typeid(*material) == typeid(RTEmissive))   record.type = static_cast<uint32_t>(MaterialType::Emissive);
+        else return false;
+
+        storeVector(material->diffuse(), record.diffuse);
+        storeVector(material->specular(), record.specular);
+        storeVector(material->emitted(), record.emitted);
+
+        index = static_cast<uint32_t>(materials.size());
+        materialIndex[material] = index;
+        materials.push_back(record);
+        return true;
+    };
+
+    std::vector<SphereRecord> spheres;
+    std::vector<BoxRecord> boxes;
+    std::vector<PlaneRecord> planes;
+    std::vector<PolygonRecord> polygons;
+    std::vector<VertexRecord> polygonVertices;
+    std::vector<MeshObjectRecord> meshObjects;
+
+    std::vector<MeshRecord> meshes;
+    std::vector<Float3Record> meshPositions, meshNormals;
+    std::vector<TriangleRecord> meshTriangles;
+    std::vector<NodeRecord> meshNodes;
+    std::vector<uint32_t> meshSlots;
+    std::unordered_map<const TriangleMesh *, uint32_t> meshIndex;
+
+    // Shared meshes are stored once, with their BVH
+    auto addMesh = [&](const TriangleMeshObject &object) {
+        const TriangleMesh *mesh = object.mesh().get();
+        auto it = meshIndex.find(mesh);
+        if (it != meshIndex.end()) return it->second;
+
+        MeshRecord record = {};
+        static const TriangleMesh emptyMesh;
+        const TriangleMesh &source = mesh ? *mesh : emptyMesh;
+
+        record.firstVertex = meshPositions.size();
+        record.vertexCount = source.vertexCount();
+        for (size_t i = 0; i < source.vertexCount(); ++i)
+            meshPositions.push_back({ { source.positions[3 * i], source.positions[3 * i + 1], source.positions[3 * i + 2] } });
+
+        record.firstNormal = UINT64_MAX;
+        if (source.hasNormals()) {
+            record.firstNormal = meshNormals.size();
+            for (size_t i = 0; i < source.vertexCount(); ++i)
+                meshNormals.push_back({ { source.normals[3 * i], source.normals[3 * i + 1], source.normals[3 * i + 2] } });
+        }
+
+        record.firstTriangle = meshTriangles.size();
+        record.triangleCount = source.triangleCount();
+        for (size_t i = 0; i < source.triangleCount(); ++i)
+            meshTriangles.push_back({ { source.indices[3 * i], source.indices[3 * i + 1], source.indices[3 * i + 2] } });
+
+        // Meshes without a tree are built on load
+        record.firstNode = meshNodes.size();
+        record.firstSlot = meshSlots.size();
+        if (!source.bvh.empty() && source.built()) {
+            record.nodeCount = source.bvh.nodes().size();
+            for (const BVHTree::Node &node : source.bvh.nodes())
+                meshNodes.push_back(storeNode(node));
+            meshSlots.insert(meshSlots.end(), source.slotTriangles.begin(), source.slotTriangles.end());
+        }
+
+        uint32_t index = static_cast<uint32_t>(meshes.size());
+        meshIndex[mesh] = index;
+        meshes.push_back(record);
+        return index;
+    };
+
+    // Scene BVH groups, split the way SceneManager::trackObject splits them
+    std::vector<const Primitives *> groupObjects[3];
+    std::vector<SlotRecord> groupSlots[3];
+
+    for (const Primitives *object : scene.primitives()) {
+        uint32_t material = 0;
+        if (!addMaterial(object->material(), material)) return false;
+
+        uint32_t selected = object->selected() ? 1 : 0;
+        SlotRecord slot = {};
+
+        // Exact types only: a subclass can carry behaviour the records do not store, so it is not saveable
+        if (typeid(*object) == typeid(SphereObject)) {
+            auto *sphere = static_cast<const SphereObject *>(object);
+            SphereRecord record = {};
+            storePoint(sphere->position(), record.position);
+            record.radius = sphere->getRadius();
+            record.material = material;
+            record.selected = selected;
+            slot = { static_cast<uint32_t>(SectionKind::Spheres), static_cast<uint32_t>(spheres.size()) };
+            spheres.push_back(record);
+        }
+        else if (typeid(*object) == typeid(CubeObject)) {
+            auto *box = static_cast<const CubeObject *>(object);
+            BoxRecord record = {};
+            storePoint(box->position(), record.position);
+            storeVector(box->getHalfSize(), record.halfSize);
+            record.material = material;
+            record.selected = selected;
+            slot = { static_cast<uint32_t>(SectionKind::Boxes), static_cast<uint32_t>(boxes.size()) };
+            boxes.push_back(record);
+        }
+        else if (typeid(*object) == typeid(PlaneObject)) {
+            auto *plane = static_cast<const PlaneObject *>(object);
+            PlaneRecord record = {};
+            storePoint(plane->position(), record.position);
+            storeVector(plane->getNormal(), record.normal);
+            record.material = material;
+            record.selected = selected;
+            slot = { static_cast<uint32_t>(SectionKind::Planes), static_cast<uint32_t>(planes.size()) };
+            planes.push_back(record);
+        }
+        else if (typeid(*object) == typeid(PolygonObject)) {
+            auto *polygon = static_cast<const PolygonObject *>(object);
+            PolygonRecord record = {};
+            storePoint(polygon->position(), record.position);
+            record.firstVertex = polygonVertices.size();
+            record.vertexCount = polygon->vertices().size();
+            record.material = material;
+            record.selected = selected;
+            for (const gm::IPoint3 &vertex : polygon->vertices())
+                polygonVertices.push_back({ { vertex.x(), vertex.y(), vertex.z() } });
+            slot = { static_cast<uint32_t>(SectionKind::Polygons), static_cast<uint32_t>(polygons.size()) };
+            polygons.push_back(record);
+        }
+        else if (typeid(*object) == typeid(TriangleMeshObject)) {
+            auto *meshObject = static_cast<const TriangleMeshObject *>(object);
+            MeshObjectRecord record = {};
+            storePoint(meshObject->position(), record.position);
+            record.mesh = addMesh(*meshObject);
+            record.material = material;
+            record.selected = selected;
+            slot = { static_cast<uint32_t>(SectionKind::MeshObjects), static_cast<uint32_t>(meshObjects.size()) };
+            meshObjects.push_back(record);
+        }
+        else return false;
+
+        if (object->boundingBox().isInfinite()) continue;
+        int group = SphereStorage::accepts(object) ? 0 : BoxStorage::accepts(object) ? 1 : 2;
+        groupObjects[group].push_back(object);
+        groupSlots[group].push_back(slot);
+    }
+
+    std::vector<LightRecord> lights;
+    lights.reserve(scene.lights().size());
+    for (const Light *light : scene.lights()) {
+        LightRecord record = {};
+        storePoint(light->position(), record.position);
+        storeVector(light->ambientIntensity(), record.ambient);
+        storeVector(light->defuseIntensity(), record.diffuse);
+        storeVector(light->specularIntensity(), record.specular);
+        record.viewLightPow = light->viewLightPow();
+        lights.push_back(record);
+    }
+
+    SectionWriter writer;
+    writer.add(SectionKind::Materials, materials);
+    writer.add(SectionKind::Lights, lights);
+    writer.add(SectionKind::Spheres, spheres);
+    writer.add(SectionKind::Boxes, boxes);
+    writer.add(SectionKind::Planes, planes);
+    writer.add(SectionKind::Polygons, polygons);
+    writer.add(SectionKind::PolygonVertices, polygonVertices);
+    writer.add(SectionKind::MeshObjects, meshObjects);
+    writer.add(SectionKind::Meshes, meshes);
+    writer.add(SectionKind::MeshPositions, meshPositions);
+    writer.add(SectionKind::MeshNormals, meshNormals);
+    writer.add(SectionKind::MeshTriangles, meshTriangles);
+    writer.add(SectionKind::MeshNodes, meshNodes);
+    writer.add(SectionKind::MeshSlots, meshSlots);
+
+    // Same builds the scene would run on its first commit(), stored in slot order
+    const SectionKind nodeKinds[3] = { SectionKind::SphereNodes, SectionKind::BoxNodes, SectionKind::OtherNodes };
+    const SectionKind slotKinds[3] = { SectionKind::SphereSlots, SectionKind::BoxSlots, SectionKind::OtherSlots };
+    std::vector<NodeRecord> groupNodes[3];
+    std::vector<SlotRecord> orderedSlots[3];
+    if (storeAcceleration) {
+        for (int group = 0; group < 3; ++group) {
+            std::vector<AABB> bounds;
+            bounds.reserve(groupObjects[group].size());
+            for (const Primitives *object : groupObjects[group]) {
+                AABB box = object->boundingBox();
+                bounds.push_back(group == 0 ? SphereStorage::bounds(box) : group == 1 ? BoxStorage::bounds(box) : ObjectStorage::bounds(box));
+            }
+
+            BVHTree bvh;
+            std::vector<int> order;
+            bvh.build(bounds, order);
+
+            for (const BVHTree::Node &node : bvh.nodes())
+                groupNodes[group].push_back(storeNode(node));
+            for (int index : order)
+                orderedSlots[group].push_back(groupSlots[group][index]);
+
+            writer.add(nodeKinds[group], groupNodes[group]);
+            writer.add(slotKinds[group], orderedSlots[group]);
+        }
+    }
+
+    return writer.write(path);
+}
+
+bool loadSceneBinary(const std::string &path, SceneManager &scene, RTMaterialManager &materialManager) {
+    MappedFile file(path);
+    SectionReader reader;
+    if (!reader.open(file)) return false;
+
+    RecordSpan<MaterialFileRecord> materials;
+    RecordSpan<LightRecord> lights;
+    RecordSpan<SphereRecord> spheres;
+    RecordSpan<BoxRecord> boxes;
+    RecordSpan<PlaneRecord> planes;
+    RecordSpan<PolygonRecord> polygons;
+    RecordSpan<VertexRecord> polygonVertices;
+    RecordSpan<MeshObjectRecord> meshObjects;
+    RecordSpan<MeshRecord> meshes;
+    RecordSpan<Float3Record> meshPositions, meshNormals;
+    RecordSpan<TriangleRecord> meshTriangles;
+    RecordSpan<NodeRecord> meshNodes;
+    RecordSpan<uint32_t> meshSlots;
+    RecordSpan<NodeRecord> groupNodes[3];
+    RecordSpan<SlotRecord> groupSlots[3];
+
+    bool sectionsRead = reader.read(SectionKind::Materials, materials) && reader.read(SectionKind::Lights, lights)
+             && reader.read(SectionKind::Spheres, spheres) && reader.read(SectionKind::Boxes, boxes)
+             && reader.read(SectionKind::Planes, planes) && reader.read(SectionKind::Polygons, polygons)
+             && reader.read(SectionKind::PolygonVertices, polygonVertices) && reader.read(SectionKind::MeshObjects, meshObjects)
+             && reader.read(SectionKind::Meshes, meshes) && reader.read(SectionKind::MeshPositions, meshPositions)
+             && reader.read(SectionKind::MeshNormals, meshNormals) && reader.read(SectionKind::MeshTriangles, meshTriangles)
+             && reader.read(SectionKind::MeshNodes, meshNodes) && reader.read(SectionKind::MeshSlots, meshSlots)
+             && reader.read(SectionKind::SphereNodes, groupNodes[0]) && reader.read(SectionKind::SphereSlots, groupSlots[0])
+             && reader.read(SectionKind::BoxNodes, groupNodes[1]) && reader.read(SectionKind::BoxSlots, groupSlots[1])
+             && reader.read(SectionKind::OtherNodes, groupNodes[2]) && reader.read(SectionKind::OtherSlots, groupSlots[2]);
+    if (!sectionsRead) return false;
+
+    // Everything is checked before the first object is created, a bad file leaves the scene alone
+    for (const MaterialFileRecord &record : materials)
+        if (record.type > static_cast<uint32_t>(MaterialType::Emissive)) return false;
+
+    auto validMaterial = [&](const auto &records) {
+        return std::all_of(records.begin(), records.end(), [&](const auto &record) { return record.material < materials.count; });
+    };
+    if (!validMaterial(spheres) || !validMaterial(boxes) || !validMaterial(planes) || !validMaterial(polygons) || !validMaterial(meshObjects))
+        return false;
+
+    for (const PolygonRecord &record : polygons)
+        if (!polygonVertices.contains(record.firstVertex, record.vertexCount)) return false;
+
+    for (const MeshObjectRecord &record : meshObjects)
+        if (record.mesh >= meshes.count) return false;
+
+    for (const MeshRecord &record : meshes) {
+        if (!meshPositions.contains(record.firstVertex, record.vertexCount)) return false;
+        if (record.firstNormal != UINT64_MAX && !meshNormals.contains(record.firstNormal, record.vertexCount)) return false;
+        if (!meshTriangles.contains(record.firstTriangle, record.triangleCount)) return false;
+        if (!meshNodes.contains(record.firstNode, record.nodeCount)) return false;
+        if (record.nodeCount > 0 && !meshSlots.contains(record.firstSlot, record.triangleCount)) return false;
+
+        for (size_t i = 0; i < record.triangleCount; ++i)
+            for (uint32_t corner : meshTriangles[record.firstTriangle + i].corners)
+                if (corner >= record.vertexCount) return false;
+    }
+
+    const size_t sectionCounts[] = { spheres.count, boxes.count, planes.count, polygons.count, meshObjects.count };
+    const SectionKind objectKinds[] = { SectionKind::Spheres, SectionKind::Boxes, SectionKind::Planes, SectionKind::Polygons, SectionKind::MeshObjects };
+    auto slotValid = [&](const SlotRecord &slot) {
+        for (int kind = 0; kind < 5; ++kind)
+            if (slot.section == static_cast<uint32_t>(objectKinds[kind])) return slot.index < sectionCounts[kind];
+        return false;
+    };
+    bool hasAcceleration = reader.has(SectionKind::SphereSlots) && reader.has(SectionKind::BoxSlots) && reader.has(SectionKind::OtherSlots);
+    for (int group = 0; group < 3 && hasAcceleration; ++group)
+        hasAcceleration = std::all_of(groupSlots[group].begin(), groupSlots[group].end(), slotValid);
+
+
+    std::vector<RTMaterial *> createdMaterials;
+    createdMaterials.reserve(materials.count);
+    for (const MaterialFileRecord &record : materials) {
+        RTMaterial *material = nullptr;
+        switch (static_cast<MaterialType>(record.type)) {
+            case MaterialType::Lambertian: material = materialManager.MakeLambertian(loadVector(record.diffuse)); break;
+            case MaterialType::Metal:      material = materialManager.MakeMetal(loadVector(record.specular), record.parameter); break;
+            case MaterialType::Dielectric: material = materialManager.MakeDielectric(loadVector(record.attenuation), record.parameter); break;
+            case MaterialType::Emissive:   material = materialManager.MakeEmissive(loadVector(record.emitted)); break;
+        }
+        material->diffuse()  = loadVector(record.diffuse);
+        material->specular() = loadVector(record.specular);
+        material->emitted()  = loadVector(record.emitted);
+        createdMaterials.push_back(material);
+    }
+
+    std::vector<std::shared_ptr<const TriangleMesh>> createdMeshes;
+    createdMeshes.reserve(meshes.count);
+    for (const MeshRecord &record : meshes) {
+        auto mesh = std::make_shared<TriangleMesh>();
+        const float *positions = meshPositions.data[record.firstVertex].xyz;
+        mesh->positions.assign(positions, positions + 3 * record.vertexCount);
+        if (record.firstNormal != UINT64_MAX) {
+            const float *normals = meshNormals.data[record.firstNormal].xyz;
+            mesh->normals.assign(normals, normals + 3 * record.vertexCount);
+        }
+        const uint32_t *indices = meshTriangles.data[record.firstTriangle].corners;
+        mesh->indices.assign(indices, indices + 3 * record.triangleCount);
+
+        // One tree per mesh, shared by all of its objects
+        if (record.nodeCount > 0) {
+            const uint32_t *slots = meshSlots.data + record.firstSlot;
+            mesh->assign(loadNodes(meshNodes.data + record.firstNode, record.nodeCount),
+                         std::vector<uint32_t>(slots, slots + record.triangleCount));
+        }
+        else mesh->build();
+        createdMeshes.push_back(std::move(mesh));
+    }
+
+    bool adopt = hasAcceleration && scene.primitives().empty();
+
+    // Objects in section order; the slot records of the scene BVHs index into these
+    std::vector<Primitives *> created[5];
+    auto add = [&](int kind, Primitives *object, const double position[3], uint32_t selected) {
+        object->setSelectFlag(selected != 0);
+        scene.addObject(loadPoint(position), object);
+        if (adopt) created[kind].push_back(object);
+    };
+
+    for (const SphereRecord &record : spheres)
+        add(0, scene.make<SphereObject>(record.radius, createdMaterials[record.material]), record.position, record.selected);
+
+    for (const BoxRecord &record : boxes)
+        add(1, scene.make<CubeObject>(loadVector(record.halfSize), createdMaterials[record.material]), record.position, record.selected);
+
+    for (const PlaneRecord &record : planes) {
+        auto *plane = scene.make<PlaneObject>();
+        plane->setNormal(loadVector(record.normal));
+        plane->setMaterial(createdMaterials[record.material]);
+        add(2, plane, record.position, record.selected);
+    }
+
+    std::vector<gm::IPoint3> vertices;
+    for (const PolygonRecord &record : polygons) {
+        vertices.clear();
+        for (size_t i = 0; i < record.vertexCount; ++i)
+            vertices.push_back(loadPoint(polygonVertices[record.firstVertex + i].xyz));
+        add(3, scene.make<PolygonObject>(vertices, createdMaterials[record.material]), record.position, record.selected);
+    }
+
+    for (const MeshObjectRecord &record : meshObjects) {
+        auto *object = scene.make<TriangleMeshObject>();
+        object->setMaterial(createdMaterials[record.material]);
+        object->setMesh(createdMeshes[record.mesh]);
+        add(4, object, record.position, record.selected);
+    }
+
+    for (const LightRecord &record : lights) {
+        auto *light = scene.make<Light>(loadVector(record.ambient), loadVector(record.diffuse), loadVector(record.specular), record.viewLightPow);
+        scene.addLight(loadPoint(record.position), light);
+    }
+
+    if (adopt) {
+        PrebuiltAcceleration prebuilt;
+        std::vector<Primitives *> *slotLists[3] = { &prebuilt.sphereSlots, &prebuilt.boxSlots, &prebuilt.otherSlots };
+        std::vector<BVHTree::Node> *nodeLists[3] = { &prebuilt.sphereNodes, &prebuilt.boxNodes, &prebuilt.otherNodes };
+        for (int group = 0; group < 3; ++group) {
+            slotLists[group]->reserve(groupSlots[group].count);
+            for (const SlotRecord &slot : groupSlots[group]) {
+                int kind = static_cast<int>(std::find(objectKinds, objectKinds + 5, static_cast<SectionKind>(slot.section)) - objectKinds);
+                slotLists[group]->push_back(created[kind][slot.index]);
+            }
+            *nodeLists[group] = loadNodes(groupNodes[group].data, groupNodes[group].count);
+        }
+        scene.adoptAcceleration(std::move(prebuilt));
+    }
+    return true;
+}
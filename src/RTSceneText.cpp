@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <omp.h>
+
+#include "RTSceneText.h"
+#include "RTMappedFile.h"
+#include "RTTextCursor.h"
+#include "RTMesh.h"
+
+
+namespace {
+
+// Chunks are at least this large, smaller files are parsed by one thread
+constexpr size_t MIN_CHUNK_SIZE   = size_t(1) << 20;
+constexpr int    CHUNKS_PER_THREAD = 4;
+
+enum class MaterialType { Lambertian, Metal, Dielectric, Emissive };
+enum class ObjectType   { Sphere, Plane, Cube, Polygon, TriangleMesh };
+
+struct ParsedMaterial {
+    MaterialType type;
+    float  diffuse[3], specular[3], emitted[3];
+    float  attenuation[3] = { 0.0f, 0.0f, 0.0f };   // dielectric
+    double parameter = 0.0;                         // metal fuzz or dielectric refraction index
+};
+
+struct ParsedObject {
+    ObjectType type;
+    float  position[3];
+    bool   selected;
+    double radius = 0.0;
+    float  vector[3] = { 0.0f, 0.0f, 0.0f };        // plane normal or cube half size
+    size_t firstVertex = 0, vertexCount = 0;        // polygon vertices in the chunk pool
+    std::shared_ptr<TriangleMesh> mesh;
+
+    // An explicit index counts materials from the start of the file; an implicit one counts the
+    // materials of the chunk before the object and is resolved once chunk offsets are known
+    bool    explicitMaterial = false;
+    int64_t material = 0;
+};
+
+struct ParsedLight {
+    float  position[3], ambient[3], diffuse[3], specular[3];
+    double viewLightPow;
+};
+
+// Records of one chunk in file order
+struct Chunk {
+    const char *begin = nullptr, *end = nullptr;
+    std::vector<ParsedMaterial> materials       = {};
+    std::vector<ParsedObject>   objects         = {};
+    std::vector<ParsedLight>    lights          = {};
+    std::vector<float>          polygonVertices = {};
+    std::vector<Primitives *>   created         = {};
+    ObjectArena                 arena           = {};    // holds created, merged into the scene arena in file order
+    bool ok = true;
+};
+
+
+template <typename T, size_t N>
+bool numbers(TextCursor &cursor, T (&values)[N]) {
+    for (T &value : values)
+        if (!cursor.number(value)) return false;
+    return true;
+}
+
+bool flag(TextCursor &cursor, bool &value) {
+    int number = 0;
+    if (!cursor.number(number) || (number != 0 && number != 1)) return false;
+    value = number != 0;
+    return true;
+}
+
+bool materialType(std::string_view word, MaterialType &type) {
+    if (word == "Lambertian") type = MaterialType::Lambertian;
+    else if (word == "Metal") type = MaterialType::Metal;
+    else if (word == "Dielectric") type = MaterialType::Dielectric;
+    else if (word == "Emissive") type = MaterialType::Emissive;
+    else return false;
+    return true;
+}
+
+bool objectType(std::string_view word, ObjectType &type) {
+    if (word == "Sphere") type = ObjectType::Sphere;
+    else if (word == "Plane") type = ObjectType::Plane;
+    else if (word == "Cube") type = ObjectType::Cube;
+    else if (word == "Polygon") type = ObjectType::Polygon;
+    else if (word == "TriangleMesh") type = ObjectType::TriangleMesh;
+    else return false;
+    return true;
+}
+
+bool parseMaterial(TextCursor &cursor, MaterialType type, ParsedMaterial &material) {
+    material.type = type;
+    if (!numbers(cursor, material.diffuse) || !numbers(cursor, material.specular) || !numbers(cursor, material.emitted))
+        return false;
+    if (type == MaterialType::Metal) return cursor.number(material.parameter);
+    if (type == MaterialType::Dielectric) return numbers(cursor, material.attenuation) && cursor.number(material.parameter);
+    return true;
+}
+
+bool parseMesh(TextCursor &cursor, TriangleMesh &mesh) {
+    size_t vertexCount = 0, triangleCount = 0;
+    bool hasNormals = false;
+
+    if (!cursor.number(vertexCount)) return false;
+    mesh.positions.resize(3 * vertexCount);
+    for (float &coordinate : mesh.positions)
+        if (!cursor.number(coordinate)) return false;
+
+    if (!flag(cursor, hasNormals)) return false;
+    if (hasNormals) {
+        mesh.normals.resize(3 * vertexCount);
+        for (float &coordinate : mesh.normals)
+            if (!cursor.number(coordinate)) return false;
+    }
+
+    if (!cursor.number(triangleCount)) return false;
+    mesh.indices.resize(3 * triangleCount);
+    for (uint32_t &index : mesh.indices)
+        if (!cursor.number(index) || index >= vertexCount) return false;
+
+    mesh.build();
+    return true;
+}
+
+bool parseObject(TextCursor &cursor, ObjectType type, Chunk &chunk, ParsedObject &object) {
+    object.type = type;
+    if (!numbers(cursor, object.position) || !flag(cursor, object.selected)) return false;
+
+    switch (type) {
+        case ObjectType::Sphere:
+            if (!cursor.number(object.radius)) return false;
+            break;
+        case ObjectType::Plane:
+        case ObjectType::Cube:
+            if (!numbers(cursor, object.vector)) return false;
+            break;
+        case ObjectType::Polygon:
+            if (!cursor.number(object.vertexCount)) return false;
+            object.firstVertex = chunk.polygonVertices.size() / 3;
+            for (size_t i = 0; i < 3 * object.vertexCount; ++i) {
+                float coordinate = 0.0f;
+                if (!cursor.number(coordinate)) return false;
+                chunk.polygonVertices.push_back(coordinate);
+            }
+            break;
+        case ObjectType::TriangleMesh:
+            object.mesh = std::make_shared<TriangleMesh>();
+            if (!parseMesh(cursor, *object.mesh)) return false;
+            break;
+    }
+
+    if (cursor.atLineEnd()) {
+        object.material = static_cast<int64_t>(chunk.materials.size()) - 1;
+        return true;
+    }
+    object.explicitMaterial = true;
+    return cursor.number(object.material);
+}
+
+void parseChunk(Chunk &chunk) {
+    TextCursor cursor{chunk.begin, chunk.end};
+
+    while (chunk.ok && !cursor.done()) {
+        if (cursor.atLineEnd()) {
+            cursor.skipLine();
+            continue;
+        }
+
+        std::string_view keyword = cursor.word();
+        MaterialType material;
+        ObjectType object;
+
+        if (materialType(keyword, material)) {
+            chunk.materials.emplace_back();
+            chunk.ok = parseMaterial(cursor, material, chunk.materials.back());
+        }
+        else if (objectType(keyword, object)) {
+            chunk.objects.emplace_back();
+            chunk.ok = parseObject(cursor, object, chunk, chunk.objects.back());
+        }
+        else if (keyword == "Light") {
+            ParsedLight &light = chunk.lights.emplace_back();
+            chunk.ok = numbers(cursor, light.position) && numbers(cursor, light.ambient) && numbers(cursor, light.diffuse)
+                    && numbers(cursor, light.specular) && cursor.number(light.viewLightPow);
+        }
+        else chunk.ok = false;
+
+        chunk.ok = chunk.ok && cursor.atLineEnd();
+        cursor.skipLine();
+    }
+}
+
+// Splits [data, data + size) after newlines into about count pieces
+std::vector<Chunk> splitChunks(const char *data, size_t size, size_t count) {
+    std::vector<Chunk> chunks;
+    const char *begin = data, *end = data + size;
+    for (size_t i = 1; i <= count && begin < end; ++i) {
+        const char *split = (i == count) ? end : data + size / count * i;
+        if (split < begin) continue;
+
+        TextCursor cursor{split, end};
+        if (split != end && split != data && split[-1] != '\n') cursor.skipLine();
+        chunks.push_back({ begin, cursor.at });
+        begin = cursor.at;
+    }
+    return chunks;
+}
+
+gm::IVec3f vector3(const float values[3]) {
+    return gm::IVec3f(values[0], values[1], values[2]);
+}
+
+gm::IPoint3 point3(const float values[3]) {
+    return gm::IPoint3(values[0], values[1], values[2]);
+}
+
+Primitives *createObject(const ParsedObject &parsed, Chunk &chunk, RTMaterial *material) {
+    switch (parsed.type) {
+        case ObjectType::Sphere:
+            return chunk.arena.create<SphereObject>(parsed.radius, material);
+        case ObjectType::Plane: {
+            auto *plane = chunk.arena.create<PlaneObject>();
+            plane->setNormal(vector3(parsed.vector));
+            plane->setMaterial(material);
+            return plane;
+        }
+        case ObjectType::Cube:
+            return chunk.arena.create<CubeObject>(vector3(parsed.vector), material);
+        case ObjectType::Polygon: {
+            std::vector<gm::IPoint3> vertices;
+            vertices.reserve(parsed.vertexCount);
+            for (size_t i = 0; i < parsed.vertexCount; ++i)
+                vertices.push_back(point3(&chunk.polygonVertices[3 * (parsed.firstVertex + i)]));
+            return chunk.arena.create<PolygonObject>(vertices, material);
+        }
+        case ObjectType::TriangleMesh:
+            return chunk.arena.create<TriangleMeshObject>(parsed.mesh, material);
+    }
+    return nullptr;
+}
+
+} // namespace
+
+
+bool saveSceneText(const std::string &path, const SceneManager &scene) {
+    std::ofstream file(path);
+    if (!file) return false;
+    file.precision(std::numeric_limits<double>::max_digits10);
+
+    std::unordered_map<const RTMaterial *, size_t> materialIndex;
+    for (const Primitives *object : scene.primitives()) {
+        const RTMaterial *material = object->material();
+        if (!material) return false;
+
+        auto it = materialIndex.find(material);
+        if (it == materialIndex.end()) {
+            it = materialIndex.emplace(material, materialIndex.size()).first;
+            file << *material << '\n';
+        }
+        file << *object << ' ' << it->second << '\n';
+    }
+
+    for (const Light *light : scene.lights())
+        file << *light << '\n';
+    return static_cast<bool>(file.flush());
+}
+
+bool loadSceneText(const std::string &path, SceneManager &scene, RTMaterialManager &materialManager) {
+    MappedFile file(path);
+    if (!file.valid()) return false;
+
+    size_t threads = static_cast<size_t>(std::max(1, omp_get_max_threads()));
+    size_t chunkCount = std::clamp(file.size() / MIN_CHUNK_SIZE, size_t(1), threads * CHUNKS_PER_THREAD);
+    std::vector<Chunk> chunks = splitChunks(file.data(), file.size(), chunkCount);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < static_cast<int>(chunks.size()); ++i)
+        parseChunk(chunks[i]);
+
+    // Material numbering is global, so every chunk needs the count of materials before it
+    std::vector<int64_t> materialOffsets(chunks.size());
+    int64_t materialCount = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (!chunks[i].ok) return false;
+        materialOffsets[i] = materialCount;
+        materialCount += static_cast<int64_t>(chunks[i].materials.size());
+    }
+
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        for (ParsedObject &object : chunks[i].objects) {
+            if (!object.explicitMaterial) object.material += materialOffsets[i];
+            if (object.material < 0 || object.material >= materialCount) return false;
+        }
+    }
+
+    std::vector<RTMaterial *> materials;
+    materials.reserve(static_cast<size_t>(materialCount));
+    for (const Chunk &chunk : chunks) {
+        for (const ParsedMaterial &parsed : chunk.materials) {
+            RTMaterial *material = nullptr;
+            switch (parsed.type) {
+                case MaterialType::Lambertian: material = materialManager.MakeLambertian(vector3(parsed.diffuse)); break;
+                case MaterialType::Metal:      material = materialManager.MakeMetal(vector3(parsed.specular), parsed.parameter); break;
+                case MaterialType::Dielectric: material = materialManager.MakeDielectric(vector3(parsed.attenuation), parsed.parameter); break;
+                case MaterialType::Emissive:   material = materialManager.MakeEmissive(vector3(parsed.emitted)); break;
+            }
+            material->diffuse()  = vector3(parsed.diffuse);
+            material->specular() = vector3(parsed.specular);
+            material->emitted()  = vector3(parsed.emitted);
+            materials.push_back(material);
+        }
+    }
+
+    // Object construction (polygon projections, mesh BVHs) is per chunk as well; the scene lists are filled in order
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < static_cast<int>(chunks.size()); ++i) {
+        Chunk &chunk = chunks[i];
+        chunk.created.reserve(chunk.objects.size());
+        for (const ParsedObject &parsed : chunk.objects) {
+            Primitives *object = createObject(parsed, chunk, materials[static_cast<size_t>(parsed.material)]);
+            object->setSelectFlag(parsed.selected);
+            chunk.created.push_back(object);
+        }
+    }
+
+    for (Chunk &chunk : chunks) {
+        scene.adoptObjects(std::move(chunk.arena));
+        for (size_t i = 0; i < chunk.objects.size(); ++i)
+            scene.addObject(point3(chunk.objects[i].position), chunk.created[i]);
+
+        for (const ParsedLight &parsed : chunk.lights) {
+            auto *light = scene.make<Light>(vector3(parsed.ambient), vector3(parsed.diffuse), vector3(parsed.specular), parsed.viewLightPow);
+            scene.addLight(point3(parsed.position), light);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+
+#include "RTTileScheduler.h"
+
+
+namespace {
+
+uint32_t spreadBits(uint32_t value) {
+    value &= 0x0000ffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+    return value;
+}
+
+uint32_t mortonCode(uint32_t x, uint32_t y) {
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+} // namespace
+
+
+void TileScheduler::build(int screenWidth, int screenHeight, int pixelsPerTile, int alignment, int threadCount) {
+    assert(threadCount > 0);
+
+    alignment = std::max(1, alignment);
+    pixelsPerTile = std::max(1, pixelsPerTile);
+
+    int tileWidth = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(pixelsPerTile))));
+    tileWidth = (tileWidth + alignment - 1) / alignment * alignment;
+    int tileHeight = std::max(1, pixelsPerTile / tileWidth);
+
+    int tilesX = (screenWidth  + tileWidth  - 1) / tileWidth;
+    int tilesY = (screenHeight + tileHeight - 1) / tileHeight;
+
+    std::vector<std::pair<uint32_t, RenderTile>> ordered;
+    ordered.reserve(static_cast<size_t>(std::max(0, tilesX * tilesY)));
+    for (int tileY = 0; tileY < tilesY; ++tileY) {
+        for (int tileX = 0; tileX < tilesX; ++tileX) {
+            RenderTile tile = { tileX * tileWidth, tileY * tileHeight, tileWidth, tileHeight };
+            tile.width  = std::min(tile.width,  screenWidth  - tile.x);
+            tile.height = std::min(tile.height, screenHeight - tile.y);
+            ordered.push_back({ mortonCode(tileX, tileY), tile });
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    tiles_.clear();
+    tiles_.reserve(ordered.size());
+    for (const auto &entry : ordered)
+        tiles_.push_back(entry.second);
+
+    queues_ = std::vector<TileQueue>(threadCount);
+    int total = tileCount();
+    for (int thread = 0; thread < threadCount; ++thread) {
+        queues_[thread].begin = static_cast<int>(static_cast<long long>(total) * thread / threadCount);
+        queues_[thread].end   = static_cast<int>(static_cast<long long>(total) * (thread + 1) / threadCount);
+    }
+    stolenTiles_ = 0;
+}
+
+bool TileScheduler::next(int threadId, RenderTile &tile) {
+    assert(threadId < static_cast<int>(queues_.size()));
+
+    TileQueue &own = queues_[threadId];
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.begin < own.end) {
+                tile = tiles_[own.begin++];
+                return true;
+            }
+        }
+        if (!steal(threadId)) return false;
+    }
+}
+
+bool TileScheduler::steal(int threadId) {
+    // One thief at a time keeps the victim choice and the hand-over consistent; stealing is rare
+    // because every steal takes half of the remaining work.
+    std::lock_guard<std::mutex> stealLock(stealMutex_);
+
+    int victim = -1;
+    int victimSize = 0;
+    for (int thread = 0; thread < static_cast<int>(queues_.size()); ++thread) {
+        if (thread == threadId) continue;
+        std::lock_guard<std::mutex> lock(queues_[thread].mutex);
+        int size = queues_[thread].end - queues_[thread].begin;
+        if (size > victimSize) {
+            victim = thread;
+            victimSize = size;
+        }
+    }
+    if (victim < 0) return false;
+
+    int first = 0, last = 0;
+    {
+        TileQueue &queue = queues_[victim];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.begin >= queue.end) return true;    // drained meanwhile, look again
+
+        last  = queue.end;
+        first = queue.end - (queue.end - queue.begin + 1) / 2;
+        queue.end = first;
+    }
+
+    TileQueue &own = queues_[threadId];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    own.begin = first;
+    own.end   = last;
+    stolenTiles_ += last - first;
+    return true;
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <chrono>
 
 #include "RTObjects.h"
 #include "RayTracer.h"
@@ -7,11 +8,36 @@
 
 SceneManager::~SceneManager() {
     for (Primitives *object : primitives_)
-        delete object;
+        if (!arena_.owns(object)) delete object;
     for (Light *object : directLightSources_)
-        delete object;
+        if (!arena_.owns(object)) delete object;
 }
 
+void Primitives::markDirty() const {
+    if (parent_) parent_->markDirty(this);
+}
+
+void Primitives::markSelectionChanged() const {
+    if (parent_) parent_->selectionChanged(this);
+}
+
+namespace {
+
+template <typename T>
+bool eraseFromList(std::vector<T *> &list, const void *object) {
+    auto it = std::find(list.begin(), list.end(), object);
+    if (it == list.end()) return false;
+    *it = list.back();
+    list.pop_back();
+    return true;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
 const std::vector<Light *> &SceneManager::inderectLightSources() const {
     return directLightSources_;
 }
@@ -25,12 +51,20 @@ void SceneManager::addObject(gm::IPoint3 position, Primitives *object) {
     object->parent_ = this;
     object->position_ = position;
     primitives_.push_back(object);
+    if (object->selected()) selectedPrimitives_.push_back(object);
+    if (!accelerationDirty_) trackObject(object);
+    revision_++;
 }
 
 void SceneManager::eraseObject(Primitives *primitive) {
     auto it = std::find(primitives_.begin(), primitives_.end(), primitive);
     if (it == primitives_.end()) return;
     primitives_.erase(it);
+    eraseFromList(selectedPrimitives_, primitive);
+
+    if (!accelerationDirty_) untrackObject(primitive);
+    primitive->parent_ = nullptr;
+    revision_++;
 }
 
 
@@ -45,6 +79,7 @@ void SceneManager::addLight(gm::IPoint3 position, Light *light) {
     light->setParent(this);
     light->setPosition(position);
     directLightSources_.push_back(light);
+    revision_++;
 }
 
 void SceneManager::addObject(Primitives *object) {
@@ -57,12 +92,232 @@ void SceneManager::addLight(Light *light) {
 
 void SceneManager::clear() {
     for (Primitives *object : primitives_)
-        if (object) delete object;
+        if (object && !arena_.owns(object)) delete object;
     for (Light *object : directLightSources_)
-        if (object) delete object;
+        if (object && !arena_.owns(object)) delete object;
+    arena_.release();
 
     primitives_.clear();
     directLightSources_.clear();
+    selectedPrimitives_.clear();
+    invalidateAcceleration();
+}
+
+void SceneManager::invalidateAcceleration() const {
+    revision_++;
+    accelerationDirty_ = true;
+    dirtyPrimitives_.clear();
+}
+
+void SceneManager::markDirty(const Primitives *object) const {
+    revision_++;
+    if (accelerationDirty_) return;
+    dirtyPrimitives_.push_back(object);
+}
+
+void SceneManager::selectionChanged(const Primitives *object) const {
+    revision_++;
+    eraseFromList(selectedPrimitives_, object);
+    if (object->selected()) selectedPrimitives_.push_back(object);
+}
+
+void SceneManager::trackObject(Primitives *object) const {
+    materials_.idOf(object->material());
+    if (object->boundingBox().isInfinite()) unboundedPrimitives_.push_back(object);
+    else if (spheres_.accepts(object))      spheres_.add(object);
+    else if (boxes_.accepts(object))        boxes_.add(object);
+    else                                    others_.add(object);
+}
+
+void SceneManager::untrackObject(const Primitives *object) const {
+    dirtyPrimitives_.erase(std::remove(dirtyPrimitives_.begin(), dirtyPrimitives_.end(), object), dirtyPrimitives_.end());
+
+    if (spheres_.erase(object) || boxes_.erase(object) || others_.erase(object)) return;
+    eraseFromList(unboundedPrimitives_, object);
+}
+
+bool SceneManager::accelerationValid() const {
+    return !accelerationDirty_ && dirtyPrimitives_.empty();
+}
+
+size_t SceneManager::trackedObjects() const {
+    return spheres_.size() + boxes_.size() + others_.size() + unboundedPrimitives_.size();
+}
+
+void SceneManager::commit() const {
+    auto start = std::chrono::steady_clock::now();
+    accelerationStats_ = {};
+
+    // Light positions can change without notice and the tree is cheap, rebuild it every time.
+    // Emission edits go through raw material pointers, so the emitters are gathered every time as well.
+    lightTree_.build(directLightSources_);
+    gatherEmitters();
+
+    if (accelerationDirty_ || trackedObjects() != primitives_.size()) {
+        rebuildAcceleration();
+        accelerationStats_.rebuildMs = elapsedMs(start);
+        accelerationStats_.fullRebuild = true;
+        return;
+    }
+
+    // Material edits do not mark anything dirty, the table copies are renewed every frame instead
+    materials_.refresh();
+
+    refitAcceleration();
+    accelerationStats_.refitMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    if (spheres_.needsRebuild()) { spheres_.rebuild(materials_); accelerationStats_.rebuiltGroups++; }
+    if (boxes_.needsRebuild())   { boxes_.rebuild(materials_);   accelerationStats_.rebuiltGroups++; }
+    if (others_.needsRebuild())  { others_.rebuild(materials_);  accelerationStats_.rebuiltGroups++; }
+    accelerationStats_.rebuildMs = elapsedMs(start);
+}
+
+void SceneManager::gatherEmitters() const {
+    emitters_.clear();
+    emitterCdf_.clear();
+    emitterPmf_.clear();
+
+    double total = 0.0;
+    for (const Primitives *object : primitives_) {
+        const RTMaterial *material = object->material();
+        if (!material || !material->hasEmmision()) continue;
+
+        gm::IVec3f emitted = material->emitted();
+        double power = (emitted.x() + emitted.y() + emitted.z()) / 3.0 * object->surfaceArea();
+        if (!(power > 0.0)) continue;
+
+        total += power;
+        object->emitterSlot_ = static_cast<int>(emitters_.size());
+        emitters_.push_back(object);
+        emitterCdf_.push_back(total);
+    }
+
+    for (size_t i = 0; i < emitters_.size(); ++i) {
+        double previous = (i == 0) ? 0.0 : emitterCdf_[i - 1];
+        emitterPmf_.push_back((emitterCdf_[i] - previous) / total);
+        emitterCdf_[i] /= total;
+    }
+}
+
+const Primitives *SceneManager::sampleEmitter(double u, double &pmf) const {
+    pmf = 0.0;
+    if (emitters_.empty()) return nullptr;
+
+    size_t index = std::upper_bound(emitterCdf_.begin(), emitterCdf_.end(), u) - emitterCdf_.begin();
+    index = std::min(index, emitters_.size() - 1);
+    pmf = emitterPmf_[index];
+    return emitters_[index];
+}
+
+double SceneManager::emitterPmf(const Primitives *object) const {
+    // Slots of objects that stopped emitting are not reset, they fail the identity check
+    int slot = object->emitterSlot_;
+    if (slot < 0 || slot >= static_cast<int>(emitters_.size()) || emitters_[slot] != object) return 0.0;
+    return emitterPmf_[slot];
+}
+
+void SceneManager::refitAcceleration() const {
+    std::sort(dirtyPrimitives_.begin(), dirtyPrimitives_.end());
+    dirtyPrimitives_.erase(std::unique(dirtyPrimitives_.begin(), dirtyPrimitives_.end()), dirtyPrimitives_.end());
+
+    PrimitiveGroupStats stats;
+    for (const Primitives *object : dirtyPrimitives_) {
+        AABB box = object->boundingBox();
+        Primitives *mutableObject = const_cast<Primitives *>(object);
+        materials_.idOf(object->material());
+
+        // Objects switching between bounded and unbounded are re-tracked from scratch
+        bool unbounded = std::find(unboundedPrimitives_.begin(), unboundedPrimitives_.end(), object) != unboundedPrimitives_.end();
+        if (unbounded != box.isInfinite()) {
+            if (unbounded) eraseFromList(unboundedPrimitives_, object);
+            else           spheres_.erase(object) || boxes_.erase(object) || others_.erase(object);
+            trackObject(mutableObject);
+            continue;
+        }
+        if (unbounded) continue;
+
+        spheres_.update(object, box, materials_, stats);
+        boxes_.update(object, box, materials_, stats);
+        others_.update(object, box, materials_, stats);
+    }
+    dirtyPrimitives_.clear();
+
+    spheres_.refit(materials_, stats);
+    boxes_.refit(materials_, stats);
+    others_.refit(materials_, stats);
+
+    accelerationStats_.refittedObjects = stats.refittedObjects;
+    accelerationStats_.evictedObjects  = stats.evictedObjects;
+    accelerationStats_.rebuiltSubtrees = stats.rebuiltSubtrees;
+}
+
+void SceneManager::rebuildAcceleration() const {
+    std::vector<Primitives *> spheres, boxes, others;
+    unboundedPrimitives_.clear();
+    dirtyPrimitives_.clear();
+    materials_.clear();
+    selectedPrimitives_.clear();
+
+    for (Primitives *object : primitives_) {
+        if (object->selected()) selectedPrimitives_.push_back(object);
+        if (object->boundingBox().isInfinite()) {
+            unboundedPrimitives_.push_back(object);
+            materials_.idOf(object->material());
+        }
+        else if (spheres_.accepts(object))      spheres.push_back(object);
+        else if (boxes_.accepts(object))        boxes.push_back(object);
+        else                                    others.push_back(object);
+    }
+
+    spheres_.build(spheres, materials_);
+    boxes_.build(boxes, materials_);
+    others_.build(others, materials_);
+
+    accelerationDirty_ = false;
+}
+
+bool SceneManager::adoptAcceleration(PrebuiltAcceleration &&prebuilt) const {
+    invalidateAcceleration();
+
+    std::vector<Primitives *> unbounded, bounded;
+    bounded.reserve(primitives_.size());
+    for (Primitives *object : primitives_)
+        (object->boundingBox().isInfinite() ? unbounded : bounded).push_back(object);
+
+    // Every bounded object exactly once, in the group trackObject would pick
+    std::vector<Primitives *> slotted;
+    slotted.reserve(bounded.size());
+    slotted.insert(slotted.end(), prebuilt.sphereSlots.begin(), prebuilt.sphereSlots.end());
+    slotted.insert(slotted.end(), prebuilt.boxSlots.begin(), prebuilt.boxSlots.end());
+    slotted.insert(slotted.end(), prebuilt.otherSlots.begin(), prebuilt.otherSlots.end());
+    std::sort(bounded.begin(), bounded.end());
+    std::sort(slotted.begin(), slotted.end());
+    if (slotted != bounded) return false;
+
+    auto allOf = [](const std::vector<Primitives *> &slots, auto &&predicate) {
+        return std::all_of(slots.begin(), slots.end(), predicate);
+    };
+    if (!allOf(prebuilt.sphereSlots, [&](const Primitives *object) { return spheres_.accepts(object); }) ||
+        !allOf(prebuilt.boxSlots,    [&](const Primitives *object) { return !spheres_.accepts(object) && boxes_.accepts(object); }) ||
+        !allOf(prebuilt.otherSlots,  [&](const Primitives *object) { return !spheres_.accepts(object) && !boxes_.accepts(object); }))
+        return false;
+
+    materials_.clear();
+    if (!spheres_.adopt(prebuilt.sphereSlots, std::move(prebuilt.sphereNodes), materials_) ||
+        !boxes_.adopt(prebuilt.boxSlots, std::move(prebuilt.boxNodes), materials_) ||
+        !others_.adopt(prebuilt.otherSlots, std::move(prebuilt.otherNodes), materials_))
+        return false;
+
+    unboundedPrimitives_ = std::move(unbounded);
+    for (Primitives *object : unboundedPrimitives_)
+        materials_.idOf(object->material());
+    selectedPrimitives_.clear();
+    for (Primitives *object : primitives_)
+        if (object->selected()) selectedPrimitives_.push_back(object);
+
+    accelerationDirty_ = false;
+    return true;
 }
 
 bool SceneManager::hitClosest(const Ray& ray, Interval rayTime, HitRecord& hitRecord, bool hitExpandedState) const {
@@ -73,21 +328,30 @@ bool SceneManager::hitClosest(const Ray& ray, Interval rayTime, HitRecord& hitRe
     double closestExpandedHitTime = rayTime.max;
 
     bool hitAnything = false;
-    
-    for (Primitives *object: primitives_) {
-        if (object->hit(ray, Interval(rayTime.min, closestHitTime), tempRec)) {
-            hitAnything = true;
-            closestHitTime = tempRec.time;
-        }
-    }
 
-    if (hitExpandedState) {
+    if (!accelerationValid()) {
         for (Primitives *object: primitives_) {
-            if (object->hitExpanded(ray, Interval(rayTime.min, closestExpandedHitTime), expandedRec)) {
+            if (object->hit(ray, Interval(rayTime.min, closestHitTime), tempRec)) {
+                hitAnything = true;
+                closestHitTime = tempRec.time;
+            }
+        }
+    } else {
+        for (Primitives *object: unboundedPrimitives_) {
+            if (object->hit(ray, Interval(rayTime.min, closestHitTime), tempRec)) {
                 hitAnything = true;
-                closestExpandedHitTime = expandedRec.time;
+                closestHitTime = tempRec.time;
             }
         }
+
+        hitAnything |= spheres_.hitClosest(ray, rayTime.min, closestHitTime, tempRec, materials_);
+        hitAnything |= boxes_.hitClosest(ray, rayTime.min, closestHitTime, tempRec, materials_);
+        hitAnything |= others_.hitClosest(ray, rayTime.min, closestHitTime, tempRec, materials_);
+    }
+
+    if (hitExpandedState && hitSelected(ray, rayTime, expandedRec)) {
+        hitAnything = true;
+        closestExpandedHitTime = expandedRec.time;
     }
 
     if (closestExpandedHitTime < closestHitTime) {
@@ -96,5 +360,109 @@ bool SceneManager::hitClosest(const Ray& ray, Interval rayTime, HitRecord& hitRe
         hitRecord = tempRec;
     }
 
+    if (hitAnything) resolveMaterial(hitRecord);
+    return hitAnything;
+}
+
+// Virtual hits only set the material pointer, and a record may carry the id of an earlier, farther hit
+void SceneManager::resolveMaterial(HitRecord &hitRecord) const {
+    uint32_t id = hitRecord.materialId;
+    if (id < materials_.size() && materials_.material(id) == hitRecord.material) return;
+    hitRecord.materialId = materials_.find(hitRecord.material);
+}
+
+bool SceneManager::occluded(const Ray& ray, Interval rayTime, const Primitives *ignore) const {
+    if (!accelerationValid()) {
+        for (Primitives *object : primitives_)
+            if (object != ignore && object->occludes(ray, rayTime)) return true;
+        return false;
+    }
+
+    for (Primitives *object : unboundedPrimitives_)
+        if (object != ignore && object->occludes(ray, rayTime)) return true;
+
+    return spheres_.occluded(ray, rayTime.min, rayTime.max, ignore) ||
+           boxes_.occluded(ray, rayTime.min, rayTime.max, ignore)   ||
+           others_.occluded(ray, rayTime.min, rayTime.max, ignore);
+}
+
+// Until commit() the list may hold objects removed through primitives(), scan the list itself then
+bool SceneManager::hitSelected(const Ray& ray, Interval rayTime, HitRecord& hitRecord) const {
+    double closestHitTime = rayTime.max;
+    bool hitAnything = false;
+
+    if (!accelerationValid()) {
+        for (Primitives *object: primitives_) {
+            if (object->hitExpanded(ray, Interval(rayTime.min, closestHitTime), hitRecord)) {
+                hitAnything = true;
+                closestHitTime = hitRecord.time;
+            }
+        }
+        return hitAnything;
+    }
+
+    for (const Primitives *object: selectedPrimitives_) {
+        if (object->hitExpanded(ray, Interval(rayTime.min, closestHitTime), hitRecord)) {
+            hitAnything = true;
+            closestHitTime = hitRecord.time;
+        }
+    }
+
     return hitAnything;
-}
\ No newline at end of file
+}
+
+template <int N>
+void SceneManager::hitClosestPacket(const Ray *rays, int count, Interval rayTime, HitRecord *hitRecords, bool *hits, bool hitExpandedState) const {
+    assert(count <= N);
+
+    enum GroupId { SPHERES, BOXES, OTHERS };
+
+    RayPacket<N> packet;
+    packet.load(rays, count, rayTime);
+
+    if (!accelerationValid() || !packet.coherent()) {
+        for (int lane = 0; lane < count; ++lane)
+            hits[lane] = hitClosest(rays[lane], rayTime, hitRecords[lane], hitExpandedState);
+        return;
+    }
+
+    for (int lane = 0; lane < count; ++lane) {
+        for (Primitives *object : unboundedPrimitives_) {
+            if (object->hit(rays[lane], Interval(rayTime.min, packet.tMax[lane]), packet.records[lane])) {
+                packet.tMax[lane] = packet.records[lane].time;
+                packet.hitGroup[lane] = RayPacket<N>::VIRTUAL_HIT;
+            }
+        }
+    }
+
+    spheres_.hitPacket(packet, SPHERES);
+    boxes_.hitPacket(packet, BOXES);
+    others_.hitPacket(packet, OTHERS);
+
+    for (int lane = 0; lane < count; ++lane) {
+        HitRecord &rec = packet.records[lane];
+        switch (packet.hitGroup[lane]) {
+            case SPHERES: spheres_.fillPacketRecord(packet, lane, rec, materials_); break;
+            case BOXES:   boxes_.fillPacketRecord(packet, lane, rec, materials_);   break;
+            case OTHERS:  others_.fillPacketRecord(packet, lane, rec, materials_);  break;
+            default: break;
+        }
+
+        bool hitAnything = packet.hitGroup[lane] != RayPacket<N>::NO_HIT;
+        double closestHitTime = packet.tMax[lane];
+
+        HitRecord expandedRec = {};
+        if (hitExpandedState && hitSelected(rays[lane], rayTime, expandedRec)) {
+            if (!hitAnything || expandedRec.time < closestHitTime) rec = expandedRec;
+            hitAnything = true;
+        }
+
+        if (hitAnything) resolveMaterial(rec);
+        hits[lane] = hitAnything;
+        hitRecords[lane] = hitAnything ? rec : HitRecord{};
+    }
+}
+
+template void SceneManager::hitClosestPacket<4>(const Ray *, int, Interval, HitRecord *, bool *, bool) const;
+template void SceneManager::hitClosestPacket<8>(const Ray *, int, Interval, HitRecord *, bool *, bool) const;
+template void SceneManager::hitClosestPacket<16>(const Ray *, int, Interval, HitRecord *, bool *, bool) const;
\ No newline at end of file